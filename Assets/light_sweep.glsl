@@ -0,0 +1,136 @@
+#version 460
+
+#pragma multi_compile LIGHT_DIRECTIONAL LIGHT_SPOT LIGHT_POINT
+#pragma multi_compile MASK
+
+// Propagates light through the illumination texture one slice at a time, see Volume::RestartPass
+// Every texel steps back along its ray to the previous slice, reads the transmittance there and attenuates it by the
+// density of the voxels in between. Each voxel is read about once per bake instead of once per shadow ray that crosses it.
+
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
+layout(r16, binding = 0) uniform image3D volume;
+layout(r16f, binding = 1) uniform image3D illumination;
+layout(r16f, binding = 3) uniform image3D transmittance;
+#ifdef MASK
+layout(r8ui, binding = 2) uniform uimage3D mask;
+uniform int MaskBits;
+uniform int MaskLevel;
+#endif
+
+uniform float Threshold;
+uniform float Density;
+uniform float WindowMin;
+uniform float WindowMax;
+
+uniform vec3 WorldScale;
+uniform vec3 TexelSize;
+// voxels per illumination texel along each axis
+uniform float IlluminationScale;
+uniform ivec3 IlluminationSize;
+
+// the two axes spanning a slice and the axis the sweep moves along
+uniform ivec3 SweepAxes;
+uniform int Slice;
+// +1 or -1, the direction the light travels along the sweep axis
+uniform int SliceStep;
+// the slice the sweep started at, nothing lies between it and the light
+uniform int FirstSlice;
+
+uniform float LightDensity;
+uniform vec3 LightPosition;
+uniform vec3 LightDirection;
+uniform float LightAngle;
+uniform float LightAmbient;
+uniform float LightIntensity;
+
+// density of the voxel at p, the same as Extinction(p) in volume.glsl
+float Extinction(vec3 p) {
+	ivec3 v = ivec3(round(p));
+	float s = imageLoad(volume, v).r;
+	s = clamp((s - WindowMin) / max(WindowMax - WindowMin, 1e-6), 0.0, 1.0);
+
+	#ifdef MASK
+	ivec3 mp = v << MaskLevel;
+	uint m = MaskBits == 1 ? (imageLoad(mask, ivec3(mp.x >> 3, mp.yz)).r >> (mp.x & 7)) & 1u : imageLoad(mask, mp).r;
+	s = m != 0u ? s : 0.0;
+	#endif
+
+	return max(0.0, (s - Threshold) / (1.0 - Threshold)) * Density;
+}
+
+ivec3 SliceTexel(int x, int y, int slice) {
+	ivec3 t;
+	t[SweepAxes.x] = x;
+	t[SweepAxes.y] = y;
+	t[SweepAxes.z] = slice;
+	return t;
+}
+
+// Bilinear transmittance of a slice at illumination texel coordinates uv, 1 outside the volume
+float LoadTransmittance(vec2 uv, int slice) {
+	ivec2 size = ivec2(IlluminationSize[SweepAxes.x], IlluminationSize[SweepAxes.y]);
+	if (any(lessThan(uv, vec2(-.5))) || any(greaterThan(uv, vec2(size) - .5))) return 1.0;
+
+	uv = clamp(uv, vec2(0.0), vec2(size - 1));
+	ivec2 i0 = ivec2(floor(uv));
+	ivec2 i1 = min(i0 + 1, size - 1);
+	vec2 f = uv - vec2(i0);
+	float a = mix(imageLoad(transmittance, SliceTexel(i0.x, i0.y, slice)).r, imageLoad(transmittance, SliceTexel(i1.x, i0.y, slice)).r, f.x);
+	float b = mix(imageLoad(transmittance, SliceTexel(i0.x, i1.y, slice)).r, imageLoad(transmittance, SliceTexel(i1.x, i1.y, slice)).r, f.x);
+	return mix(a, b, f.y);
+}
+
+void main() {
+	ivec3 texel = SliceTexel(int(gl_GlobalInvocationID.x), int(gl_GlobalInvocationID.y), Slice);
+	if (any(greaterThanEqual(texel, IlluminationSize))) return;
+
+	// centre of the texel, in voxels
+	vec3 p = (vec3(texel) + .5) * IlluminationScale - .5;
+
+	// direction the light travels, in voxels
+	#ifdef LIGHT_DIRECTIONAL
+	vec3 d = normalize(LightDirection / WorldScale) / TexelSize;
+	#else
+	vec3 lp = (LightPosition / WorldScale + vec3(.5)) / TexelSize;
+	vec3 d = p - lp;
+	#endif
+
+	// step back along the ray to the previous slice
+	float t = 1.0;
+	float da = d[SweepAxes.z] * float(SliceStep);
+	if (Slice != FirstSlice && da > 1e-4) {
+		vec3 q = p - d * (IlluminationScale / da);
+		vec3 qt = (q + .5) / IlluminationScale - .5;
+		float prev = LoadTransmittance(vec2(qt[SweepAxes.x], qt[SweepAxes.y]), Slice - SliceStep);
+
+		// the density of every voxel the segment crosses, sampled a voxel apart so thin occluders between coarse
+		// illumination texels still cast shadows. Rays almost parallel to the slices are capped.
+		vec3 e = abs(p - q);
+		int n = clamp(int(ceil(max(e.x, max(e.y, e.z)))), 1, 64);
+		float sum = 0.0;
+		for (int i = 0; i < n; i++)
+			sum += Extinction(mix(q, p, (float(i) + .5) / float(n)));
+
+		float len = length((p - q) * TexelSize * WorldScale);
+		t = prev * exp(-sum / float(n) * LightDensity * len);
+	}
+	imageStore(transmittance, texel, vec4(t));
+
+	#if defined(LIGHT_DIRECTIONAL)
+	float light = t * LightIntensity + LightAmbient;
+	#elif defined(LIGHT_SPOT) || defined(LIGHT_POINT)
+	vec3 wp = (p * TexelSize - vec3(.5)) * WorldScale;
+	vec3 ldir = wp - LightPosition;
+	float dist = length(ldir);
+	ldir /= dist;
+	dist = 75.0 * dist + 1.0;
+	float light = t * LightIntensity / (dist * dist)
+	#ifdef LIGHT_SPOT
+		* clamp(10.0 * (max(0.0, dot(LightDirection, -ldir)) - LightAngle), 0.0, 1.0)
+	#endif
+		+ LightAmbient;
+	#else
+	float light = 1.0;
+	#endif
+	imageStore(illumination, texel, vec4(light));
+}
\ No newline at end of file
@@ -1,6 +1,9 @@
 #version 460
 
 #pragma multi_compile SAMPLECOUNT
+#pragma multi_compile BRICKED
+#pragma multi_compile ILLUMINATION
+#pragma multi_compile PREINTEGRATED
 
 out vec4 FragColor;
 
@@ -20,8 +23,76 @@ uniform vec3 CameraPosition;
 uniform vec3 PlanePoint;
 uniform vec3 PlaneNormal;
 
+// light l as l / (1 + l) unless there is an illumination texture, and the texel value, see volume.glsl
 uniform sampler3D Volume;
+// texel values mapped to intensities 0 and 1, applied here so windowing doesn't need a new bake
+uniform float WindowMin;
+uniform float WindowMax;
 uniform sampler2D DepthTexture;
+// TransferFunction::Table, colour and extinction by intensity
+uniform sampler2D Transfer;
+uniform float TransferSize;
+
+#ifdef PREINTEGRATED
+// TransferFunction::Preintegrate, by the intensity at the front and the back of a segment
+uniform sampler2D Preintegrated;
+uniform float PreintegratedSize;
+// segment length the opacities of the transfer function are meant for
+uniform float ReferenceStep;
+#endif
+
+#ifdef ILLUMINATION
+// lighting baked at a lower resolution than Volume, see Volume::IlluminationLevel
+uniform sampler3D Illumination;
+// the illumination texture covers a little more than the volume when its size isn't a multiple of the scale
+uniform vec3 IlluminationScale;
+#endif
+
+// intensity of a texel value, masked out voxels are baked as 0 which stays 0 unless the window reaches below it
+float Window(float s) {
+	return clamp((s - WindowMin) / max(WindowMax - WindowMin, 1e-6), 0.0, 1.0);
+}
+
+#ifdef BRICKED
+// Volume is the baked brick atlas, see BrickCache.hpp
+#define BRICK_SIZE 64
+#define BRICK_BORDER 1
+#define BRICK_INTERIOR 62
+#define PAGE_EMPTY 0x80000000u
+uniform usampler3D PageTable;
+uniform ivec3 AtlasSlots;
+uniform ivec3 BrickCount;
+uniform vec3 VolumeSize;
+uniform uint Frame;
+// frame each brick was last entered by a ray
+layout(std430, binding = 0) buffer Feedback { uint BrickFrame[]; };
+int lastBrick = -1;
+
+vec2 SampleVolume(vec3 p) {
+	vec3 v = clamp(p * VolumeSize - .5, vec3(0.0), VolumeSize - 1.0);
+	ivec3 b = min(ivec3(v) / BRICK_INTERIOR, BrickCount - 1);
+	uint e = texelFetch(PageTable, b, 0).r;
+	if ((e & PAGE_EMPTY) != 0u) return vec2(0.0);
+
+	int brick = b.x + BrickCount.x * (b.y + BrickCount.y * b.z);
+	if (brick != lastBrick) {
+		BrickFrame[brick] = Frame;
+		lastBrick = brick;
+	}
+	if (e == 0u) return vec2(0.0);
+
+	int slot = int(e - 1u);
+	ivec3 sc = ivec3(slot % AtlasSlots.x, (slot / AtlasSlots.x) % AtlasSlots.y, slot / (AtlasSlots.x * AtlasSlots.y));
+	vec3 t = vec3(sc * BRICK_SIZE) + v - vec3(b * BRICK_INTERIOR) + float(BRICK_BORDER) + .5;
+	vec2 ls = textureLod(Volume, t / vec3(AtlasSlots * BRICK_SIZE), 0.0).rg;
+	return vec2(ls.r, Window(ls.g));
+}
+#else
+vec2 SampleVolume(vec3 p) {
+	vec2 ls = textureLod(Volume, p, 0.0).rg;
+	return vec2(ls.r, Window(ls.g));
+}
+#endif
 
 vec2 RayCube(vec3 ro, vec3 rd, vec3 extents) {
     vec3 tMin = (-extents - ro) / rd;
@@ -48,17 +119,36 @@ float DepthTextureToObjectDepth(vec3 ro, vec3 screenPos) {
 	return length((ViewToObject * viewSpacePosition).xyz - ro);
 }
 
+float Light(vec3 p, vec2 ls) {
+	#ifdef ILLUMINATION
+	return textureLod(Illumination, p * IlluminationScale, 0.0).r;
+	#else
+	return ls.r / max(1.0 - ls.r, 1e-4);
+	#endif
+}
+
 vec4 Sample(vec3 p) {
-	vec4 s;
+	vec2 ls = SampleVolume(p);
+	// the first and last entries sit at intensity 0 and 1
+	vec4 s = textureLod(Transfer, vec2((ls.g * (TransferSize - 1.0) + .5) / TransferSize, .5), 0.0);
 
-	vec2 ra = textureLod(Volume, p, 0.0).rg;
-	s.rgb = vec3(ra.r);
-	s.a = ra.g;
+	s.rgb = min(s.rgb * Light(p, ls), vec3(1.0));
 	s.a = (dot((p - .5) - PlanePoint, PlaneNormal) < 0) ? 0 : s.a;
 
 	return s;
 }
 
+#ifdef PREINTEGRATED
+// The segment of length dt ending at p, premultiplied, front is the intensity at its start
+vec4 Segment(vec3 p, float front, vec2 ls, float dt) {
+	vec4 c = textureLod(Preintegrated, (vec2(front, ls.g) * (PreintegratedSize - 1.0) + .5) / PreintegratedSize, 0.0);
+	float a = 1.0 - exp(-c.a * dt / ReferenceStep);
+	a = (dot((p - .5) - PlanePoint, PlaneNormal) < 0) ? 0 : a;
+	vec3 rgb = min(c.rgb / max(c.a, 1e-6) * Light(p, ls), vec3(1.0));
+	return vec4(rgb * a, a);
+}
+#endif
+
 void main() {
 	vec3 ro = CameraPosition;
 	vec3 rd = normalize(i.rd.xyz);
@@ -77,6 +167,28 @@ void main() {
 	vec4 sum = vec4(0);
 
 	uint steps = 0;
+
+	#ifdef PREINTEGRATED
+	// whole segments between samples are classified, so features thinner than a step still show up and there's no
+	// entrance to look for
+	float front = SampleVolume(ro + rd * intersect.x).g;
+	float dt = StepSize;
+	for (float t = intersect.x; t < intersect.y;) {
+		if (sum.a > .98 || steps > 750) break;
+
+		dt = min(dt, intersect.y - t);
+		vec3 p = ro + rd * (t + dt);
+		vec2 ls = SampleVolume(p);
+		vec4 col = Segment(p, front, ls, dt);
+		sum += col * (1 - sum.a);
+
+		steps++;
+
+		front = ls.g;
+		t += dt;
+		dt = col.a > .01 ? StepSize : StepSize * 4; // step farther if not in dense part
+	}
+	#else
 	float pd = 0;
 	for (float t = intersect.x; t < intersect.y;) {
 		if (sum.a > .98 || steps > 750) break;
@@ -109,6 +221,7 @@ void main() {
 		pd = col.a;
 		t += col.a > .01 ? StepSize : StepSize * 4; // step farther if not in dense part
 	}
+	#endif
 
 	#ifdef SAMPLECOUNT
 	FragColor = vec4(mix(vec3(.2, .2, 1.0), vec3(1.0, .2, .2), float(steps) / 750.0), 1.0);
@@ -2,17 +2,53 @@
 
 #pragma multi_compile LIGHT_DIRECTIONAL LIGHT_SPOT LIGHT_POINT
 #pragma multi_compile MASK
+#pragma multi_compile BRICKED
+#pragma multi_compile ILLUMINATION
 
 layout(local_size_x = 8, local_size_y = 8, local_size_z = 8) in;
-layout(rg16, binding = 0) uniform image3D volume;
+layout(r16, binding = 0) uniform image3D volume;
+#ifdef ILLUMINATION
+// lighting alone, at a fraction of the volume resolution
+layout(r16f, binding = 1) uniform image3D illumination;
+#else
+// light l as l / (1 + l) and the texel value, the window and the transfer function are applied while raymarching
 layout(rg16, binding = 1) uniform image3D baked;
-
-uniform float Exposure;
+#endif
+#ifdef MASK
+// 8 voxels per texel along x when MaskBits is 1, segment numbers when it is 8
+layout(r8ui, binding = 2) uniform uimage3D mask;
+uniform int MaskBits;
+// pyramid level of the volume, the mask is at level 0
+uniform int MaskLevel;
+#endif
+
+#ifdef BRICKED
+// see BrickedVolume.hpp and BrickCache.hpp, the volume and baked images are brick atlases
+#define BRICK_SIZE 64
+#define BRICK_BORDER 1
+#define BRICK_INTERIOR 62
+#define PAGE_EMPTY 0x80000000u
+layout(r32ui, binding = 3) uniform uimage3D pageTable;
+uniform ivec3 AtlasSlots;
+uniform ivec3 VolumeSize;
+// first voxel (border included) and atlas texel of the brick being baked
+uniform ivec3 BrickVoxel;
+uniform ivec3 BrickTexel;
+#endif
+
+// the extinction of TransferFunction, for the shadows
 uniform float Threshold;
 uniform float Density;
+// texel values mapped to 0 and 1
+uniform float WindowMin;
+uniform float WindowMax;
 
 uniform vec3 WorldScale;
 uniform vec3 TexelSize;
+// first voxel (or illumination texel) of the region being baked, unbricked volumes only
+uniform ivec3 BakeOffset;
+// voxels per illumination texel along each axis
+uniform float IlluminationScale;
 
 uniform float LightDensity;
 uniform vec3 LightPosition;
@@ -21,22 +57,45 @@ uniform float LightAngle;
 uniform float LightAmbient;
 uniform float LightIntensity;
 
-vec2 Sample(ivec3 p) {
-	vec2 s = imageLoad(volume, p).rg;
+float LoadVoxel(ivec3 p) {
+	#ifdef BRICKED
+	// bricks that aren't resident are empty until they stream in
+	p = clamp(p, ivec3(0), VolumeSize - 1);
+	ivec3 b = p / BRICK_INTERIOR;
+	uint e = imageLoad(pageTable, b).r;
+	if (e == 0u || (e & PAGE_EMPTY) != 0u) return 0.0;
+	int slot = int(e - 1u);
+	ivec3 sc = ivec3(slot % AtlasSlots.x, (slot / AtlasSlots.x) % AtlasSlots.y, slot / (AtlasSlots.x * AtlasSlots.y));
+	return imageLoad(volume, sc * BRICK_SIZE + p - b * BRICK_INTERIOR + BRICK_BORDER).r;
+	#else
+	return imageLoad(volume, p).r;
+	#endif
+}
 
-	#ifdef INVERT
-	s.r = 1 - s.r;
+// s at voxel p, 0 outside the mask
+float Masked(ivec3 p, float s) {
+	#ifdef MASK
+	ivec3 mp = p << MaskLevel;
+	uint m = MaskBits == 1 ? (imageLoad(mask, ivec3(mp.x >> 3, mp.yz)).r >> (mp.x & 7)) & 1u : imageLoad(mask, mp).r;
+	s = m != 0u ? s : 0.0;
 	#endif
+	return s;
+}
+
+// windowed intensity, 0 outside the mask
+float Intensity(ivec3 p) {
+	float s = LoadVoxel(p);
+	s = clamp((s - WindowMin) / max(WindowMax - WindowMin, 1e-6), 0.0, 1.0);
 
-	#ifndef MASK
-	s.g = s.r;
+	#ifdef INVERT
+	s = 1 - s;
 	#endif
 
-	s.g = max(0.0, (s.g - Threshold) / (1.0 - Threshold)); // subtractive for soft edges
-	s.g *= Density;
+	return Masked(p, s);
+}
 
-	s.r *= Exposure;
-	return s;
+float Extinction(ivec3 p) {
+	return max(0.0, (Intensity(p) - Threshold) / (1.0 - Threshold)) * Density; // subtractive for soft edges
 }
 
 float Light(vec3 p) {
@@ -49,7 +108,7 @@ float Light(vec3 p) {
 	vec3 uvwldir = -normalize(LightDirection / WorldScale) / TexelSize;
 	float ld = 0.0;
 	for (uint i = 1; i < ls; i++)
-		ld += Sample(ivec3(p + uvwldir * ldt * i)).g;
+		ld += Extinction(ivec3(p + uvwldir * ldt * i));
 
 	return exp(-ld * LightDensity * ldt) * LightIntensity + LightAmbient; // extinction = e^(-x)
 
@@ -65,7 +124,7 @@ float Light(vec3 p) {
 	// sum density towards the light source
 	float ld = 0.0;
 	for (uint i = 1; i <= ls; i++)
-		ld += Sample(ivec3(mix(p, lp, float(i) / float(ls)))).g;
+		ld += Extinction(ivec3(mix(p, lp, float(i) / float(ls))));
 
 	dist = 75.0 * dist + 1.0;
 
@@ -84,9 +143,23 @@ float Light(vec3 p) {
 }
 
 void main() {
-	ivec3 index = ivec3(gl_GlobalInvocationID.xyz);
+	#ifdef ILLUMINATION
+	ivec3 texel = BakeOffset + ivec3(gl_GlobalInvocationID.xyz);
+	// lit at the centre of the voxels the texel covers
+	imageStore(illumination, texel, vec4(Light((vec3(texel) + .5) * IlluminationScale - .5)));
+	#else
 
-	vec2 s = Sample(index);
-	s.r *= Light(vec3(index));
-	imageStore(baked, index, vec4(s, 0.0, 0.0));
+	#ifdef BRICKED
+	// one brick per dispatch, borders included so the atlas filters across bricks
+	ivec3 index = BrickVoxel + ivec3(gl_GlobalInvocationID.xyz);
+	ivec3 texel = BrickTexel + ivec3(gl_GlobalInvocationID.xyz);
+	#else
+	ivec3 index = BakeOffset + ivec3(gl_GlobalInvocationID.xyz);
+	ivec3 texel = index;
+	#endif
+
+	// Light() is 1 without a light keyword, the lighting is in the illumination texture then
+	float l = Light(vec3(index));
+	imageStore(baked, texel, vec4(l / (1.0 + l), Masked(index, LoadVoxel(index)), 0.0, 0.0));
+	#endif
 }
\ No newline at end of file
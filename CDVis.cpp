@@ -1,6 +1,8 @@
 ﻿#include <iostream>
 #include <chrono>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <thread>
 
 #include <gl/glew.h>
@@ -30,8 +32,12 @@
 #include "Pipeline/Shader.hpp"
 #include "Pipeline/Mesh.hpp"
 #include "Pipeline/Texture.hpp"
+#include "Util/Benchmark.hpp"
+#include "Util/CineVolume.hpp"
 #include "Util/FileBrowser.hpp"
 #include "Util/ImageLoader.hpp"
+#include "Util/ThreadPool.hpp"
+#include "Util/VolumeResampler.hpp"
 #include "Util/Util.hpp"
 
 using namespace std;
@@ -74,6 +80,16 @@ shared_ptr<Camera> gCamera;
 shared_ptr<Camera> gLeftEye;
 shared_ptr<Camera> gRightEye;
 vector<shared_ptr<Volume>> gVolumes;
+shared_ptr<VolumeStream> gVolumeStream;
+// mask decoding for the current volume, dropped when the volume changes
+shared_ptr<MaskStream> gMaskStream;
+// downsampled copies of the current volume, [ and ] switch between them
+shared_ptr<VolumePyramid> gVolumePyramid;
+unsigned int gVolumeLevel = 0;
+// slices of the current volume, masks are placed on them
+SliceGrid gVolumeGrid;
+// time series loaded with C, drawn by gVolumes[0] instead of a static volume
+shared_ptr<CineVolume> gCine;
 
 vector<shared_ptr<VRDevice>> vrDevices;
 unordered_map<string, shared_ptr<Mesh>> vrMeshes;
@@ -94,6 +110,9 @@ void Error(int error, const char* desc) {
 }
 
 int main(int argc, char** argv) {
+	if (argc > 1 && string(argv[1]) == "--benchmark" && !BenchmarkNeedsContext(argc - 2, argv + 2))
+		exit(RunBenchmark(argc - 2, argv + 2));
+
 	glfwSetErrorCallback(Error);
 
 	if (!glfwInit()) {
@@ -140,6 +159,13 @@ int main(int argc, char** argv) {
 		exit(EXIT_FAILURE);
 	}
 
+	if (argc > 1 && string(argv[1]) == "--benchmark") {
+		int result = RunBenchmark(argc - 2, argv + 2);
+		glfwDestroyWindow(gWindow);
+		glfwTerminate();
+		exit(result);
+	}
+
 	memset(gMouse, 0, 5 * sizeof(bool));
 
 	InitScene();
@@ -281,6 +307,7 @@ void InitScene() {
 	gLight->Shader(AssetDatabase::gTexturedShader);
 	gLight->Uniform("Color", vec4(.05f, .05f, .05f, 1.f));
 	gLight->EnableKeyword("NOTEXTURE");
+	gLight->LocalPosition(v->LightPosition());
 	gScene.push_back(gLight);
 
 	if (!InitVR()) {
@@ -296,6 +323,9 @@ void Cleanup() {
 	gCamera.reset();
 	gScene.clear();
 	gScreenQuadMesh.reset();
+	gVolumeStream.reset();
+	gVolumePyramid.reset();
+	gCine.reset();
 	gVolumes.clear();
 	vrTextures.clear();
 	vrMeshes.clear();
@@ -314,28 +344,158 @@ void MouseMove(GLFWwindow* window, double x, double y) {
 void Mouse(GLFWwindow* window, int btn, int action, int mods) {
 	gMouse[btn] = action == GLFW_PRESS;
 }
+#ifndef WINDOWS
+// folders typed on the console, read on their own thread so rendering and the VR compositor carry on meanwhile
+mutex gPromptMutex;
+vector<pair<void(*)(const string&), string>> gPromptedFolders;
+atomic<bool> gPrompting(false);
+#endif
+
+// Asks for a folder and passes it to then on the render thread, from Update() when it is read from the console
+void PromptFolder(const char* prompt, void(*then)(const string&)) {
+	#ifdef WINDOWS
+	then(BrowseFolder(GetForegroundWindow()));
+	#else
+	if (gPrompting.exchange(true)) return;
+	thread([prompt, then]() {
+		printf("%s: ", prompt);
+		fflush(stdout);
+		string folder;
+		getline(cin, folder);
+		lock_guard<mutex> lock(gPromptMutex);
+		gPromptedFolders.push_back(make_pair(then, folder));
+		gPrompting = false;
+	}).detach();
+	#endif
+}
+
+void OpenVolume(const string& folder) {
+	if (folder.empty()) return;
+
+	// bricked volumes stream from disk instead, written with B
+	shared_ptr<BrickedVolume> bricked = BrickedVolume::Open(folder);
+	if (!bricked) bricked = BrickedVolume::Open(folder + "/volume.cdbrick");
+	if (bricked) {
+		if (gVolumeStream) gVolumeStream->Cancel();
+		gVolumePyramid.reset();
+		gVolumeGrid = SliceGrid();
+		gCine.reset();
+		gMaskStream.reset();
+		gVolumes[0]->Bricks(shared_ptr<BrickCache>(new BrickCache(bricked, VolumePyramid::sBudget)));
+		gVolumes[0]->Stats(bricked->Stats());
+		gVolumes[0]->LocalScale(bricked->Size());
+		return;
+	}
+
+	// the current volume keeps rendering until the new texture exists, then the slabs show up as they are uploaded
+	if (gVolumeStream) gVolumeStream->Cancel();
+	gCine.reset();
+	gVolumeStream = ImageLoader::StreamVolume(folder);
+}
+void OpenCine(const string& folder) {
+	if (folder.empty()) return;
+
+	if (gVolumeStream) gVolumeStream->Cancel();
+	gVolumes[0]->Mask(nullptr);
+	gMaskStream.reset();
+	gCine = CineVolume::Load(folder);
+}
+void WriteBricks(const string& folder) {
+	if (folder.empty() || !gVolumePyramid) return;
+
+	shared_ptr<VolumePyramid> pyramid = gVolumePyramid;
+	vec3 size = gVolumes[0]->LocalScale();
+	VolumeStats stats = gVolumes[0]->Stats();
+	ThreadPool::Shared().Enqueue([pyramid, size, stats, folder]() {
+		const VolumePyramid::Level& l = pyramid->GetLevel(0);
+		BrickedVolume::Write(folder + "/volume.cdbrick", l.mVoxels, l.mWidth, l.mHeight, l.mDepth, size, stats);
+	});
+}
+void OpenMask(const string& folder) {
+	gMaskStream.reset();
+	if (folder.empty() || !gVolumes[0]->Texture() || gVolumeGrid.mPositions.empty()) {
+		gVolumes[0]->Mask(nullptr);
+		return;
+	}
+	// masks are always read at full resolution, coarser pyramid levels sample them sparsely
+	// Decoded on the loader threads, the current mask stays until the new one is there.
+	gMaskStream = ImageLoader::StreamMask(folder, gVolumeGrid);
+}
+
 void Key(GLFWwindow* window, int key, int scancode, int action, int mods) {
 	if (action == GLFW_PRESS) {
 		gKeys[key] = true;
 		switch (key) {
-		case GLFW_KEY_O: {
-			#ifdef WINDOWS
-			string folder = BrowseFolder(GetForegroundWindow());
-			#endif
-			if (folder.empty()) break;
-
-			vec3 size;
-			gVolumes[0]->Texture(ImageLoader::LoadVolume(folder, size));
-			gVolumes[0]->LocalScale(size);
-
+		case GLFW_KEY_O:
+			PromptFolder("Folder", OpenVolume);
+			break;
+		case GLFW_KEY_C:
+			// every phase of a 4D series, played back in a loop
+			PromptFolder("Cine folder", OpenCine);
+			break;
+		case GLFW_KEY_SPACE:
+			if (gCine) gCine->Playing(!gCine->Playing());
+			break;
+		case GLFW_KEY_B:
+			// writes the current volume as bricks, to open later with O
+			if (gVolumePyramid) PromptFolder("Brick folder", WriteBricks);
+			break;
+		case GLFW_KEY_I:
+			// resampling of the next volume loaded: off, trilinear, Lanczos
+			if (!VolumeResampler::sEnabled) {
+				VolumeResampler::sEnabled = true;
+				VolumeResampler::sFilter = RESAMPLE_TRILINEAR;
+			} else if (VolumeResampler::sFilter == RESAMPLE_TRILINEAR)
+				VolumeResampler::sFilter = RESAMPLE_LANCZOS;
+			else
+				VolumeResampler::sEnabled = false;
+			printf("isotropic resampling: %s\n", !VolumeResampler::sEnabled ? "off" : VolumeResampler::sFilter == RESAMPLE_TRILINEAR ? "trilinear" : "lanczos");
+			break;
+		case GLFW_KEY_BACKSPACE:
+			if (gVolumeStream) gVolumeStream->Cancel();
+			break;
+		case GLFW_KEY_LEFT_BRACKET:
+		case GLFW_KEY_RIGHT_BRACKET: {
+			// finer or coarser resolution of the current volume
+			if (!gVolumePyramid) break;
+			unsigned int level = gVolumeLevel;
+			if (key == GLFW_KEY_LEFT_BRACKET && level > 0) level--;
+			if (key == GLFW_KEY_RIGHT_BRACKET && level + 1 < gVolumePyramid->LevelCount()) level++;
+			if (level == gVolumeLevel) break;
+			gVolumeLevel = level;
+			gVolumes[0]->Texture(gVolumePyramid->Upload(level), level);
+			const VolumePyramid::Level& l = gVolumePyramid->GetLevel(level);
+			printf("level %u: %ux%ux%u\n", level, l.mWidth, l.mHeight, l.mDepth);
 			break;
 		}
+		case GLFW_KEY_P:
+			// mask for the current volume, an empty path removes it
+			PromptFolder("Mask", OpenMask);
+			break;
 		case GLFW_KEY_V:
 			vrEnable = !vrEnable;
 			break;
 		case GLFW_KEY_G:
 			gVolumes[0]->DisplaySampleCount(!gVolumes[0]->DisplaySampleCount());
 			break;
+		case GLFW_KEY_U:
+			// lighting at full, half or quarter resolution
+			gVolumes[0]->IlluminationLevel((gVolumes[0]->IlluminationLevel() + 1) % 3);
+			printf("illumination at 1/%u resolution\n", 1u << gVolumes[0]->IlluminationLevel());
+			break;
+		case GLFW_KEY_Y:
+			gVolumes[0]->LightSweep(!gVolumes[0]->LightSweep());
+			printf("lighting: %s\n", gVolumes[0]->LightSweep() ? "slice sweep" : "shadow rays");
+			break;
+		case GLFW_KEY_E:
+			gVolumes[0]->LightDirectional(!gVolumes[0]->LightDirectional());
+			printf("light: %s\n", gVolumes[0]->LightDirectional() ? "directional" : "point");
+			break;
+		case GLFW_KEY_T:
+			// pre-integrated segments hold up at a few times the step size, raise it with J
+			gVolumes[0]->Preintegrated(!gVolumes[0]->Preintegrated());
+			printf("classification: %s, step size %f\n", gVolumes[0]->Preintegrated() ? "pre-integrated" : "per sample", gVolumes[0]->StepSize());
+			break;
 		case GLFW_KEY_F:
 			gGizmoDraw = !gGizmoDraw;
 			break;
@@ -480,6 +640,99 @@ void Update() {
 	}
 	#pragma endregion
 
+	#pragma region Volume loading
+	#ifndef WINDOWS
+	{
+		vector<pair<void(*)(const string&), string>> folders;
+		{
+			lock_guard<mutex> lock(gPromptMutex);
+			folders.swap(gPromptedFolders);
+		}
+		for (const auto& f : folders)
+			f.first(f.second);
+	}
+	#endif
+	if (gVolumeStream) {
+		// a few milliseconds of uploads per frame
+		bool uploaded = gVolumeStream->Update(.004);
+
+		// the new texture replaces the current volume as soon as it exists and fills in slab by slab, volumes that are
+		// resampled or too large for one texture only show up once they are done
+		if (gVolumeStream->Texture() && gVolumes[0]->Texture() != gVolumeStream->Texture()) {
+			// the old mask belongs to the old volume
+			gVolumes[0]->Mask(nullptr);
+			gMaskStream.reset();
+			gVolumes[0]->Texture(gVolumeStream->Texture());
+			gVolumes[0]->Cine(false);
+			gVolumes[0]->Stats(gVolumeStream->Stats());
+			gVolumes[0]->LocalScale(gVolumeStream->Size());
+			gVolumePyramid.reset();
+			gVolumeGrid = SliceGrid();
+		} else if (uploaded && gVolumes[0]->Texture() == gVolumeStream->Texture()) {
+			// only the new slices, and what they shadow, are baked again
+			uvec2 slices = gVolumeStream->UploadedSlices();
+			shared_ptr<Texture> tex = gVolumeStream->Texture();
+			gVolumes[0]->Invalidate(uvec3(0, 0, slices.x), uvec3(tex->Width(), tex->Height(), slices.y));
+		}
+
+		static int lastProgress = -1;
+		int progress = (int)(gVolumeStream->Progress() * 10.f);
+		if (progress != lastProgress) {
+			printf("loading %d%%\n", progress * 10);
+			lastProgress = progress;
+		}
+
+		if (gVolumeStream->Done()) {
+			if (!gVolumeStream->Failed()) {
+				// the old mask belongs to the old volume
+				gVolumes[0]->Mask(nullptr);
+				gMaskStream.reset();
+				gVolumes[0]->Texture(gVolumeStream->Texture(), gVolumeStream->Level());
+				gVolumes[0]->Cine(false);
+				gVolumes[0]->Stats(gVolumeStream->Stats());
+				gVolumes[0]->LocalScale(gVolumeStream->Size());
+				gVolumePyramid = gVolumeStream->Pyramid();
+				gVolumeLevel = gVolumeStream->Level();
+				gVolumeGrid = gVolumeStream->Grid();
+			}
+			gVolumeStream.reset();
+			lastProgress = -1;
+		}
+	}
+	if (gMaskStream && gMaskStream->Update()) {
+		if (!gMaskStream->Failed())
+			gVolumes[0]->Mask(gMaskStream->Texture(), gMaskStream->Bits());
+		gMaskStream.reset();
+	}
+	if (gCine) {
+		if (gCine->Failed())
+			gCine.reset();
+		else {
+			bool shown = gCine->Texture() != nullptr;
+			if (gCine->Update(deltaTime, .004, gVolumes[0]->BakeSource())) {
+				// every phase is remapped to the texel range of the first, so the window the user set stays put
+				if (!shown) {
+					gVolumePyramid.reset();
+					gVolumeGrid = SliceGrid();
+					gVolumes[0]->Stats(gCine->Stats());
+					gVolumes[0]->LocalScale(gCine->Size());
+					gVolumes[0]->Cine(true);
+				}
+				gVolumes[0]->Texture(gCine->Texture());
+			}
+		}
+	}
+	gVolumes[0]->UpdateBricks(gCamera->WorldPosition());
+
+	// dragging the light relights the volume, otherwise it follows the volume around
+	static vec3 lastLight = gLight->WorldPosition();
+	if (gLight->WorldPosition() != lastLight)
+		gVolumes[0]->LightPosition(gLight->WorldPosition());
+	else
+		gLight->LocalPosition(gVolumes[0]->LightPosition());
+	lastLight = gLight->WorldPosition();
+	#pragma endregion
+
 	#pragma region PC controls
 	static vec2 mouseLast;
 	vec2 md = gMousePos - mouseLast;
@@ -19,6 +19,7 @@ shared_ptr<Shader> AssetDatabase::gPieShader;
 shared_ptr<Shader> AssetDatabase::gTexturedShader;
 shared_ptr<Shader> AssetDatabase::gVolumeShader;
 shared_ptr<Shader> AssetDatabase::gVolumeComputeShader;
+shared_ptr<Shader> AssetDatabase::gLightSweepShader;
 
 void AssetDatabase::LoadAssets() {
 	gLightMesh = shared_ptr<Mesh>(new Mesh("Assets/light.obj"));
@@ -49,6 +50,10 @@ void AssetDatabase::LoadAssets() {
 	gVolumeComputeShader->AddShaderFile(GL_COMPUTE_SHADER, "Assets/volume.glsl");
 	gVolumeComputeShader->CompileAndLink();
 
+	gLightSweepShader = shared_ptr<Shader>(new Shader());
+	gLightSweepShader->AddShaderFile(GL_COMPUTE_SHADER, "Assets/light_sweep.glsl");
+	gLightSweepShader->CompileAndLink();
+
 	gDialTexture = shared_ptr<Texture>(new Texture("Assets/dial_diffuse.png"));
 	gIconTexture = shared_ptr<Texture>(new Texture("Assets/icons.png"));
 	gPenTexture = shared_ptr<Texture>(new Texture("Assets/pen_diffuse.png"));
@@ -145,4 +150,5 @@ void AssetDatabase::Cleanup() {
 	gTexturedShader.reset();
 	gVolumeShader.reset();
 	gVolumeComputeShader.reset();
+	gLightSweepShader.reset();
 }
\ No newline at end of file
@@ -26,4 +26,5 @@ public:
 	static std::shared_ptr<Shader> gTexturedShader;
 	static std::shared_ptr<Shader> gVolumeShader;
 	static std::shared_ptr<Shader> gVolumeComputeShader;
+	static std::shared_ptr<Shader> gLightSweepShader;
 };
\ No newline at end of file
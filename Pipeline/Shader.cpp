@@ -26,6 +26,9 @@ Shader::~Shader() {
 void Shader::Uniform(GLuint program, const GLchar* name, int x) {
 	glUniform1i(glGetUniformLocation(program, name), x);
 }
+void Shader::Uniform(GLuint program, const GLchar* name, unsigned int x) {
+	glUniform1ui(glGetUniformLocation(program, name), x);
+}
 void Shader::Uniform(GLuint program, const GLchar* name, float x){
 	glUniform1f(glGetUniformLocation(program, name), x);
 }
@@ -38,6 +41,9 @@ void Shader::Uniform(GLuint program, const GLchar* name, const vec3& v) {
 void Shader::Uniform(GLuint program, const GLchar* name, const vec4& v) {
 	glUniform4f(glGetUniformLocation(program, name), v.x, v.y, v.z, v.w);
 }
+void Shader::Uniform(GLuint program, const GLchar* name, const ivec3& v) {
+	glUniform3i(glGetUniformLocation(program, name), v.x, v.y, v.z);
+}
 void Shader::Uniform(GLuint program, const GLchar* name, const mat4& m){
 	glUniformMatrix4fv(glGetUniformLocation(program, name), 1, GL_FALSE, &m[0][0]);
 }
@@ -27,10 +27,12 @@ public:
 
 	// global utility functions
 	static void Uniform(GLuint program, const GLchar* name, int x);
+	static void Uniform(GLuint program, const GLchar* name, unsigned int x);
 	static void Uniform(GLuint program, const GLchar* name, float x);
 	static void Uniform(GLuint program, const GLchar* name, const glm::vec2& x);
 	static void Uniform(GLuint program, const GLchar* name, const glm::vec3& x);
 	static void Uniform(GLuint program, const GLchar* name, const glm::vec4& x);
+	static void Uniform(GLuint program, const GLchar* name, const glm::ivec3& x);
 	static void Uniform(GLuint program, const GLchar* name, const glm::mat4& x);
 
 private:
@@ -118,6 +118,28 @@ Texture::Texture(unsigned int width, unsigned int height, unsigned int depth, GL
 	glBindTexture(GL_TEXTURE_3D, 0);
 }
 
+void Texture::Upload(unsigned int x, unsigned int y, unsigned int z, unsigned int width, unsigned int height, unsigned int depth, const void* data) {
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glBindTexture(GL_TEXTURE_3D, mTexture);
+	glTexSubImage3D(GL_TEXTURE_3D, 0, x, y, z, width, height, depth, mFormat, mType, data);
+	glBindTexture(GL_TEXTURE_3D, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+void Texture::Upload(const void* data) {
+	if (mDepth > 0) {
+		Upload(0, 0, 0, mWidth, mHeight, mDepth, data);
+		return;
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glBindTexture(GL_TEXTURE_2D, mTexture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, mWidth, mHeight, mFormat, mType, data);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+void Texture::Clear() {
+	glClearTexImage(mTexture, 0, mFormat, mType, nullptr);
+}
+
 Texture::~Texture() {
 	glDeleteTextures(1, &mTexture);
 }
\ No newline at end of file
@@ -13,6 +13,13 @@ public:
 	Texture(unsigned int width, unsigned int height, unsigned int depth, GLenum internalFormat, GLenum format, GLenum type, GLenum filter, void* data);
 	~Texture();
 
+	// Replaces a box of a 3D texture with tightly packed data in the texture's format and type
+	void Upload(unsigned int x, unsigned int y, unsigned int z, unsigned int width, unsigned int height, unsigned int depth, const void* data);
+	// Replaces every texel of a 2D or 3D texture without reallocating it
+	void Upload(const void* data);
+	// Sets every texel to zero
+	void Clear();
+
 	unsigned int Width() const { return mWidth; }
 	unsigned int Height() const { return mHeight; }
 	unsigned int Depth() const { return mDepth; }
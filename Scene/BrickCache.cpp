@@ -0,0 +1,235 @@
+#include "BrickCache.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+#define NO_BRICK 0xFFFFFFFFu
+
+using namespace std;
+using namespace glm;
+
+BrickCache::BrickCache(const shared_ptr<BrickedVolume>& volume, size_t budget)
+	: mVolume(volume), mPagesDirty(true), mEmptyBelow(0), mFull(false), mFrame(0), mLastFeedback(0), mStop(false) {
+	// source and baked texels of one slot
+	size_t slotBytes = (size_t)BRICK_VOXELS * (sizeof(uint16_t) + 2 * sizeof(uint16_t));
+	GLint maxSize;
+	glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &maxSize);
+
+	int n = 1;
+	while ((size_t)(n + 1) * (n + 1) * (n + 1) * slotBytes <= budget && (n + 1) * BRICK_SIZE <= maxSize) n++;
+	// no more slots than there are bricks
+	unsigned int total = volume->BrickTotal();
+	mSlots.x = std::min(n, (int)total);
+	mSlots.y = std::min(n, (int)((total + mSlots.x - 1) / mSlots.x));
+	mSlots.z = std::min(n, (int)((total + mSlots.x * mSlots.y - 1) / (mSlots.x * mSlots.y)));
+
+	mAtlas = shared_ptr<Texture>(new Texture(mSlots.x * BRICK_SIZE, mSlots.y * BRICK_SIZE, mSlots.z * BRICK_SIZE, GL_R16, GL_RED, GL_UNSIGNED_SHORT, GL_LINEAR));
+	mBakedAtlas = shared_ptr<Texture>(new Texture(mSlots.x * BRICK_SIZE, mSlots.y * BRICK_SIZE, mSlots.z * BRICK_SIZE, GL_RG16, GL_RG, GL_UNSIGNED_SHORT, GL_LINEAR));
+	uvec3 count = volume->BrickCount();
+	mPageTable = shared_ptr<Texture>(new Texture(count.x, count.y, count.z, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, GL_NEAREST));
+
+	mSlotBricks.resize((size_t)mSlots.x * mSlots.y * mSlots.z, { NO_BRICK, 0 });
+	mBrickSlots.resize(total);
+	mPages.resize(total);
+	mFeedbackData.resize(total);
+
+	glGenBuffers(FEEDBACK_BUFFERS, mFeedback);
+	for (unsigned int i = 0; i < FEEDBACK_BUFFERS; i++) {
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, mFeedback[i]);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(uint32_t) * total, mFeedbackData.data(), GL_STREAM_READ);
+		mFences[i] = 0;
+		mFeedbackFrame[i] = 0;
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	printf("brick atlas %dx%dx%d slots (%.1f MB)\n", mSlots.x, mSlots.y, mSlots.z, mSlotBricks.size() * slotBytes / 1048576.0);
+
+	mThread = thread(&BrickCache::IOMain, this);
+}
+BrickCache::~BrickCache() {
+	{
+		lock_guard<mutex> lock(mMutex);
+		mStop = true;
+	}
+	mCondition.notify_all();
+	mThread.join();
+
+	for (unsigned int i = 0; i < FEEDBACK_BUFFERS; i++)
+		if (mFences[i]) glDeleteSync(mFences[i]);
+	glDeleteBuffers(FEEDBACK_BUFFERS, mFeedback);
+}
+
+void BrickCache::IOMain() {
+	ifstream file(mVolume->Path(), ios::binary);
+
+	while (true) {
+		unsigned int brick;
+		{
+			unique_lock<mutex> lock(mMutex);
+			mCondition.wait(lock, [&]() { return mStop || !mRequests.empty(); });
+			if (mStop) return;
+			brick = mRequests.front();
+			mRequests.pop_front();
+			mPending.insert(brick);
+		}
+
+		unique_ptr<LoadedBrick> loaded(new LoadedBrick());
+		loaded->mBrick = brick;
+		loaded->mTexels.resize(BRICK_VOXELS);
+		bool good = mVolume->ReadBrick(file, brick, loaded->mTexels.data());
+
+		lock_guard<mutex> lock(mMutex);
+		if (good)
+			mLoaded.push_back(move(loaded));
+		else {
+			printf("Failed to read brick %u of %s\n", brick, mVolume->Path().c_str());
+			mPending.erase(brick);
+		}
+	}
+}
+
+void BrickCache::EmptyBelow(uint16_t texel) {
+	if (texel == mEmptyBelow) return;
+	mEmptyBelow = texel;
+	for (unsigned int b = 0; b < mPages.size(); b++)
+		mPages[b] = Page(b);
+	mPagesDirty = true;
+}
+
+void BrickCache::ReadFeedback(const vec3& cameraVoxel) {
+	unsigned int cur = mFrame % FEEDBACK_BUFFERS;
+
+	// fence the buffer the last frame drew into
+	unsigned int prev = (mFrame + FEEDBACK_BUFFERS - 1) % FEEDBACK_BUFFERS;
+	if (mFrame > 1) {
+		if (mFences[prev]) glDeleteSync(mFences[prev]);
+		mFences[prev] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+	// this frame's buffer was drawn into FEEDBACK_BUFFERS frames ago, skip it if the GPU still isn't done with it
+	if (!mFences[cur]) return;
+	GLenum status = glClientWaitSync(mFences[cur], 0, 0);
+	if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) return;
+	glDeleteSync(mFences[cur]);
+	mFences[cur] = 0;
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, mFeedback[cur]);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(uint32_t) * mFeedbackData.size(), mFeedbackData.data());
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	uint32_t frame = mFeedbackFrame[cur];
+	mLastFeedback = frame;
+
+	vector<unsigned int> requests;
+	size_t pending;
+	{
+		lock_guard<mutex> lock(mMutex);
+		for (unsigned int b = 0; b < mFeedbackData.size(); b++) {
+			if (mFeedbackData[b] != frame) continue;
+			if (mBrickSlots[b])
+				mSlotBricks[mBrickSlots[b] - 1].mLastUsed = frame;
+			else if (mPages[b] != PAGE_EMPTY && !mPending.count(b))
+				requests.push_back(b);
+		}
+		pending = mPending.size();
+	}
+
+	// only as many bricks as there are slots to put them in, the ones read and loaded already count against them.
+	// Bricks that can't get a slot would be read again every frame and thrown away.
+	size_t free = 0;
+	for (const auto& slot : mSlotBricks)
+		if (slot.mBrick == NO_BRICK || slot.mLastUsed < frame) free++;
+	size_t capacity = free > pending ? free - pending : 0;
+	if (requests.size() > capacity && !mFull) {
+		printf("brick atlas is full, raise the budget to see the whole volume at full resolution\n");
+		mFull = true;
+	} else if (requests.size() <= capacity)
+		mFull = false;
+
+	// closest bricks first, they cover the most of the screen
+	vector<float> distance(requests.size());
+	for (size_t i = 0; i < requests.size(); i++) {
+		vec3 center = (vec3(mVolume->BrickCoord(requests[i])) + .5f) * (float)BRICK_INTERIOR;
+		distance[i] = length(center - cameraVoxel);
+	}
+	vector<unsigned int> order(requests.size());
+	for (unsigned int i = 0; i < order.size(); i++) order[i] = i;
+	sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) { return distance[a] < distance[b]; });
+	if (order.size() > capacity) order.resize(capacity);
+
+	// requests from older frames are dropped, the rays may have moved on
+	{
+		lock_guard<mutex> lock(mMutex);
+		mRequests.clear();
+		for (unsigned int i : order)
+			mRequests.push_back(requests[i]);
+	}
+	mCondition.notify_one();
+}
+
+unsigned int BrickCache::FindSlot() {
+	unsigned int best = NO_BRICK;
+	for (unsigned int s = 0; s < mSlotBricks.size(); s++) {
+		if (mSlotBricks[s].mBrick == NO_BRICK) return s;
+		if (best == NO_BRICK || mSlotBricks[s].mLastUsed < mSlotBricks[best].mLastUsed) best = s;
+	}
+	// everything in the atlas is still on screen
+	if (mSlotBricks[best].mLastUsed >= mLastFeedback) return NO_BRICK;
+	return best;
+}
+
+void BrickCache::Update(const vec3& cameraVoxel, double budget, vector<uvec2>& uploaded) {
+	mFrame++;
+	ReadFeedback(cameraVoxel);
+	mFeedbackFrame[mFrame % FEEDBACK_BUFFERS] = mFrame;
+
+	// at least one loaded brick per call so loading always advances, then as many as fit in the budget
+	auto start = chrono::high_resolution_clock::now();
+	bool any = false;
+	while (!any || chrono::duration<double>(chrono::high_resolution_clock::now() - start).count() < budget) {
+		any = true;
+		unique_ptr<LoadedBrick> loaded;
+		{
+			lock_guard<mutex> lock(mMutex);
+			if (mLoaded.empty()) break;
+			loaded = move(mLoaded.front());
+			mLoaded.erase(mLoaded.begin());
+			mPending.erase(loaded->mBrick);
+		}
+		unsigned int b = loaded->mBrick;
+		if (mBrickSlots[b]) continue;
+
+		// the slots filled up with bricks on screen since it was requested, it is requested again if rays still need it
+		unsigned int s = FindSlot();
+		if (s == NO_BRICK) continue;
+
+		// evict the least recently used brick
+		if (mSlotBricks[s].mBrick != NO_BRICK) {
+			unsigned int old = mSlotBricks[s].mBrick;
+			mBrickSlots[old] = 0;
+			mPages[old] = Page(old);
+		}
+		mSlotBricks[s].mBrick = b;
+		mSlotBricks[s].mLastUsed = mFrame;
+		mBrickSlots[b] = s + 1;
+		mPages[b] = Page(b);
+
+		uvec3 slot(s % mSlots.x, (s / mSlots.x) % mSlots.y, s / (mSlots.x * mSlots.y));
+		mAtlas->Upload(slot.x * BRICK_SIZE, slot.y * BRICK_SIZE, slot.z * BRICK_SIZE, BRICK_SIZE, BRICK_SIZE, BRICK_SIZE, loaded->mTexels.data());
+		uploaded.push_back(uvec2(s, b));
+		mPagesDirty = true;
+	}
+
+	if (mPagesDirty) {
+		uvec3 count = mVolume->BrickCount();
+		mPageTable->Upload(0, 0, 0, count.x, count.y, count.z, mPages.data());
+		mPagesDirty = false;
+	}
+}
+
+void BrickCache::Resident(vector<uvec2>& slots) const {
+	for (unsigned int s = 0; s < mSlotBricks.size(); s++)
+		if (mSlotBricks[s].mBrick != NO_BRICK)
+			slots.push_back(uvec2(s, mSlotBricks[s].mBrick));
+}
\ No newline at end of file
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <gl/glew.h>
+#include <glm/glm.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "../Pipeline/Texture.hpp"
+#include "../Util/BrickedVolume.hpp"
+
+// page table entry of a brick below the threshold, it is drawn as empty and never loaded
+#define PAGE_EMPTY 0x80000000u
+// frames of feedback in flight, so reading it back never waits on the GPU
+#define FEEDBACK_BUFFERS 3
+
+// GPU residency of a BrickedVolume
+// Bricks live in a fixed atlas of BRICK_SIZE^3 slots. A page table with one texel per brick holds slot + 1 for
+// resident bricks, 0 for missing ones and PAGE_EMPTY for empty ones. The ray marcher records every brick it enters
+// in a feedback buffer, which is read back a few frames later: missing bricks are requested closest to the camera
+// first and read by a background I/O thread, resident ones are marked used. Loaded bricks replace the least
+// recently used slot, and no more bricks are requested than there are slots not on screen. Rays through missing
+// bricks see empty space until they arrive.
+class BrickCache {
+public:
+	// Allocates an atlas of at most budget bytes for the source and baked texels
+	BrickCache(const std::shared_ptr<BrickedVolume>& volume, size_t budget);
+	~BrickCache();
+
+	inline const std::shared_ptr<BrickedVolume>& Volume() const { return mVolume; }
+	inline std::shared_ptr<Texture> Atlas() const { return mAtlas; }
+	inline std::shared_ptr<Texture> BakedAtlas() const { return mBakedAtlas; }
+	inline std::shared_ptr<Texture> PageTable() const { return mPageTable; }
+	// atlas slots along each axis
+	inline glm::ivec3 AtlasSlots() const { return mSlots; }
+	// the buffer rays record their bricks in this frame
+	inline GLuint FeedbackBuffer() const { return mFeedback[mFrame % FEEDBACK_BUFFERS]; }
+	inline uint32_t Frame() const { return mFrame; }
+
+	// Marks bricks whose texels are all at or below texel as empty
+	void EmptyBelow(uint16_t texel);
+	// Reads back feedback, queues missing bricks and uploads loaded ones for up to budget seconds.
+	// Once per frame, before drawing. Appends the slots that received a brick to uploaded, with the brick's index.
+	void Update(const glm::vec3& cameraVoxel, double budget, std::vector<glm::uvec2>& uploaded);
+	// Slots that hold a brick, with the brick's index
+	void Resident(std::vector<glm::uvec2>& slots) const;
+
+private:
+	struct Slot {
+		unsigned int mBrick;
+		uint32_t mLastUsed;
+	};
+	struct LoadedBrick {
+		unsigned int mBrick;
+		std::vector<uint16_t> mTexels;
+	};
+
+	std::shared_ptr<BrickedVolume> mVolume;
+	std::shared_ptr<Texture> mAtlas;
+	std::shared_ptr<Texture> mBakedAtlas;
+	std::shared_ptr<Texture> mPageTable;
+	glm::ivec3 mSlots;
+
+	std::vector<Slot> mSlotBricks;
+	// slot + 1 of every brick, 0 if it isn't resident
+	std::vector<uint32_t> mBrickSlots;
+	std::vector<uint32_t> mPages;
+	bool mPagesDirty;
+	uint16_t mEmptyBelow;
+	bool mFull;
+
+	uint32_t mFrame;
+	GLuint mFeedback[FEEDBACK_BUFFERS];
+	GLsync mFences[FEEDBACK_BUFFERS];
+	uint32_t mFeedbackFrame[FEEDBACK_BUFFERS];
+	// frame of the newest feedback read back, slots used in it are never evicted
+	uint32_t mLastFeedback;
+	std::vector<uint32_t> mFeedbackData;
+
+	// shared with the I/O thread
+	std::mutex mMutex;
+	std::condition_variable mCondition;
+	std::deque<unsigned int> mRequests;
+	std::unordered_set<unsigned int> mPending;
+	std::vector<std::unique_ptr<LoadedBrick>> mLoaded;
+	bool mStop;
+	std::thread mThread;
+
+	void IOMain();
+	void ReadFeedback(const glm::vec3& cameraVoxel);
+	unsigned int FindSlot();
+	inline uint32_t Page(unsigned int brick) const { return mVolume->BrickMax(brick) <= mEmptyBelow ? PAGE_EMPTY : mBrickSlots[brick]; }
+};
\ No newline at end of file
@@ -3,81 +3,685 @@
 #include <glm/gtx/quaternion.hpp>
 
 #include "../Pipeline/AssetDatabase.hpp"
+#include "../Util/ThreadPool.hpp"
 
 #pragma warning(disable:26451)
 
+// entries of the transfer function table, the threshold's kink falls within one of them
+#define TRANSFER_TABLE_SIZE 1024
+// entries along each axis of the pre-integrated table
+#define PREINTEGRATED_TABLE_SIZE 256
+// step size the opacities of the transfer function are meant for, the default StepSize
+#define REFERENCE_STEP .00135f
+
 using namespace std;
 using namespace glm;
 
+struct Volume::PreintegrationJob {
+	vector<vec4> mTable;
+	atomic<bool> mDone;
+	PreintegrationJob() : mDone(false) {}
+};
+
+// Builds the pre-integrated tables, away from the loader pool so they never wait behind slices
+ThreadPool& PreintegrationPool() {
+	static ThreadPool pool(1);
+	return pool;
+}
+
 Volume::Volume()
-	: Object(), mDisplaySampleCount(false), mTexture(nullptr), mBakedTexture(nullptr), mMask(false), mDirty(true),
-	mStepSize(.00135f),
-	mDensity(.5f), mThreshold(.2f), mExposure(1.5f), mLightDensity(300.f),
+	: Object(), mDisplaySampleCount(false), mTexture(nullptr), mTextureLevel(0), mBakedTexture(nullptr), mBricksStreaming(false), mMask(false), mMaskBits(1), mDirty(true),
+	mStepSize(REFERENCE_STEP), mPreintegrated(false), mPreintegratedStale(true),
+	mTransferDirty(true), mWindowMin(0.f), mWindowMax(1.f), mLightDensity(300.f),
 	mPlanePoint(vec3(0.f, -2.f, 0.f)), mPlaneNormal(vec3(0.f, 1.f, 0.f)),
 	mLightIntensity(100.0f), mLightAmbient(.2f),
-	mLightPosition(vec3(.0f, .1f, 0.f)), mLightDirection(normalize(vec3(-1.0f, -.25f, 0.f))), mLightAngle(.5f) {}
-Volume::~Volume() {}
+	mLightPosition(vec3(.0f, .1f, 0.f)), mLightDirection(normalize(vec3(-1.0f, -.25f, 0.f))), mLightAngle(.5f),
+	mLightDirty(false), mIlluminationLevel(1), mLightSweep(true), mLightDirectional(false), mCine(false),
+	mLightAttached(true), mBakeBudget(2.f), mTextureChanged(false), mBakedScale(0.f), mDirtyMin(0), mDirtyMax(0), mStreamedMin(0), mStreamedMax(0) {
+	// about what a mid-range GPU takes, the timer queries correct it after the first frames
+	for (unsigned int i = 0; i < BAKE_PASS_COUNT; i++)
+		mBakeCost[i] = 1.0;
+	// the transform is still the identity
+	mLightLocalPosition = mLightPosition;
+	mLightLocalDirection = mLightDirection;
+}
+Volume::~Volume() {
+	for (const auto& q : mBakeQueries)
+		glDeleteQueries(1, &q.mQuery);
+}
 
-void Volume::Texture(const shared_ptr<::Texture>& tex) {
+void Volume::Texture(const shared_ptr<::Texture>& tex, unsigned int level) {
+	if (tex != mTexture) mTextureChanged = true;
 	mTexture = tex;
+	mTextureLevel = level;
+	mBricks.reset();
+	mBakeSlots.clear();
 	mDirty = true;
 }
 
+void Volume::Bricks(const shared_ptr<BrickCache>& bricks) {
+	mBricks = bricks;
+	mBakeSlots.clear();
+	mTexture.reset();
+	mBakedTexture.reset();
+	mIlluminationTexture.reset();
+	mTransmittanceTexture.reset();
+	mBakedBack.reset();
+	mIlluminationBack.reset();
+	mBakeSteps.clear();
+	mBakeSource.reset();
+	mMask = false;
+	mMaskTexture.reset();
+	mDirty = true;
+}
+
+void Volume::UpdateBricks(const vec3& cameraPosition) {
+	if (!mBricks) return;
+	const BrickedVolume& v = *mBricks->Volume();
+	vec3 size((float)v.Width(), (float)v.Height(), (float)v.Depth());
+
+	// bricks whose brightest texel is below the threshold contribute nothing
+	float wmin = mStats.ToTexel(mWindowMin);
+	float wmax = mStats.ToTexel(mWindowMax);
+	float empty = wmin + mTransfer.mThreshold * (wmax - wmin);
+	mBricks->EmptyBelow((uint16_t)(std::min(std::max(empty, 0.f), 1.f) * 65535.f));
+
+	vector<uvec2> uploaded;
+	mBricks->Update(((vec3)(WorldToObject() * vec4(cameraPosition, 1.f)) + .5f) * size, .004, uploaded);
+	mBakeSlots.insert(mBakeSlots.end(), uploaded.begin(), uploaded.end());
+
+	for (const auto& s : uploaded) {
+		uvec3 b = v.BrickCoord(s.y) * (unsigned int)BRICK_INTERIOR;
+		uvec3 e = min(b + (unsigned int)BRICK_INTERIOR, uvec3(v.Width(), v.Height(), v.Depth()));
+		if (all(lessThan(mStreamedMin, mStreamedMax))) {
+			mStreamedMin = min(mStreamedMin, b);
+			mStreamedMax = max(mStreamedMax, e);
+		} else {
+			mStreamedMin = b;
+			mStreamedMax = e;
+		}
+	}
+
+	// bricks were lit before their neighbours arrived, relight the ones they shadow once streaming settles
+	if (uploaded.empty() && mBricksStreaming && all(lessThan(mStreamedMin, mStreamedMax))) {
+		uvec3 mn = mStreamedMin;
+		uvec3 mx = mStreamedMax;
+		ShadowBounds(uvec3(v.Width(), v.Height(), v.Depth()), mn, mx);
+
+		vector<uvec2> resident;
+		mBricks->Resident(resident);
+		for (const auto& s : resident) {
+			uvec3 b = v.BrickCoord(s.y) * (unsigned int)BRICK_INTERIOR;
+			if (all(lessThan(b, mx)) && all(lessThan(mn, b + (unsigned int)BRICK_INTERIOR)))
+				mBakeSlots.push_back(s);
+		}
+		mStreamedMin = mStreamedMax = uvec3(0);
+	}
+	mBricksStreaming = !uploaded.empty();
+}
+
+void Volume::Mask(const shared_ptr<::Texture>& mask, unsigned int bits) {
+	mMaskTexture = mask;
+	mMaskBits = bits;
+	mMask = mask != nullptr;
+	mDirty = true;
+}
+
+void Volume::Stats(const VolumeStats& stats) {
+	mStats = stats;
+	mWindowMin = stats.mMin;
+	mWindowMax = stats.mMax;
+	mDirty = true;
+}
+
+void Volume::Transfer(const TransferFunction& transfer) {
+	mTransfer = transfer;
+	mTransferDirty = true;
+	mLightDirty = true;
+}
+
+void Volume::Invalidate(const uvec3& mn, const uvec3& mx) {
+	if (!all(lessThan(mn, mx))) return;
+	if (all(lessThan(mDirtyMin, mDirtyMax))) {
+		mDirtyMin = min(mDirtyMin, mn);
+		mDirtyMax = max(mDirtyMax, mx);
+	} else {
+		mDirtyMin = mn;
+		mDirtyMax = mx;
+	}
+}
+
+void Volume::LightPosition(const vec3& p) {
+	mLightPosition = p;
+	mLightLocalPosition = inverse(WorldRotation()) * (p - WorldPosition());
+}
+void Volume::LightDirection(const vec3& d) {
+	mLightDirection = normalize(d);
+	mLightLocalDirection = inverse(WorldRotation()) * mLightDirection;
+}
+
 bool Volume::UpdateTransform() {
 	if (!Object::UpdateTransform()) return false;
-	mDirty = true;
+	// the bake only depends on the light relative to the volume, LightMoved() decides whether it has to run
+	if (mLightAttached) {
+		mLightPosition = WorldPosition() + WorldRotation() * mLightLocalPosition;
+		mLightDirection = WorldRotation() * mLightLocalDirection;
+	} else {
+		quat invRot = inverse(WorldRotation());
+		mLightLocalPosition = invRot * (mLightPosition - WorldPosition());
+		mLightLocalDirection = invRot * mLightDirection;
+	}
 	return true;
 }
 
-void Volume::Precompute() {
-	if (!mTexture) return;
+bool Volume::LightMoved() {
+	UpdateTransform();
+	// well below a voxel of any volume that fits in a room
+	const float eps = 1e-5f;
+	vec3 scale = LocalScale();
+	if (length(mLightLocalPosition - mBakedLightPosition) < eps && length(mLightLocalDirection - mBakedLightDirection) < eps && length(scale - mBakedScale) < eps)
+		return false;
+	mBakedLightPosition = mLightLocalPosition;
+	mBakedLightDirection = mLightLocalDirection;
+	mBakedScale = scale;
+	return true;
+}
 
-	if (!mBakedTexture || mBakedTexture->Width() != mTexture->Width() || mBakedTexture->Height() != mTexture->Height() || mBakedTexture->Depth() != mTexture->Depth()) {
-		glEnable(GL_TEXTURE_3D);
+// Grows [min, max) to every voxel whose shadow ray to the point light passes through it, for a volume of size voxels
+void Volume::ShadowBounds(const uvec3& size, uvec3& mn, uvec3& mx) {
+	if (mLightDirectional) {
+		// shadows can reach across the whole volume
+		mn = uvec3(0);
+		mx = size;
+		return;
+	}
 
-		uint16_t* data = new uint16_t[mTexture->Width() * mTexture->Height() * mTexture->Depth() * 2];
-		memset(data, 0xFFFF, mTexture->Width() * mTexture->Height() * mTexture->Depth() * 2 * sizeof(uint16_t));
-		
-		mBakedTexture = shared_ptr<::Texture>(new ::Texture(mTexture->Width(), mTexture->Height(), mTexture->Depth(), GL_RG16, GL_RG, GL_UNSIGNED_SHORT, GL_LINEAR, data));
+	vec3 bmin = vec3(mn) - 1.f;
+	vec3 bmax = vec3(mx) + 1.f;
+	vec3 vsize(size);
+	vec3 lp = (mLightLocalPosition / LocalScale() + .5f) * vsize;
+
+	// a light inside the box can shadow anything
+	float d = length(clamp(lp, bmin, bmax) - lp);
+	if (d < 1.f) {
+		mn = uvec3(0);
+		mx = size;
+		return;
 	}
-	
-	if (mMask)
-		AssetDatabase::gVolumeComputeShader->EnableKeyword("MASK");
+
+	// the rays through the corners, far enough along that they have left the volume
+	float t = (length(lp - vsize * .5f) + length(vsize)) / d;
+	vec3 lo = bmin;
+	vec3 hi = bmax;
+	for (unsigned int i = 0; i < 8; i++) {
+		vec3 c((i & 1) ? bmax.x : bmin.x, (i & 2) ? bmax.y : bmin.y, (i & 4) ? bmax.z : bmin.z);
+		vec3 f = lp + (c - lp) * t;
+		lo = min(lo, f);
+		hi = max(hi, f);
+	}
+	mn = uvec3(clamp(floor(lo), vec3(0.f), vsize));
+	mx = uvec3(clamp(ceil(hi), vec3(0.f), vsize));
+}
+
+VolumeBakeParams Volume::BakeParameters() {
+	UpdateTransform();
+	VolumeBakeParams b;
+	b.mTransfer = mTransfer;
+	b.mWindowMin = mStats.ToTexel(mWindowMin);
+	b.mWindowMax = mStats.ToTexel(mWindowMax);
+	b.mWorldScale = LocalScale();
+	b.mLight = mLightDirectional ? BAKE_LIGHT_DIRECTIONAL : BAKE_LIGHT_POINT;
+	b.mLightPosition = mLightLocalPosition;
+	b.mLightDirection = mLightLocalDirection;
+	b.mLightDensity = mLightDensity;
+	b.mLightAngle = mLightAngle;
+	b.mLightAmbient = mLightAmbient;
+	b.mLightIntensity = mLightIntensity;
+	return b;
+}
+
+void Volume::BakeUniforms(GLuint p) {
+	const VolumeBakeParams& b = mBakeParams;
+	Shader::Uniform(p, "Density", b.mTransfer.mDensity);
+	Shader::Uniform(p, "Threshold", b.mTransfer.mThreshold);
+	Shader::Uniform(p, "WindowMin", b.mWindowMin);
+	Shader::Uniform(p, "WindowMax", b.mWindowMax);
+	Shader::Uniform(p, "WorldScale", b.mWorldScale);
+
+	Shader::Uniform(p, "LightDensity", b.mLightDensity);
+	Shader::Uniform(p, "LightPosition", b.mLightPosition);
+	Shader::Uniform(p, "LightDirection", b.mLightDirection);
+	Shader::Uniform(p, "LightAngle", b.mLightAngle);
+	Shader::Uniform(p, "LightAmbient", b.mLightAmbient);
+	Shader::Uniform(p, "LightIntensity", b.mLightIntensity);
+}
+
+void Volume::PrecomputeBricks() {
+	// everything resident when the parameters changed, otherwise only the bricks that just arrived
+	vector<uvec2> slots;
+	if (mDirty || mLightDirty)
+		mBricks->Resident(slots);
 	else
-		AssetDatabase::gVolumeComputeShader->DisableKeyword("MASK");
+		slots.swap(mBakeSlots);
+	mBakeSlots.clear();
 
-	AssetDatabase::gVolumeComputeShader->EnableKeyword("LIGHT_POINT");
+	AssetDatabase::gVolumeComputeShader->DisableKeyword("MASK");
+	AssetDatabase::gVolumeComputeShader->DisableKeyword("ILLUMINATION");
+	AssetDatabase::gVolumeComputeShader->EnableKeyword("BRICKED");
+	LightKeywords(*AssetDatabase::gVolumeComputeShader);
 
 	GLuint p = AssetDatabase::gVolumeComputeShader->Use();
+	mBakeParams = BakeParameters();
+	BakeUniforms(p);
+
+	const BrickedVolume& v = *mBricks->Volume();
+	ivec3 slotCount = mBricks->AtlasSlots();
+	Shader::Uniform(p, "TexelSize", vec3(1.f / v.Width(), 1.f / v.Height(), 1.f / v.Depth()));
+	Shader::Uniform(p, "VolumeSize", ivec3(v.Width(), v.Height(), v.Depth()));
+	Shader::Uniform(p, "AtlasSlots", slotCount);
+
+	glBindImageTexture(0, mBricks->Atlas()->GLTexture(), 0, GL_TRUE, 0, GL_READ_ONLY, GL_R16);
+	glBindImageTexture(1, mBricks->BakedAtlas()->GLTexture(), 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RG16);
+	glBindImageTexture(3, mBricks->PageTable()->GLTexture(), 0, GL_TRUE, 0, GL_READ_ONLY, GL_R32UI);
+
+	for (const auto& s : slots) {
+		uvec3 b = v.BrickCoord(s.y);
+		ivec3 slot(s.x % slotCount.x, (s.x / slotCount.x) % slotCount.y, s.x / (slotCount.x * slotCount.y));
+		Shader::Uniform(p, "BrickVoxel", ivec3(b.x * BRICK_INTERIOR - BRICK_BORDER, b.y * BRICK_INTERIOR - BRICK_BORDER, b.z * BRICK_INTERIOR - BRICK_BORDER));
+		Shader::Uniform(p, "BrickTexel", ivec3(slot.x * BRICK_SIZE, slot.y * BRICK_SIZE, slot.z * BRICK_SIZE));
+		glDispatchCompute(BRICK_SIZE / 8, BRICK_SIZE / 8, BRICK_SIZE / 8);
+	}
+	glMemoryBarrier(GL_ALL_BARRIER_BITS);
+
+	glBindImageTexture(0, 0, 0, GL_TRUE, 0, GL_READ_ONLY, GL_R16);
+	glBindImageTexture(1, 0, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RG16);
+	glBindImageTexture(3, 0, 0, GL_TRUE, 0, GL_READ_ONLY, GL_R32UI);
+
+	glUseProgram(0);
+
+	mDirty = mLightDirty = false;
+}
+
+// Binds the bake shader for the texture, lit or unlit into the baked texture or the lighting alone into the illumination texture
+// back writes the textures that replace them once the bake is done.
+GLuint Volume::BakeProgram(bool light, bool illumination, bool back) {
+	Shader& shader = *AssetDatabase::gVolumeComputeShader;
+	if (mMask)
+		shader.EnableKeyword("MASK");
+	else
+		shader.DisableKeyword("MASK");
+	shader.DisableKeyword("BRICKED");
+	if (light)
+		LightKeywords(shader);
+	else {
+		shader.DisableKeyword("LIGHT_POINT");
+		shader.DisableKeyword("LIGHT_DIRECTIONAL");
+	}
+	if (illumination)
+		shader.EnableKeyword("ILLUMINATION");
+	else
+		shader.DisableKeyword("ILLUMINATION");
+
+	GLuint p = shader.Use();
+	BakeUniforms(p);
+	if (mMask) {
+		// the mask stays at full resolution when the volume is a coarser pyramid level
+		Shader::Uniform(p, "MaskBits", (int)mMaskBits);
+		Shader::Uniform(p, "MaskLevel", (int)mTextureLevel);
+	}
+	Shader::Uniform(p, "TexelSize", vec3(1.f / mBakeSource->Width(), 1.f / mBakeSource->Height(), 1.f / mBakeSource->Depth()));
+	Shader::Uniform(p, "IlluminationScale", (float)(1u << mIlluminationLevel));
 
-	Shader::Uniform(p, "Exposure", mExposure);
-	Shader::Uniform(p, "Density", mDensity);
-	Shader::Uniform(p, "Threshold", mThreshold);
+	glBindImageTexture(0, mBakeSource->GLTexture(), 0, GL_TRUE, 0, GL_READ_ONLY, GL_R16);
+	if (illumination)
+		glBindImageTexture(1, (back ? mIlluminationBack : mIlluminationTexture)->GLTexture(), 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R16F);
+	else
+		glBindImageTexture(1, (back ? mBakedBack : mBakedTexture)->GLTexture(), 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RG16);
+	if (mMask) glBindImageTexture(2, mMaskTexture->GLTexture(), 0, GL_TRUE, 0, GL_READ_ONLY, GL_R8UI);
+	return p;
+}
+void Volume::LightKeywords(Shader& shader) {
+	if (mLightDirectional) {
+		shader.EnableKeyword("LIGHT_DIRECTIONAL");
+		shader.DisableKeyword("LIGHT_POINT");
+	} else {
+		shader.EnableKeyword("LIGHT_POINT");
+		shader.DisableKeyword("LIGHT_DIRECTIONAL");
+	}
+}
 
-	Shader::Uniform(p, "WorldScale", LocalScale());
-	Shader::Uniform(p, "TexelSize", vec3(1.f / mTexture->Width(), 1.f / mTexture->Height(), 1.f / mTexture->Depth()));
+// Binds the sweep shader, the slices are dispatched by RunBakeSteps
+GLuint Volume::SweepProgram(bool back) {
+	::Texture& illumination = back ? *mIlluminationBack : *mIlluminationTexture;
+	uvec3 lightSize(illumination.Width(), illumination.Height(), illumination.Depth());
+	if (!mTransmittanceTexture || mTransmittanceTexture->Width() != lightSize.x || mTransmittanceTexture->Height() != lightSize.y || mTransmittanceTexture->Depth() != lightSize.z)
+		mTransmittanceTexture = shared_ptr<::Texture>(new ::Texture(lightSize.x, lightSize.y, lightSize.z, GL_R16F, GL_RED, GL_FLOAT, GL_NEAREST));
 
-	quat invRot = inverse(WorldRotation());
+	Shader& shader = *AssetDatabase::gLightSweepShader;
+	if (mMask)
+		shader.EnableKeyword("MASK");
+	else
+		shader.DisableKeyword("MASK");
+	LightKeywords(shader);
+
+	GLuint p = shader.Use();
+	BakeUniforms(p);
+	if (mMask) {
+		Shader::Uniform(p, "MaskBits", (int)mMaskBits);
+		Shader::Uniform(p, "MaskLevel", (int)mTextureLevel);
+	}
+	vec3 size((float)mBakeSource->Width(), (float)mBakeSource->Height(), (float)mBakeSource->Depth());
+	Shader::Uniform(p, "TexelSize", 1.f / size);
+	Shader::Uniform(p, "IlluminationScale", (float)(1u << mIlluminationLevel));
+	Shader::Uniform(p, "IlluminationSize", ivec3(lightSize.x, lightSize.y, lightSize.z));
+	Shader::Uniform(p, "SweepAxes", mSweepAxes);
+
+	glBindImageTexture(0, mBakeSource->GLTexture(), 0, GL_TRUE, 0, GL_READ_ONLY, GL_R16);
+	glBindImageTexture(1, illumination.GLTexture(), 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R16F);
+	glBindImageTexture(3, mTransmittanceTexture->GLTexture(), 0, GL_TRUE, 0, GL_READ_WRITE, GL_R16F);
+	if (mMask) glBindImageTexture(2, mMaskTexture->GLTexture(), 0, GL_TRUE, 0, GL_READ_ONLY, GL_R8UI);
+	return p;
+}
 
-	Shader::Uniform(p, "LightDensity", mLightDensity);
-	Shader::Uniform(p, "LightPosition", invRot * (mLightPosition - WorldPosition()));
-	Shader::Uniform(p, "LightDirection", invRot * mLightDirection);
-	Shader::Uniform(p, "LightAngle", mLightAngle);
-	Shader::Uniform(p, "LightAmbient", mLightAmbient);
-	Shader::Uniform(p, "LightIntensity", mLightIntensity);
+// Replaces the steps that write the same texture as pass with ones that bake all of it, into the back buffer if back is set
+void Volume::RestartPass(BakePass pass, bool back, const uvec3& size) {
+	bool lighting = pass == BAKE_ILLUMINATION || pass == BAKE_SWEEP;
+	mBakeSteps.erase(remove_if(mBakeSteps.begin(), mBakeSteps.end(), [&](const BakeStep& s) {
+		return (s.mPass == BAKE_ILLUMINATION || s.mPass == BAKE_SWEEP) == lighting;
+	}), mBakeSteps.end());
+
+	shared_ptr<::Texture>& front = lighting ? mIlluminationTexture : mBakedTexture;
+	shared_ptr<::Texture>& target = lighting ? mIlluminationBack : mBakedBack;
+	if (!back)
+		target.reset();
+	else if (!target)
+		target = shared_ptr<::Texture>(new ::Texture(front->Width(), front->Height(), front->Depth(), lighting ? GL_R16F : GL_RG16,
+			lighting ? GL_RED : GL_RG, lighting ? GL_FLOAT : GL_UNSIGNED_SHORT, GL_LINEAR));
+
+	if (pass != BAKE_SWEEP) {
+		mBakeSteps.push_back({ pass, back, uvec3(0), size });
+		return;
+	}
 
-	glBindImageTexture(0, mTexture->GLTexture(), 0, GL_TRUE, 0, GL_READ_ONLY, GL_RG16);
-	glBindImageTexture(1, mBakedTexture->GLTexture(), 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RG16);
+	// the sweep starts at the light and moves along the axis it travels most along, see light_sweep.glsl
+	// A point light inside the volume is swept both ways from its slice. Rays almost parallel to the slices take their
+	// transmittance from far away, which is the price for O(N).
+	float scale = (float)(1u << mIlluminationLevel);
+	vec3 vsize((float)mBakeSource->Width(), (float)mBakeSource->Height(), (float)mBakeSource->Depth());
+	vec3 d;
+	vec3 lt;
+	if (mLightDirectional) {
+		d = normalize(mLightLocalDirection / LocalScale()) * vsize;
+		lt = vec3(-1e10f);
+	} else {
+		vec3 lp = (mLightLocalPosition / LocalScale() + .5f) * vsize;
+		d = vsize * .5f - lp;
+		lt = (lp + .5f) / scale - .5f;
+	}
+	int axis = 0;
+	for (int i = 1; i < 3; i++)
+		if (fabsf(d[i]) > fabsf(d[axis])) axis = i;
+	mSweepAxes = ivec3((axis + 1) % 3, (axis + 2) % 3, axis);
+	int n = (int)size[axis];
+
+	auto sweep = [&](int first, int last, int step) {
+		for (int s = first; s != last + step; s += step) {
+			BakeStep b = { BAKE_SWEEP, back, uvec3(0), uvec3(0) };
+			b.mSlice = s;
+			b.mFirstSlice = first;
+			b.mSliceStep = step;
+			mBakeSteps.push_back(b);
+		}
+	};
+	if (mLightDirectional) {
+		if (d[axis] > 0.f)
+			sweep(0, n - 1, 1);
+		else
+			sweep(n - 1, 0, -1);
+	} else {
+		// away from the light's slice in both directions, only one of them if the light is outside
+		int above = std::max((int)ceilf(lt[axis]), 0);
+		int below = std::min((int)floorf(lt[axis]), n - 1);
+		if (above < n) sweep(above, n - 1, 1);
+		if (below >= 0) sweep(below, 0, -1);
+	}
+}
 
-	glDispatchCompute((mBakedTexture->Width() + 7) / 8, (mBakedTexture->Height() + 7) / 8, (mBakedTexture->Depth() + 7) / 8);
-	glMemoryBarrier(GL_ALL_BARRIER_BITS);
+// Adds a box to bake, into the back buffer when a bake into it is already under way since that replaces the texture
+void Volume::AddBakeStep(BakePass pass, const uvec3& mn, const uvec3& mx) {
+	if (!all(lessThan(mn, mx))) return;
+	bool back = pass == BAKE_ILLUMINATION ? mIlluminationBack != nullptr : mBakedBack != nullptr;
+	mBakeSteps.push_back({ pass, back, mn, mx });
+}
 
-	glBindImageTexture(0, 0, 0, GL_TRUE, 0, GL_READ_ONLY, GL_RG16);
-	glBindImageTexture(1, 0, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RG16);
+void Volume::BakeRegion(GLuint p, const uvec3& mn, const uvec3& mx) {
+	if (!all(lessThan(mn, mx))) return;
+	Shader::Uniform(p, "BakeOffset", ivec3(mn.x, mn.y, mn.z));
+	uvec3 groups = (mx - mn + 7u) / 8u;
+	glDispatchCompute(groups.x, groups.y, groups.z);
+}
+
+// Dispatches the steps of the bake in order until the GPU time they are estimated to take exceeds budget (in ms)
+// Boxes are cut into slabs of 8 slices (one work group deep) to fit, sweeps go a slice at a time. At least one
+// dispatch runs every frame so the bake always gets done. 0 runs all of them.
+void Volume::RunBakeSteps(float budget) {
+	// what the dispatches of the last frames took, the queries are only read once the GPU is done with them
+	for (auto& q : mBakeQueries) {
+		if (!q.mPending) continue;
+		GLint available = 0;
+		glGetQueryObjectiv(q.mQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) continue;
+		GLuint64 ns = 0;
+		glGetQueryObjectui64v(q.mQuery, GL_QUERY_RESULT, &ns);
+		q.mPending = false;
+		if (q.mVoxels > 0) mBakeCost[q.mPass] = (mBakeCost[q.mPass] + (double)ns / q.mVoxels) * .5;
+	}
+
+	// one timer query per run of steps of the same pass, they don't nest
+	int query = -1;
+	auto endQuery = [&]() {
+		if (query < 0) return;
+		glEndQuery(GL_TIME_ELAPSED);
+		mBakeQueries[query].mPending = true;
+		query = -1;
+	};
+	auto beginQuery = [&](BakePass pass) {
+		for (size_t i = 0; i < mBakeQueries.size() && query < 0; i++)
+			if (!mBakeQueries[i].mPending) query = (int)i;
+		if (query < 0 && mBakeQueries.size() < 8) {
+			BakeQuery q = {};
+			glGenQueries(1, &q.mQuery);
+			mBakeQueries.push_back(q);
+			query = (int)mBakeQueries.size() - 1;
+		}
+		// all of them are still in flight, this run isn't timed
+		if (query < 0) return;
+		mBakeQueries[query].mPass = pass;
+		mBakeQueries[query].mVoxels = 0;
+		glBeginQuery(GL_TIME_ELAPSED, mBakeQueries[query].mQuery);
+	};
+
+	double remaining = budget > 0.f ? budget * 1e6 : 1e300;
+	bool first = true;
+	int pass = -1;
+	bool back = false;
+	GLuint p = 0;
+	while (!mBakeSteps.empty()) {
+		BakeStep& s = mBakeSteps.front();
+		double cost = mBakeCost[s.mPass];
+
+		// a slice of the sweep, or as many slabs of the box as fit
+		uint64_t voxels;
+		uvec3 mx = s.mMax;
+		if (s.mPass == BAKE_SWEEP) {
+			::Texture& illumination = s.mBack ? *mIlluminationBack : *mIlluminationTexture;
+			uvec3 lightSize(illumination.Width(), illumination.Height(), illumination.Depth());
+			voxels = (uint64_t)lightSize[mSweepAxes.x] * lightSize[mSweepAxes.y];
+			if (!first && voxels * cost > remaining) break;
+		} else {
+			uvec3 e = s.mMax - s.mMin;
+			voxels = (uint64_t)e.x * e.y * e.z;
+			if (voxels * cost > remaining) {
+				uint64_t slab = (uint64_t)e.x * e.y * 8;
+				unsigned int slabs = (unsigned int)std::min(remaining / (slab * cost), (double)e.z);
+				if (slabs == 0 && !first) break;
+				mx.z = std::min(s.mMin.z + std::max(slabs, 1u) * 8u, s.mMax.z);
+				voxels = (uint64_t)e.x * e.y * (mx.z - s.mMin.z);
+			}
+		}
+
+		if (s.mPass != pass || s.mBack != back) {
+			endQuery();
+			pass = s.mPass;
+			back = s.mBack;
+			switch (s.mPass) {
+			case BAKE_LIT: p = BakeProgram(true, false, back); break;
+			case BAKE_CLASSIFY: p = BakeProgram(false, false, back); break;
+			case BAKE_ILLUMINATION: p = BakeProgram(true, true, back); break;
+			default: p = SweepProgram(back); break;
+			}
+			beginQuery(s.mPass);
+		}
+
+		if (s.mPass == BAKE_SWEEP) {
+			Shader::Uniform(p, "SliceStep", s.mSliceStep);
+			Shader::Uniform(p, "FirstSlice", s.mFirstSlice);
+			Shader::Uniform(p, "Slice", s.mSlice);
+			::Texture& illumination = back ? *mIlluminationBack : *mIlluminationTexture;
+			uvec3 lightSize(illumination.Width(), illumination.Height(), illumination.Depth());
+			glDispatchCompute((lightSize[mSweepAxes.x] + 7) / 8, (lightSize[mSweepAxes.y] + 7) / 8, 1);
+			// the next slice reads this one
+			glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+			mBakeSteps.pop_front();
+		} else {
+			BakeRegion(p, s.mMin, mx);
+			if (mx.z == s.mMax.z)
+				mBakeSteps.pop_front();
+			else
+				s.mMin.z = mx.z;
+		}
+		if (query >= 0) mBakeQueries[query].mVoxels += voxels;
+		remaining -= voxels * cost;
+		first = false;
+	}
+	endQuery();
+
+	// the draw samples what was just written
+	glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
 
+	glBindImageTexture(0, 0, 0, GL_TRUE, 0, GL_READ_ONLY, GL_R16);
+	glBindImageTexture(1, 0, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RG16);
+	if (mMask) glBindImageTexture(2, 0, 0, GL_TRUE, 0, GL_READ_ONLY, GL_R8UI);
+	glBindImageTexture(3, 0, 0, GL_TRUE, 0, GL_READ_WRITE, GL_R16F);
 	glUseProgram(0);
 
-	mDirty = false;
+	// done, the new bake replaces the one that was drawn meanwhile
+	if (mBakeSteps.empty()) {
+		if (mBakedBack) mBakedTexture.swap(mBakedBack);
+		if (mIlluminationBack) mIlluminationTexture.swap(mIlluminationBack);
+		mBakedBack.reset();
+		mIlluminationBack.reset();
+		mBakeSource.reset();
+	}
+}
+
+// Turns what changed since the last bake into steps for RunBakeSteps
+void Volume::Precompute() {
+	if (mBricks) {
+		PrecomputeBricks();
+		return;
+	}
+	if (!mTexture) return;
+
+	// a new texture holds nothing to draw until it is baked, and the baked texture means something else with an
+	// illumination texture than without, so those bake everything at once
+	bool hadIllumination = mIlluminationTexture != nullptr;
+	bool fresh = false;
+
+	uvec3 size(mTexture->Width(), mTexture->Height(), mTexture->Depth());
+	if (!mBakedTexture || mBakedTexture->Width() != size.x || mBakedTexture->Height() != size.y || mBakedTexture->Depth() != size.z) {
+		glEnable(GL_TEXTURE_3D);
+
+		// every texel is written by the bake, no need to fill it
+		mBakedTexture = shared_ptr<::Texture>(new ::Texture(size.x, size.y, size.z, GL_RG16, GL_RG, GL_UNSIGNED_SHORT, GL_LINEAR));
+		mDirty = true;
+		fresh = true;
+	}
+
+	// lighting is smooth, a texel of the illumination texture covers 2^level voxels along each axis
+	unsigned int scale = 1u << mIlluminationLevel;
+	uvec3 lightSize = (size + scale - 1u) / scale;
+	if (mIlluminationLevel == 0 && !Sweeping()) {
+		mIlluminationTexture.reset();
+		mTransmittanceTexture.reset();
+	}
+	else if (!mIlluminationTexture || mIlluminationTexture->Width() != lightSize.x || mIlluminationTexture->Height() != lightSize.y || mIlluminationTexture->Depth() != lightSize.z) {
+		mIlluminationTexture = shared_ptr<::Texture>(new ::Texture(lightSize.x, lightSize.y, lightSize.z, GL_R16F, GL_RED, GL_FLOAT, GL_LINEAR));
+		mDirty = true;
+		fresh = true;
+	}
+	if (hadIllumination != (mIlluminationTexture != nullptr)) {
+		mDirty = true;
+		fresh = true;
+	}
+	if (fresh) {
+		mBakeSteps.clear();
+		mBakedBack.reset();
+		mIlluminationBack.reset();
+	}
+	// a cine phase is only up for a few frames, it is classified and swept at once rather than shown late
+	bool now = fresh || mBakeBudget <= 0.f || (mCine && mTextureChanged);
+
+	// a bake into the back buffers runs to the end and gets swapped in, whatever changed meanwhile stays pending and
+	// is baked after that with the latest parameters instead of restarting it every frame. A new texture starts it
+	// over: the old one may be rewritten while the steps still read it, and finishing would only put a stale bake up.
+	if (!now && (mBakedBack || mIlluminationBack) && !mTextureChanged) return;
+	mTextureChanged = false;
+
+	// the steps bake with these until they are done, even if the parameters or the texture change meanwhile
+	mBakeParams = BakeParameters();
+	mBakeSource = mTexture;
+
+	// invalidated voxels, and the voxels they shadow for the lighting
+	uvec3 mn = mDirtyMin;
+	uvec3 mx = mDirtyMax;
+	uvec3 shadowMin = mn;
+	uvec3 shadowMax = mx;
+	if (all(lessThan(mn, mx))) ShadowBounds(size, shadowMin, shadowMax);
+	mDirtyMin = mDirtyMax = uvec3(0);
+
+	// parameter changes bake into the back buffers, so the old bake stays up until the new one is done
+	if (!mIlluminationTexture) {
+		if (mDirty || mLightDirty)
+			RestartPass(BAKE_LIT, !now, size);
+		else
+			AddBakeStep(BAKE_LIT, shadowMin, shadowMax);
+	} else {
+		if (mDirty)
+			RestartPass(BAKE_CLASSIFY, !now, size);
+		else
+			AddBakeStep(BAKE_CLASSIFY, mn, mx);
+
+		if (Sweeping()) {
+			// cheap enough to always do all of it
+			if (mDirty || mLightDirty || all(lessThan(shadowMin, shadowMax)))
+				RestartPass(BAKE_SWEEP, !now, lightSize);
+		} else if (mDirty || mLightDirty)
+			RestartPass(BAKE_ILLUMINATION, !now, lightSize);
+		else if (all(lessThan(shadowMin, shadowMax)))
+			AddBakeStep(BAKE_ILLUMINATION, shadowMin / scale, min((shadowMax + scale - 1u) / scale, lightSize));
+	}
+
+	mDirty = mLightDirty = false;
+
+	if (now) RunBakeSteps(0.f);
+}
+
+void Volume::Bake() {
+	// a light moved while a bake runs stays dirty until the bake after it
+	if (LightMoved()) mLightDirty = true;
+	if (mDirty || mLightDirty || !mBakeSlots.empty() || all(lessThan(mDirtyMin, mDirtyMax))) Precompute();
+	if (!mBakeSteps.empty()) RunBakeSteps(mBakeBudget);
 }
 
 void Volume::DrawGizmo(Camera& camera) {
@@ -101,7 +705,7 @@ void Volume::Draw(Camera& camera) {
 	camera.ResolveDepth(); // so we can access depth texture
 	camera.Set();
 
-	if (mDirty) Precompute();
+	Bake();
 
 	glEnable(GL_BLEND);
 	glDisable(GL_DEPTH_TEST);
@@ -111,6 +715,50 @@ void Volume::Draw(Camera& camera) {
 		AssetDatabase::gVolumeShader->EnableKeyword("SAMPLECOUNT");
 	else
 		AssetDatabase::gVolumeShader->DisableKeyword("SAMPLECOUNT");
+	if (mBricks)
+		AssetDatabase::gVolumeShader->EnableKeyword("BRICKED");
+	else
+		AssetDatabase::gVolumeShader->DisableKeyword("BRICKED");
+
+	if (mTransferDirty || !mTransferTexture) {
+		vector<vec4> table = mTransfer.Table(TRANSFER_TABLE_SIZE);
+		if (mTransferTexture)
+			mTransferTexture->Upload(table.data());
+		else
+			mTransferTexture = shared_ptr<::Texture>(new ::Texture(TRANSFER_TABLE_SIZE, 1, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_LINEAR, table.data()));
+		mPreintegratedStale = true;
+		mTransferDirty = false;
+	}
+	if (mPreintegrated) {
+		if (mPreintegrating && mPreintegrating->mDone) {
+			if (mPreintegratedTexture)
+				mPreintegratedTexture->Upload(mPreintegrating->mTable.data());
+			else
+				mPreintegratedTexture = shared_ptr<::Texture>(new ::Texture(PREINTEGRATED_TABLE_SIZE, PREINTEGRATED_TABLE_SIZE, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_LINEAR, mPreintegrating->mTable.data()));
+			mPreintegrating.reset();
+		}
+		if (mPreintegratedStale && !mPreintegrating) {
+			shared_ptr<PreintegrationJob> job(new PreintegrationJob());
+			TransferFunction transfer = mTransfer;
+			PreintegrationPool().Enqueue([job, transfer]() {
+				job->mTable = transfer.Preintegrate(PREINTEGRATED_TABLE_SIZE, PreintegrationPool());
+				job->mDone = true;
+			});
+			mPreintegrating = job;
+			mPreintegratedStale = false;
+		}
+	}
+	// samples are classified one by one until the first table is there
+	bool preintegrated = mPreintegrated && mPreintegratedTexture;
+	if (preintegrated)
+		AssetDatabase::gVolumeShader->EnableKeyword("PREINTEGRATED");
+	else
+		AssetDatabase::gVolumeShader->DisableKeyword("PREINTEGRATED");
+	bool illumination = !mBricks && mIlluminationTexture;
+	if (illumination)
+		AssetDatabase::gVolumeShader->EnableKeyword("ILLUMINATION");
+	else
+		AssetDatabase::gVolumeShader->DisableKeyword("ILLUMINATION");
 
 	GLuint p = AssetDatabase::gVolumeShader->Use();
 
@@ -122,14 +770,50 @@ void Volume::Draw(Camera& camera) {
 	Shader::Uniform(p, "PlanePoint", mPlanePoint);
 	Shader::Uniform(p, "PlaneNormal", mPlaneNormal);
 	Shader::Uniform(p, "StepSize", mStepSize);
+	Shader::Uniform(p, "WindowMin", mStats.ToTexel(mWindowMin));
+	Shader::Uniform(p, "WindowMax", mStats.ToTexel(mWindowMax));
 
 	Shader::Uniform(p, "Volume", 0);
 	Shader::Uniform(p, "DepthTexture", 1);
+	Shader::Uniform(p, "Transfer", 4);
+	Shader::Uniform(p, "TransferSize", (float)TRANSFER_TABLE_SIZE);
+	glActiveTexture(GL_TEXTURE4);
+	glBindTexture(GL_TEXTURE_2D, mTransferTexture->GLTexture());
+	if (preintegrated) {
+		Shader::Uniform(p, "Preintegrated", 5);
+		Shader::Uniform(p, "PreintegratedSize", (float)PREINTEGRATED_TABLE_SIZE);
+		Shader::Uniform(p, "ReferenceStep", REFERENCE_STEP);
+		glActiveTexture(GL_TEXTURE5);
+		glBindTexture(GL_TEXTURE_2D, mPreintegratedTexture->GLTexture());
+	}
 
-	if (mBakedTexture) {
+	if (mBricks) {
+		const BrickedVolume& v = *mBricks->Volume();
+		uvec3 count = v.BrickCount();
+		Shader::Uniform(p, "PageTable", 2);
+		Shader::Uniform(p, "AtlasSlots", mBricks->AtlasSlots());
+		Shader::Uniform(p, "BrickCount", ivec3(count.x, count.y, count.z));
+		Shader::Uniform(p, "VolumeSize", vec3((float)v.Width(), (float)v.Height(), (float)v.Depth()));
+		Shader::Uniform(p, "Frame", mBricks->Frame());
+
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_3D, mBricks->BakedAtlas()->GLTexture());
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_3D, mBricks->PageTable()->GLTexture());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, mBricks->FeedbackBuffer());
+	} else if (mBakedTexture) {
 		glActiveTexture(GL_TEXTURE0);
 		glBindTexture(GL_TEXTURE_3D, mBakedTexture->GLTexture());
 	}
+	if (illumination) {
+		// the illumination texture can cover a few more voxels than the volume
+		unsigned int scale = 1u << mIlluminationLevel;
+		Shader::Uniform(p, "Illumination", 3);
+		Shader::Uniform(p, "IlluminationScale", vec3(mBakedTexture->Width(), mBakedTexture->Height(), mBakedTexture->Depth()) /
+			(vec3(mIlluminationTexture->Width(), mIlluminationTexture->Height(), mIlluminationTexture->Depth()) * (float)scale));
+		glActiveTexture(GL_TEXTURE3);
+		glBindTexture(GL_TEXTURE_3D, mIlluminationTexture->GLTexture());
+	}
 
 	glActiveTexture(GL_TEXTURE1);
 	glBindTexture(GL_TEXTURE_2D, camera.ResolveDepthBuffer());
@@ -137,6 +821,12 @@ void Volume::Draw(Camera& camera) {
 	AssetDatabase::gCubeMesh->BindVAO();
 	glDrawElements(GL_TRIANGLES, AssetDatabase::gCubeMesh->ElementCount(), GL_UNSIGNED_INT, 0);
 
+	if (mBricks) {
+		// the feedback is read back with glGetBufferSubData
+		glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+	}
+
 	glBindVertexArray(0);
 	glUseProgram(0);
 
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <algorithm>
+#include <deque>
 #include <unordered_map>
 #include <gl/glew.h>
 #include <memory>
@@ -10,6 +12,10 @@
 #include "../Pipeline/Texture.hpp"
 #include "../Pipeline/Shader.hpp"
 #include "../Pipeline/Mesh.hpp"
+#include "../Util/TransferFunction.hpp"
+#include "../Util/VolumeBake.hpp"
+#include "../Util/VolumeStats.hpp"
+#include "BrickCache.hpp"
 
 class Volume : public Object, public VRInteractable {
 public:
@@ -18,19 +24,93 @@ public:
 
 	inline float StepSize() const { return mStepSize; }
 	inline bool DisplaySampleCount() const { return mDisplaySampleCount; }
-	inline float Density() const { return mDensity; }
-	inline float Exposure() const { return mExposure; }
-	inline float Threshold() const { return mThreshold; }
+	inline float Density() const { return mTransfer.mDensity; }
+	inline float Exposure() const { return mTransfer.mExposure; }
+	inline float Threshold() const { return mTransfer.mThreshold; }
+	inline const TransferFunction& Transfer() const { return mTransfer; }
+	inline float WindowMin() const { return mWindowMin; }
+	inline float WindowMax() const { return mWindowMax; }
+	inline const VolumeStats& Stats() const { return mStats; }
 
 	inline void StepSize(float x) { mStepSize = x; }
+	// Classifies whole segments between samples from a pre-integrated table instead of single samples, which looks
+	// about the same with a few times the step size
+	inline bool Preintegrated() const { return mPreintegrated; }
+	inline void Preintegrated(bool x) { mPreintegrated = x; }
 	inline void DisplaySampleCount(bool x) { mDisplaySampleCount = x; }
-	inline void Density(float x) { mDensity = x; mDensity = fmaxf(mDensity, 0.f); mDirty = true; }
-	inline void Exposure(float x) { mExposure = x; mExposure = fmaxf(mExposure, 0.f); mDirty = true; }
-	inline void Threshold(float x) { mThreshold = x; mThreshold = fminf(fmaxf(mThreshold, 0.f), 1.f); mDirty = true; }
+	// The transfer function is applied while raymarching, so these show up in the next frame. Density and threshold
+	// change the shadows too, the lighting is baked again over the next frames.
+	inline void Density(float x) { mTransfer.mDensity = fmaxf(x, 0.f); mTransferDirty = true; mLightDirty = true; }
+	inline void Exposure(float x) { mTransfer.mExposure = fmaxf(x, 0.f); mTransferDirty = true; }
+	inline void Threshold(float x) { mTransfer.mThreshold = fminf(fmaxf(x, 0.f), 1.f); mTransferDirty = true; mLightDirty = true; }
+	void Transfer(const TransferFunction& transfer);
+	// Threshold in modality units (Hounsfield units for CT)
+	inline void ThresholdValue(float v) { Threshold(mWindowMax > mWindowMin ? (v - mWindowMin) / (mWindowMax - mWindowMin) : 0.f); }
+	// Range of modality values mapped to the full intensity range. Applied while raymarching like the transfer function,
+	// only the shadows are baked again.
+	inline void Window(float mn, float mx) { mWindowMin = mn; mWindowMax = fmaxf(mx, mn); mTransferDirty = true; mLightDirty = true; }
 
 	inline virtual bool Draggable() override { return true; }
 
-	void Texture(const std::shared_ptr<::Texture>& tex);
+	inline std::shared_ptr<::Texture> Texture() const { return mTexture; }
+	// level is the VolumePyramid level tex holds, the mask stays at level 0
+	// Keeps the stats and window. The new texture is baked over the next frames while the last bake is drawn, a bake
+	// still running for the previous one starts over with the new texture.
+	void Texture(const std::shared_ptr<::Texture>& tex, unsigned int level = 0);
+	inline unsigned int TextureLevel() const { return mTextureLevel; }
+	// Draws a bricked volume streamed from disk instead of the texture, masks aren't supported then
+	inline std::shared_ptr<BrickCache> Bricks() const { return mBricks; }
+	void Bricks(const std::shared_ptr<BrickCache>& bricks);
+	// Streams and bakes the bricks the last frames needed, once per frame before drawing
+	void UpdateBricks(const glm::vec3& cameraPosition);
+	// Optional GL_R8UI mask from ImageLoader::LoadMask, nullptr to disable masking
+	void Mask(const std::shared_ptr<::Texture>& mask, unsigned int bits = 1);
+	// Sets how texels map to modality values and resets the window to the full range of the volume
+	void Stats(const VolumeStats& stats);
+	// Call when the contents of the texture changed
+	inline void Invalidate() { mDirty = true; }
+	// Call when the voxels in [min, max) changed, only the voxels they can shadow are baked again
+	void Invalidate(const glm::uvec3& min, const glm::uvec3& max);
+
+	// Point light in world space
+	// An attached light keeps its place relative to the volume, so moving or rotating the volume doesn't need a new bake.
+	inline glm::vec3 LightPosition() { UpdateTransform(); return mLightPosition; }
+	inline glm::vec3 LightDirection() { UpdateTransform(); return mLightDirection; }
+	void LightPosition(const glm::vec3& p);
+	void LightDirection(const glm::vec3& d);
+	inline bool LightAttached() const { return mLightAttached; }
+	inline void LightAttached(bool x) { mLightAttached = x; }
+	// Lighting is baked into a separate texture at 1 / 2^level of the volume resolution and combined while raymarching.
+	// 0 bakes it into the classified volume at full resolution, unless the light is swept. Bricked volumes always do that.
+	inline unsigned int IlluminationLevel() const { return mIlluminationLevel; }
+	inline void IlluminationLevel(unsigned int x) { mIlluminationLevel = std::min(x, 2u); mDirty = true; }
+	// Propagates the light slice by slice along the axis it travels most along, instead of marching a shadow ray from
+	// every voxel. Bricked volumes always march.
+	inline bool LightSweep() const { return mLightSweep; }
+	inline void LightSweep(bool x) { mLightSweep = x; mDirty = true; }
+	// Set while the texture is replaced every few frames (CineVolume). A new texture is baked at once, classified and
+	// lit by the sweep at IlluminationLevel whatever LightSweep says, so showing a phase costs one frame.
+	inline bool Cine() const { return mCine; }
+	inline void Cine(bool x) { mCine = x; mDirty = true; }
+	// Directional light along LightDirection instead of a point light at LightPosition
+	inline bool LightDirectional() const { return mLightDirectional; }
+	inline void LightDirectional(bool x) { mLightDirectional = x; mLightDirty = true; }
+
+	// GPU time in ms the bake may take per frame, a bake that doesn't fit carries on over the next frames while the
+	// previous one is drawn. Changes made meanwhile are baked once it is swapped in. 0 bakes everything at once.
+	// Bricked volumes always bake at once.
+	inline float BakeBudget() const { return mBakeBudget; }
+	inline void BakeBudget(float ms) { mBakeBudget = fmaxf(ms, 0.f); }
+	inline bool Baking() const { return !mBakeSteps.empty(); }
+	// The texture the bake under way reads, nullptr once it is done. It mustn't be written to until then.
+	inline std::shared_ptr<::Texture> BakeSource() const { return mBakeSource; }
+
+	// What the bake shader gets, VolumeBake::Bake with these produces the same texels as an unbricked bake at IlluminationLevel 0 without the sweep
+	VolumeBakeParams BakeParameters();
+	// Bakes whatever changed now instead of in the next Draw, within the budget
+	void Bake();
+	// RG16 masked texel values (and light, unless there is an illumination texture), nullptr until the first bake
+	inline std::shared_ptr<::Texture> BakedTexture() const { return mBakedTexture; }
 
 	::Bounds Bounds() override { return ::Bounds(WorldPosition(), WorldScale() * .5f, WorldRotation()); };
 	void Draw(Camera& camera) override;
@@ -42,11 +122,21 @@ private:
 	bool mDisplaySampleCount;
 
 	bool mMask;
+	unsigned int mMaskBits;
 	glm::vec3 mPlanePoint;
 	glm::vec3 mPlaneNormal;
-	float mExposure;
-	float mThreshold;
-	float mDensity;
+	TransferFunction mTransfer;
+	bool mTransferDirty;
+	std::shared_ptr<::Texture> mTransferTexture;
+	bool mPreintegrated;
+	// Built from the transfer function on a thread of its own and uploaded once it is done, the previous table is
+	// drawn meanwhile. Changes made during a build wait for it, so a held key builds only the latest transfer function.
+	struct PreintegrationJob;
+	std::shared_ptr<::Texture> mPreintegratedTexture;
+	std::shared_ptr<PreintegrationJob> mPreintegrating;
+	bool mPreintegratedStale;
+	float mWindowMin;
+	float mWindowMax;
 	glm::vec3 mLightPosition;
 	glm::vec3 mLightDirection;
 	float mLightDensity;
@@ -55,12 +145,91 @@ private:
 	float mLightAngle;
 	float mStepSize;
 
+	// light relative to the volume (rotated, not scaled), what the bake works with
+	bool mLightAttached;
+	glm::vec3 mLightLocalPosition;
+	glm::vec3 mLightLocalDirection;
+	// light and scale of the last bake, it only runs again if they change
+	glm::vec3 mBakedLightPosition;
+	glm::vec3 mBakedLightDirection;
+	glm::vec3 mBakedScale;
+
+	// everything needs to be baked again
 	bool mDirty;
+	// only the lighting
+	bool mLightDirty;
+	// voxels invalidated since the last bake, empty if min >= max
+	glm::uvec3 mDirtyMin;
+	glm::uvec3 mDirtyMax;
+
+	VolumeStats mStats;
 
 	std::shared_ptr<::Texture> mTexture;
+	unsigned int mTextureLevel;
+	std::shared_ptr<::Texture> mMaskTexture;
 	std::shared_ptr<::Texture> mBakedTexture;
+	unsigned int mIlluminationLevel;
+	std::shared_ptr<::Texture> mIlluminationTexture;
+	bool mLightSweep;
+	bool mLightDirectional;
+	bool mCine;
+	// how much light reaches each illumination texel, read back by the next slice of the sweep
+	std::shared_ptr<::Texture> mTransmittanceTexture;
+
+	// A dispatch of a bake spread over frames, a box of voxels (illumination texels for the lighting) or a slice of the sweep
+	enum BakePass { BAKE_LIT, BAKE_CLASSIFY, BAKE_ILLUMINATION, BAKE_SWEEP, BAKE_PASS_COUNT };
+	struct BakeStep {
+		BakePass mPass;
+		// writes the back buffer, which replaces the texture once every step is done
+		bool mBack;
+		glm::uvec3 mMin;
+		glm::uvec3 mMax;
+		int mSlice;
+		int mFirstSlice;
+		int mSliceStep;
+	};
+	struct BakeQuery {
+		GLuint mQuery;
+		BakePass mPass;
+		uint64_t mVoxels;
+		bool mPending;
+	};
+	float mBakeBudget;
+	std::deque<BakeStep> mBakeSteps;
+	// what the steps were planned with, changes made meanwhile wait for the next bake
+	VolumeBakeParams mBakeParams;
+	std::shared_ptr<::Texture> mBakeSource;
+	// set by Texture(), a bake reading the old texture doesn't wait to finish
+	bool mTextureChanged;
+	std::shared_ptr<::Texture> mBakedBack;
+	std::shared_ptr<::Texture> mIlluminationBack;
+	glm::ivec3 mSweepAxes;
+	// GPU ns per voxel (or illumination texel) of every pass, measured with the timer queries
+	double mBakeCost[BAKE_PASS_COUNT];
+	std::vector<BakeQuery> mBakeQueries;
+
+	std::shared_ptr<BrickCache> mBricks;
+	// atlas slots and bricks uploaded since the last bake
+	std::vector<glm::uvec2> mBakeSlots;
+	bool mBricksStreaming;
+	// voxels of the bricks that arrived while streaming, their neighbours are relit once it settles
+	glm::uvec3 mStreamedMin;
+	glm::uvec3 mStreamedMax;
 	
+	// cine phases are always swept, it is the cheapest way to light a whole volume
+	inline bool Sweeping() const { return mLightSweep || mCine; }
+	bool LightMoved();
+	void ShadowBounds(const glm::uvec3& size, glm::uvec3& min, glm::uvec3& max);
+	void BakeUniforms(GLuint program);
+	GLuint BakeProgram(bool light, bool illumination, bool back);
+	GLuint SweepProgram(bool back);
+	void BakeRegion(GLuint program, const glm::uvec3& min, const glm::uvec3& max);
+	void LightKeywords(Shader& shader);
+	void RestartPass(BakePass pass, bool back, const glm::uvec3& size);
+	void AddBakeStep(BakePass pass, const glm::uvec3& min, const glm::uvec3& max);
+	void RunBakeSteps(float budget);
 	void Precompute();
+	void PrecomputeBricks();
 
 protected:
 	virtual bool UpdateTransform() override;
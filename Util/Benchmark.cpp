@@ -0,0 +1,388 @@
+#include "Benchmark.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "DicomGenerator.hpp"
+#include "ImageLoader.hpp"
+#include "SliceKernels.hpp"
+#include "ThreadPool.hpp"
+#include "VolumeBake.hpp"
+#include "VolumeCache.hpp"
+#include "../Pipeline/AssetDatabase.hpp"
+#include "../Scene/Volume.hpp"
+
+using namespace std;
+using namespace glm;
+
+namespace fs = std::filesystem;
+
+// Loads a folder repeatedly with the volume cache disabled, returns the best and mean slices/second
+bool MeasureLoad(const string& folder, int iterations, unsigned int& slices, double& best, double& mean) {
+	bool cache = VolumeCache::sEnabled;
+	VolumeCache::sEnabled = false;
+
+	best = 0.0;
+	mean = 0.0;
+	slices = 0;
+	for (int i = 0; i < iterations; i++) {
+		auto start = chrono::high_resolution_clock::now();
+		vec3 size;
+		auto tex = ImageLoader::LoadVolume(folder, size);
+		double seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+		if (!tex) {
+			printf("Failed to load %s\n", folder.c_str());
+			VolumeCache::sEnabled = cache;
+			return false;
+		}
+		slices = tex->Depth();
+		double sps = slices / seconds;
+		best = std::max(best, sps);
+		mean += sps / iterations;
+	}
+
+	VolumeCache::sEnabled = cache;
+	return true;
+}
+
+// loader <folder> [iterations]: loads a volume repeatedly and reports slices/second
+int BenchmarkLoader(int argc, char** argv) {
+	if (argc < 1) {
+		printf("usage: --benchmark loader <folder> [iterations]\n");
+		return EXIT_FAILURE;
+	}
+	string folder = argv[0];
+	int iterations = argc > 1 ? atoi(argv[1]) : 5;
+
+	unsigned int slices;
+	double best, mean;
+	if (!MeasureLoad(folder, iterations, slices, best, mean)) return EXIT_FAILURE;
+
+	printf("loader: %u slices, %u threads, best %.1f slices/s, mean %.1f slices/s\n", slices, ThreadPool::Shared().ThreadCount(), best, mean);
+	return EXIT_SUCCESS;
+}
+
+// codecs [slices] [size] [iterations]: writes a synthetic series in every transfer syntax this build can encode
+// and compares how fast each one loads
+int BenchmarkCodecs(int argc, char** argv) {
+	unsigned int depth = argc > 0 ? (unsigned int)atoi(argv[0]) : 256;
+	unsigned int size = argc > 1 ? (unsigned int)atoi(argv[1]) : 512;
+	int iterations = argc > 2 ? atoi(argv[2]) : 3;
+
+	error_code ec;
+	fs::path root = fs::temp_directory_path(ec) / "CDVis" / "codecs";
+
+	for (int e = 0; e < DICOM_ENCODING_COUNT; e++) {
+		DicomEncoding encoding = (DicomEncoding)e;
+		if (!DicomGenerator::Supported(encoding)) {
+			printf("codecs: %-14s not available\n", DicomGenerator::EncodingName(encoding));
+			continue;
+		}
+
+		string folder = (root / DicomGenerator::EncodingName(encoding)).string();
+		fs::remove_all(folder, ec);
+		if (!DicomGenerator::WriteSeries(folder, size, size, depth, encoding)) return EXIT_FAILURE;
+
+		uintmax_t bytes = 0;
+		for (fs::directory_iterator it(folder, ec), end; !ec && it != end; it.increment(ec))
+			bytes += it->file_size(ec);
+
+		unsigned int slices;
+		double best, mean;
+		bool ok = MeasureLoad(folder, iterations, slices, best, mean);
+		fs::remove_all(folder, ec);
+		if (!ok) return EXIT_FAILURE;
+
+		printf("codecs: %-14s %ux%ux%u, %.1f MB on disk, best %.1f slices/s (%.1f MB/s decoded), mean %.1f slices/s\n",
+			DicomGenerator::EncodingName(encoding), size, size, slices, bytes / 1048576.0, best, best * size * size * 2 / 1048576.0, mean);
+	}
+	return EXIT_SUCCESS;
+}
+
+// synthetic [width] [height] [slices] [encoding] [bits] [iterations] [output.json]: writes a synthetic series into a
+// temporary folder and times every stage of loading it, the results are printed (and written to output) as JSON
+int BenchmarkSynthetic(int argc, char** argv) {
+	unsigned int width = argc > 0 ? (unsigned int)atoi(argv[0]) : 512;
+	unsigned int height = argc > 1 ? (unsigned int)atoi(argv[1]) : width;
+	unsigned int depth = argc > 2 ? (unsigned int)atoi(argv[2]) : 256;
+	DicomEncoding encoding = argc > 3 ? DicomGenerator::ParseEncoding(argv[3]) : DICOM_UNCOMPRESSED;
+	unsigned int bits = argc > 4 ? (unsigned int)atoi(argv[4]) : 12;
+	int iterations = argc > 5 ? std::max(atoi(argv[5]), 1) : 3;
+	string output = argc > 6 ? argv[6] : "";
+
+	if (encoding == DICOM_ENCODING_COUNT) {
+		printf("unknown encoding %s, expected one of:", argv[3]);
+		for (int e = 0; e < DICOM_ENCODING_COUNT; e++) printf(" %s", DicomGenerator::EncodingName((DicomEncoding)e));
+		printf("\n");
+		return EXIT_FAILURE;
+	}
+
+	error_code ec;
+	string folder = (fs::temp_directory_path(ec) / "CDVis" / "synthetic").string();
+	fs::remove_all(folder, ec);
+	if (!DicomGenerator::WriteSeries(folder, width, height, depth, encoding, bits)) return EXIT_FAILURE;
+
+	uintmax_t bytes = 0;
+	for (fs::directory_iterator it(folder, ec), end; !ec && it != end; it.increment(ec))
+		bytes += it->file_size(ec);
+
+	bool cache = VolumeCache::sEnabled;
+	VolumeCache::sEnabled = false;
+	ImageLoader::sProfile = true;
+
+	// seconds per stage of every run, the total wall time last
+	vector<vector<double>> runs;
+	for (int i = 0; i < iterations; i++) {
+		ImageLoader::ResetProfile();
+		auto start = chrono::high_resolution_clock::now();
+		vec3 size;
+		auto tex = ImageLoader::LoadVolume(folder, size);
+		if (!tex) break;
+
+		// uploads are only done once the driver has copied them
+		auto finish = chrono::high_resolution_clock::now();
+		glFinish();
+		double wait = chrono::duration<double>(chrono::high_resolution_clock::now() - finish).count();
+
+		vector<double> run(LOADER_STAGE_COUNT + 1);
+		for (int s = 0; s < LOADER_STAGE_COUNT; s++)
+			run[s] = ImageLoader::ProfileSeconds((LoaderStage)s);
+		run[LOADER_UPLOAD] += wait;
+		run[LOADER_STAGE_COUNT] = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+		runs.push_back(run);
+	}
+
+	ImageLoader::sProfile = false;
+	VolumeCache::sEnabled = cache;
+	fs::remove_all(folder, ec);
+	if (runs.size() != (size_t)iterations) {
+		printf("Failed to load %s\n", folder.c_str());
+		return EXIT_FAILURE;
+	}
+
+	auto stages = [](const vector<double>& run) {
+		string str = "{";
+		char buf[64];
+		for (int s = 0; s < LOADER_STAGE_COUNT; s++) {
+			snprintf(buf, 64, "\"%s\": %.6f, ", ImageLoader::StageName((LoaderStage)s), run[s]);
+			str += buf;
+		}
+		snprintf(buf, 64, "\"total\": %.6f}", run[LOADER_STAGE_COUNT]);
+		return str + buf;
+	};
+
+	vector<double> best(LOADER_STAGE_COUNT + 1, 1e30);
+	for (const auto& r : runs)
+		for (size_t s = 0; s < r.size(); s++)
+			best[s] = std::min(best[s], r[s]);
+
+	char header[512];
+	snprintf(header, 512,
+		"{\n\t\"benchmark\": \"synthetic\",\n\t\"width\": %u,\n\t\"height\": %u,\n\t\"slices\": %u,\n\t\"encoding\": \"%s\",\n\t\"bits\": %u,\n"
+		"\t\"threads\": %u,\n\t\"bytes_on_disk\": %llu,\n\t\"stage_seconds_summed_over_threads\": true,\n",
+		width, height, depth, DicomGenerator::EncodingName(encoding), bits, ThreadPool::Shared().ThreadCount(), (unsigned long long)bytes);
+	string json = header;
+	json += "\t\"runs\": [\n";
+	for (size_t i = 0; i < runs.size(); i++)
+		json += "\t\t" + stages(runs[i]) + (i + 1 < runs.size() ? ",\n" : "\n");
+	json += "\t],\n\t\"best\": " + stages(best) + "\n}\n";
+
+	printf("%s", json.c_str());
+	if (!output.empty()) {
+		ofstream file(output);
+		if (!file) {
+			printf("Failed to write %s\n", output.c_str());
+			return EXIT_FAILURE;
+		}
+		file << json;
+	}
+	return EXIT_SUCCESS;
+}
+
+// Best time of func over iterations runs, in seconds
+double TimeBest(int iterations, const function<void()>& func) {
+	double best = 1e30;
+	for (int i = 0; i < iterations; i++) {
+		auto start = chrono::high_resolution_clock::now();
+		func();
+		best = std::min(best, chrono::duration<double>(chrono::high_resolution_clock::now() - start).count());
+	}
+	return best;
+}
+
+// interleave [iterations]: converts 512x512 slices into the R16 texture layout, the old strided loop (x outer, rescaling
+// each sample) against the kernels, both into the same buffer
+int BenchmarkInterleave(int argc, char** argv) {
+	int iterations = argc > 0 ? atoi(argv[0]) : 200;
+	const unsigned int w = 512;
+	const unsigned int h = 512;
+	const size_t count = (size_t)w * h;
+	const float scale = 16.f;
+	const float bias = 0.f;
+
+	// 12 bit CT-like samples
+	vector<uint16_t> src(count);
+	mt19937 rng(0);
+	for (auto& s : src) s = (uint16_t)(rng() & 0x0FFF);
+	vector<uint16_t> dst(count);
+
+	double strided = TimeBest(iterations, [&]() {
+		uint16_t* slice = dst.data();
+		const uint16_t* pixelData = src.data();
+		for (int x = 0; x < (int)w; x++)
+			for (int y = 0; y < (int)h; y++) {
+				int j = x + y * w;
+				slice[j] = (uint16_t)std::min(std::max((pixelData[j] & 0x0FFF) * scale + bias, 0.f), 65535.f);
+			}
+	});
+	printf("interleave: %ux%u R16, strided loop %.3f ms/slice\n", w, h, strided * 1000.0);
+
+	SliceKernelIsa supported = GetSliceKernelIsa();
+	for (int isa = SLICE_KERNEL_SCALAR; isa <= supported; isa++) {
+		SetSliceKernelIsa((SliceKernelIsa)isa);
+		double t = TimeBest(iterations, [&]() {
+			RescaleSamples(src.data(), count, 12, false, scale, bias, dst.data());
+		});
+		printf("interleave: %-6s kernel %.3f ms/slice, %.1fx\n", SliceKernelIsaName((SliceKernelIsa)isa), t * 1000.0, strided / t);
+	}
+	SetSliceKernelIsa(supported);
+
+	return EXIT_SUCCESS;
+}
+
+// bake [size] [iterations] [shader]: bakes a synthetic size^3 volume on the CPU with every instruction set, reports
+// voxels/second and checks the SIMD bakes against the scalar one for a point and a directional light. With shader it
+// also bakes the volume with the shader and checks the CPU bake against it, which needs a GL context.
+int BenchmarkBake(int argc, char** argv) {
+	unsigned int size = argc > 0 ? (unsigned int)atoi(argv[0]) : 128;
+	int iterations = argc > 1 ? atoi(argv[1]) : 3;
+	bool shader = argc > 2 && string(argv[2]) == "shader";
+	const size_t count = (size_t)size * size * size;
+
+	// soft tissue with a bony shell and a brighter lump inside, plus a little noise
+	vector<uint16_t> volume(count);
+	ThreadPool::Shared().ParallelFor(0, size, [&](size_t z) {
+		mt19937 rng((unsigned int)z);
+		uniform_real_distribution<float> noise(-.02f, .02f);
+		for (unsigned int y = 0; y < size; y++)
+			for (unsigned int x = 0; x < size; x++) {
+				vec3 p = vec3((float)x, (float)y, (float)z) / (float)size * 2.f - 1.f;
+				float r = length(p);
+				float v = 0.f;
+				if (r < .8f) v = .3f;
+				if (r > .65f && r < .75f) v = .8f;
+				if (length(p - vec3(.3f, .2f, 0.f)) < .2f) v = .6f;
+				v = std::min(std::max(v + noise(rng), 0.f), 1.f);
+				volume[x + size * (y + (size_t)size * z)] = (uint16_t)(v * 65535.f);
+			}
+	});
+
+	ThreadPool& pool = ThreadPool::Shared();
+	vector<uint16_t> baked(count * 2);
+	vector<uint16_t> reference(count * 2);
+	SliceKernelIsa supported = GetSliceKernelIsa();
+	bool passed = true;
+	for (int directional = 0; directional < 2; directional++) {
+		VolumeBakeParams params;
+		if (directional) {
+			params.mLight = BAKE_LIGHT_DIRECTIONAL;
+			params.mLightDirection = normalize(vec3(-1.f, -.25f, 0.f));
+		}
+		for (int isa = SLICE_KERNEL_SCALAR; isa <= supported; isa++) {
+			SetSliceKernelIsa((SliceKernelIsa)isa);
+			vector<uint16_t>& dst = isa == SLICE_KERNEL_SCALAR ? reference : baked;
+			double t = TimeBest(iterations, [&]() {
+				VolumeBake::Bake(volume.data(), size, size, size, params, dst.data(), pool);
+			});
+
+			// the SIMD versions round exp a little differently
+			int maxError = 0;
+			if (isa != SLICE_KERNEL_SCALAR)
+				for (size_t i = 0; i < baked.size(); i++)
+					maxError = std::max(maxError, abs((int)baked[i] - (int)reference[i]));
+			bool ok = maxError <= 1;
+			passed = passed && ok;
+			printf("bake: %u^3 %s light %-6s %.2f Mvoxels/s on %u threads, max error %d: %s\n", size, directional ? "directional" : "point",
+				SliceKernelIsaName((SliceKernelIsa)isa), count / t / 1e6, pool.ThreadCount(), maxError, ok ? "ok" : "FAILED");
+		}
+	}
+	SetSliceKernelIsa(supported);
+	if (!shader) return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+
+	// the shader bakes at full resolution without the sweep, like VolumeBake
+	AssetDatabase::LoadAssets();
+	shared_ptr<Volume> v(new Volume());
+	v->Texture(shared_ptr<Texture>(new Texture(size, size, size, GL_R16, GL_RED, GL_UNSIGNED_SHORT, GL_LINEAR, volume.data())));
+	v->IlluminationLevel(0);
+	v->LightSweep(false);
+	v->BakeBudget(0.f);
+
+	// the GPU rounds and truncates shadow ray positions a little differently, a few voxels can pick up a different sample
+	const int tolerance = 256;
+	const double maxOver = .001;
+	vector<uint16_t> gpu(count * 2);
+	for (int directional = 0; directional < 2; directional++) {
+		v->LightDirectional(directional != 0);
+		glFinish();
+		auto start = chrono::high_resolution_clock::now();
+		v->Bake();
+		glFinish();
+		double gpuSeconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+
+		glBindTexture(GL_TEXTURE_3D, v->BakedTexture()->GLTexture());
+		glGetTexImage(GL_TEXTURE_3D, 0, GL_RG, GL_UNSIGNED_SHORT, gpu.data());
+		glBindTexture(GL_TEXTURE_3D, 0);
+
+		VolumeBake::Bake(volume.data(), size, size, size, v->BakeParameters(), baked.data(), pool);
+
+		int maxError = 0;
+		size_t over = 0;
+		for (size_t i = 0; i < gpu.size(); i++) {
+			int e = abs((int)gpu[i] - (int)baked[i]);
+			maxError = std::max(maxError, e);
+			if (e > tolerance) over++;
+		}
+		double fraction = (double)over / gpu.size();
+		bool ok = fraction <= maxOver;
+		passed = passed && ok;
+		printf("bake: %s light, shader %.2f Mvoxels/s, max error %d, %.4f%% of texels off by more than %d: %s\n", directional ? "directional" : "point",
+			count / gpuSeconds / 1e6, maxError, fraction * 100.0, tolerance, ok ? "ok" : "FAILED");
+	}
+
+	v.reset();
+	AssetDatabase::Cleanup();
+	return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool BenchmarkNeedsContext(int argc, char** argv) {
+	if (argc < 1) return false;
+	string name = argv[0];
+	if (name == "interleave") return false;
+	if (name == "bake") return argc > 3 && string(argv[3]) == "shader";
+	return true;
+}
+
+int RunBenchmark(int argc, char** argv) {
+	if (argc < 1) {
+		printf("usage: --benchmark <loader|interleave|codecs|synthetic|bake> [args]\n");
+		return EXIT_FAILURE;
+	}
+
+	string name = argv[0];
+	if (name == "loader") return BenchmarkLoader(argc - 1, argv + 1);
+	if (name == "interleave") return BenchmarkInterleave(argc - 1, argv + 1);
+	if (name == "codecs") return BenchmarkCodecs(argc - 1, argv + 1);
+	if (name == "synthetic") return BenchmarkSynthetic(argc - 1, argv + 1);
+	if (name == "bake") return BenchmarkBake(argc - 1, argv + 1);
+
+	printf("Unknown benchmark %s\n", name.c_str());
+	return EXIT_FAILURE;
+}
\ No newline at end of file
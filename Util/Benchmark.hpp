@@ -0,0 +1,8 @@
+#pragma once
+
+// Command line benchmarks, run with CDVis --benchmark <name> [args]
+// Most need a GL context, so they run after the window is created but before the scene is loaded. The ones that don't
+// run before GLFW is initialized, on hosts without a GPU too.
+int RunBenchmark(int argc, char** argv);
+// False if the benchmark runs on the CPU alone
+bool BenchmarkNeedsContext(int argc, char** argv);
\ No newline at end of file
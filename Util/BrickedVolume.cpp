@@ -0,0 +1,173 @@
+#include "BrickedVolume.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+
+#include "ThreadPool.hpp"
+
+#define BRICK_MAGIC 0x4B524243 // CBRK
+#define BRICK_VERSION 1
+// bricks start on a page boundary
+#define BRICK_ALIGNMENT 4096
+// bricks gathered in parallel before they are written out together
+#define BRICK_BATCH 64
+
+using namespace std;
+using namespace glm;
+
+namespace fs = std::filesystem;
+
+#pragma pack(push, 1)
+struct BrickHeader {
+	uint32_t mMagic;
+	uint32_t mVersion;
+	uint32_t mWidth;
+	uint32_t mHeight;
+	uint32_t mDepth;
+	uint32_t mBrickCount[3];
+	float mSize[3];
+	float mValueScale;
+	float mValueOffset;
+	float mMin;
+	float mMax;
+	// histogram bins, stored as uint32_t after the header, followed by a min and max uint16_t per brick
+	uint32_t mHistogramBins;
+	uint64_t mBrickOffset;
+};
+#pragma pack(pop)
+
+bool BrickedVolume::Write(const string& path, const uint16_t* data, unsigned int width, unsigned int height, unsigned int depth,
+	const vec3& size, const VolumeStats& stats) {
+	auto start = chrono::high_resolution_clock::now();
+
+	uvec3 count((width + BRICK_INTERIOR - 1) / BRICK_INTERIOR, (height + BRICK_INTERIOR - 1) / BRICK_INTERIOR, (depth + BRICK_INTERIOR - 1) / BRICK_INTERIOR);
+	unsigned int total = count.x * count.y * count.z;
+
+	BrickHeader header;
+	header.mMagic = BRICK_MAGIC;
+	header.mVersion = BRICK_VERSION;
+	header.mWidth = width;
+	header.mHeight = height;
+	header.mDepth = depth;
+	header.mBrickCount[0] = count.x;
+	header.mBrickCount[1] = count.y;
+	header.mBrickCount[2] = count.z;
+	header.mSize[0] = size.x;
+	header.mSize[1] = size.y;
+	header.mSize[2] = size.z;
+	header.mValueScale = stats.mValueScale;
+	header.mValueOffset = stats.mValueOffset;
+	header.mMin = stats.mMin;
+	header.mMax = stats.mMax;
+	header.mHistogramBins = (uint32_t)stats.mHistogram.size();
+	uint64_t tables = sizeof(BrickHeader) + sizeof(uint32_t) * stats.mHistogram.size() + sizeof(uint16_t) * 2 * total;
+	header.mBrickOffset = (tables + BRICK_ALIGNMENT - 1) / BRICK_ALIGNMENT * BRICK_ALIGNMENT;
+
+	error_code ec;
+	fs::create_directories(fs::path(path).parent_path(), ec);
+
+	// write to a temporary file first so an interrupted write never leaves a valid looking file behind
+	string tmp = path + ".tmp";
+	ofstream file(tmp, ios::binary);
+	if (!file) {
+		printf("Failed to write bricked volume %s\n", path.c_str());
+		return false;
+	}
+
+	vector<uint16_t> ranges(2 * total);
+	vector<uint16_t> batch((size_t)BRICK_BATCH * BRICK_VOXELS);
+	file.seekp(header.mBrickOffset);
+	for (unsigned int first = 0; first < total; first += BRICK_BATCH) {
+		unsigned int n = std::min(total - first, (unsigned int)BRICK_BATCH);
+		ThreadPool::Shared().ParallelFor(0, n, [&](size_t i) {
+			unsigned int brick = first + (unsigned int)i;
+			ivec3 b(brick % count.x, (brick / count.x) % count.y, brick / (count.x * count.y));
+			ivec3 origin = b * BRICK_INTERIOR - BRICK_BORDER;
+			uint16_t* dst = batch.data() + i * BRICK_VOXELS;
+
+			uint16_t lo = 0xFFFF;
+			uint16_t hi = 0;
+			for (int z = 0; z < BRICK_SIZE; z++) {
+				size_t sz = (size_t)std::min(std::max(origin.z + z, 0), (int)depth - 1);
+				for (int y = 0; y < BRICK_SIZE; y++) {
+					size_t sy = (size_t)std::min(std::max(origin.y + y, 0), (int)height - 1);
+					const uint16_t* row = data + (sz * height + sy) * width;
+					for (int x = 0; x < BRICK_SIZE; x++) {
+						uint16_t v = row[std::min(std::max(origin.x + x, 0), (int)width - 1)];
+						lo = std::min(lo, v);
+						hi = std::max(hi, v);
+						*dst++ = v;
+					}
+				}
+			}
+			ranges[2 * brick] = lo;
+			ranges[2 * brick + 1] = hi;
+		});
+		file.write((const char*)batch.data(), (size_t)n * BRICK_VOXELS * sizeof(uint16_t));
+	}
+
+	file.seekp(0);
+	file.write((const char*)&header, sizeof(BrickHeader));
+	file.write((const char*)stats.mHistogram.data(), sizeof(uint32_t) * stats.mHistogram.size());
+	file.write((const char*)ranges.data(), sizeof(uint16_t) * ranges.size());
+
+	bool good = file.good();
+	file.close();
+	if (!good) {
+		fs::remove(tmp, ec);
+		printf("Failed to write bricked volume %s\n", path.c_str());
+		return false;
+	}
+	fs::rename(tmp, path, ec);
+	if (ec) {
+		fs::remove(tmp, ec);
+		return false;
+	}
+
+	double seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+	printf("wrote %u bricks to %s in %.2fs\n", total, path.c_str(), seconds);
+	return true;
+}
+
+shared_ptr<BrickedVolume> BrickedVolume::Open(const string& path) {
+	ifstream file(path, ios::binary);
+	if (!file) return nullptr;
+
+	BrickHeader header;
+	if (!file.read((char*)&header, sizeof(BrickHeader)) || header.mMagic != BRICK_MAGIC || header.mVersion != BRICK_VERSION) return nullptr;
+
+	shared_ptr<BrickedVolume> volume(new BrickedVolume());
+	volume->mPath = path;
+	volume->mWidth = header.mWidth;
+	volume->mHeight = header.mHeight;
+	volume->mDepth = header.mDepth;
+	volume->mBrickCount = uvec3(header.mBrickCount[0], header.mBrickCount[1], header.mBrickCount[2]);
+	volume->mSize = vec3(header.mSize[0], header.mSize[1], header.mSize[2]);
+	volume->mStats.mValueScale = header.mValueScale;
+	volume->mStats.mValueOffset = header.mValueOffset;
+	volume->mStats.mMin = header.mMin;
+	volume->mStats.mMax = header.mMax;
+	volume->mStats.mHistogram.resize(header.mHistogramBins);
+	volume->mRanges.resize(2 * (size_t)volume->BrickTotal());
+	volume->mBrickOffset = header.mBrickOffset;
+
+	file.read((char*)volume->mStats.mHistogram.data(), sizeof(uint32_t) * header.mHistogramBins);
+	file.read((char*)volume->mRanges.data(), sizeof(uint16_t) * volume->mRanges.size());
+	if (!file) {
+		printf("Failed to read bricked volume %s\n", path.c_str());
+		return nullptr;
+	}
+
+	printf("%ux%ux%u volume in %ux%ux%u bricks\n", header.mWidth, header.mHeight, header.mDepth, header.mBrickCount[0], header.mBrickCount[1], header.mBrickCount[2]);
+	return volume;
+}
+
+bool BrickedVolume::ReadBrick(ifstream& file, unsigned int brick, uint16_t* texels) const {
+	file.seekg(mBrickOffset + (uint64_t)brick * BRICK_VOXELS * sizeof(uint16_t));
+	file.read((char*)texels, BRICK_VOXELS * sizeof(uint16_t));
+	if (file) return true;
+	file.clear();
+	return false;
+}
\ No newline at end of file
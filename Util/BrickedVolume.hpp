@@ -0,0 +1,61 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "VolumeStats.hpp"
+
+// texels per brick along each axis, including the border
+#define BRICK_SIZE 64
+// voxels every brick repeats from its neighbours on each side, so bricks filter linearly on their own
+#define BRICK_BORDER 1
+// voxels per brick along each axis that belong to it
+#define BRICK_INTERIOR (BRICK_SIZE - 2 * BRICK_BORDER)
+#define BRICK_VOXELS (BRICK_SIZE * BRICK_SIZE * BRICK_SIZE)
+
+// 16 bit volume stored on disk (.cdbrick) as BRICK_SIZE^3 bricks, for volumes too large to keep in memory
+// The header holds the dimensions, physical size and intensity statistics, followed by the texel range of every
+// brick (so bricks below the threshold are never read) and the bricks themselves in x, y, z order.
+class BrickedVolume {
+public:
+	// Splits a volume into bricks and writes it to path
+	static bool Write(const std::string& path, const uint16_t* data, unsigned int width, unsigned int height, unsigned int depth,
+		const glm::vec3& size, const VolumeStats& stats);
+	// Reads the header and the brick ranges, returns nullptr if path isn't a bricked volume
+	static std::shared_ptr<BrickedVolume> Open(const std::string& path);
+
+	inline const std::string& Path() const { return mPath; }
+	inline unsigned int Width() const { return mWidth; }
+	inline unsigned int Height() const { return mHeight; }
+	inline unsigned int Depth() const { return mDepth; }
+	inline glm::uvec3 BrickCount() const { return mBrickCount; }
+	inline unsigned int BrickTotal() const { return mBrickCount.x * mBrickCount.y * mBrickCount.z; }
+	inline glm::vec3 Size() const { return mSize; }
+	inline const VolumeStats& Stats() const { return mStats; }
+
+	// Lowest and highest texel of a brick, border included
+	inline uint16_t BrickMin(unsigned int brick) const { return mRanges[2 * brick]; }
+	inline uint16_t BrickMax(unsigned int brick) const { return mRanges[2 * brick + 1]; }
+	inline glm::uvec3 BrickCoord(unsigned int brick) const {
+		return glm::uvec3(brick % mBrickCount.x, (brick / mBrickCount.x) % mBrickCount.y, brick / (mBrickCount.x * mBrickCount.y));
+	}
+
+	// Reads BRICK_VOXELS texels of a brick from a stream opened on Path()
+	bool ReadBrick(std::ifstream& file, unsigned int brick, uint16_t* texels) const;
+
+private:
+	std::string mPath;
+	unsigned int mWidth;
+	unsigned int mHeight;
+	unsigned int mDepth;
+	glm::uvec3 mBrickCount;
+	glm::vec3 mSize;
+	VolumeStats mStats;
+	std::vector<uint16_t> mRanges;
+	uint64_t mBrickOffset;
+};
\ No newline at end of file
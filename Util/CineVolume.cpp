@@ -0,0 +1,243 @@
+#include "CineVolume.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "ImageLoader.hpp"
+#include "MemoryStream.hpp"
+#include "ThreadPool.hpp"
+
+using namespace std;
+using namespace glm;
+
+#define CINE_CHUNK_SLICES 16
+// slices uploaded to the back texture at a time
+#define CINE_UPLOAD_SLICES 8
+// playback rate when the series has no trigger times
+#define CINE_DEFAULT_RATE 10.f
+
+// State shared with the loading and decoding tasks, outlives the CineVolume if they are still running
+struct CineVolume::Phases {
+	vector<SeriesInfo> mSeries;
+	uvec3 mDimensions;
+	vec3 mSize;
+	VolumeStats mStats;
+	float mPhasesPerSecond;
+
+	// zlib chunks of CINE_CHUNK_SLICES slices for each phase, entries below mLoaded are complete and never change
+	vector<vector<unique_ptr<MemoryStream>>> mChunks;
+	atomic<unsigned int> mLoaded;
+
+	// decompressed phase waiting to be uploaded
+	vector<uint16_t> mStaging;
+	atomic<int> mStagingPhase;
+	atomic<bool> mDecoding;
+
+	atomic<bool> mFailed;
+	atomic<bool> mCancelled;
+
+	Phases() : mDimensions(0), mSize(0.f), mPhasesPerSecond(CINE_DEFAULT_RATE), mLoaded(0), mStagingPhase(-1), mDecoding(false), mFailed(false), mCancelled(false) {}
+};
+
+static void LoadPhases(shared_ptr<CineVolume::Phases> phases, const string& folder) {
+	auto start = chrono::high_resolution_clock::now();
+
+	vector<SeriesInfo> series = ImageLoader::ScanSeries(folder);
+	if (series.empty()) {
+		printf("no series in %s\n", folder.c_str());
+		phases->mFailed = true;
+		return;
+	}
+
+	// every series shaped like the largest one is a phase
+	for (const auto& s : series)
+		if (s.mWidth == series[0].mWidth && s.mHeight == series[0].mHeight && s.mSliceCount == series[0].mSliceCount && s.mModality == series[0].mModality)
+			phases->mSeries.push_back(s);
+	sort(phases->mSeries.begin(), phases->mSeries.end(), [](const SeriesInfo& a, const SeriesInfo& b) {
+		if (a.mTemporalPosition != b.mTemporalPosition) return a.mTemporalPosition < b.mTemporalPosition;
+		if (a.mTriggerTime != b.mTriggerTime) return a.mTriggerTime < b.mTriggerTime;
+		return a.mSeriesNumber < b.mSeriesNumber;
+	});
+	phases->mChunks.resize(phases->mSeries.size());
+
+	// play at the rate the phases were acquired at
+	const auto& first = phases->mSeries.front();
+	const auto& last = phases->mSeries.back();
+	if (phases->mSeries.size() > 1 && first.mTriggerTime >= 0.0 && last.mTriggerTime > first.mTriggerTime)
+		phases->mPhasesPerSecond = (float)(1000.0 * (phases->mSeries.size() - 1) / (last.mTriggerTime - first.mTriggerTime));
+	printf("%u phases of %ux%ux%u, %.1f phases/s\n", (unsigned int)phases->mSeries.size(), first.mWidth, first.mHeight, first.mSliceCount, phases->mPhasesPerSecond);
+
+	size_t compressed = 0;
+	for (const auto& s : phases->mSeries) {
+		if (phases->mCancelled) return;
+
+		vector<uint16_t> voxels;
+		uvec3 dimensions;
+		vec3 size;
+		VolumeStats stats;
+		if (!ImageLoader::DecodeVolume(s, voxels, dimensions, size, stats) || (phases->mLoaded > 0 && dimensions != phases->mDimensions)) {
+			printf("skipping phase %d of series %d\n", s.mTemporalPosition, s.mSeriesNumber);
+			continue;
+		}
+
+		unsigned int index = phases->mLoaded;
+		if (index == 0) {
+			phases->mDimensions = dimensions;
+			phases->mSize = size;
+			phases->mStats = stats;
+		} else if (stats.mValueScale != phases->mStats.mValueScale || stats.mValueOffset != phases->mStats.mValueOffset) {
+			// one texel range for every phase so the transfer function doesn't jump, values outside the first phase's range clamp
+			const VolumeStats& s0 = phases->mStats;
+			ThreadPool::Shared().ParallelFor(0, voxels.size(), [&](size_t i) {
+				float value = stats.ToValue(voxels[i] / 65535.f);
+				voxels[i] = (uint16_t)(clamp(s0.ToTexel(value), 0.f, 1.f) * 65535.f + .5f);
+			}, 1 << 16);
+		}
+
+		size_t sliceSize = (size_t)dimensions.x * dimensions.y * sizeof(uint16_t);
+		auto& chunks = phases->mChunks[index];
+		chunks.resize((dimensions.z + CINE_CHUNK_SLICES - 1) / CINE_CHUNK_SLICES);
+		ThreadPool::Shared().ParallelFor(0, chunks.size(), [&](size_t i) {
+			size_t z = i * CINE_CHUNK_SLICES;
+			size_t bytes = std::min<size_t>(CINE_CHUNK_SLICES, dimensions.z - z) * sliceSize;
+			MemoryStream src(bytes, false);
+			src.Write((const char*)voxels.data() + z * sliceSize, bytes);
+			chunks[i] = unique_ptr<MemoryStream>(new MemoryStream());
+			src.Compress(*chunks[i]);
+		});
+		for (const auto& c : chunks)
+			compressed += c->Tell();
+
+		phases->mLoaded++;
+	}
+
+	if (phases->mLoaded == 0) {
+		phases->mFailed = true;
+		return;
+	}
+	double seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+	size_t raw = (size_t)phases->mDimensions.x * phases->mDimensions.y * phases->mDimensions.z * sizeof(uint16_t) * phases->mLoaded;
+	printf("loaded %u phases in %.2fs, %.1f MB compressed to %.1f MB\n", phases->mLoaded.load(), seconds, raw / 1e6, compressed / 1e6);
+}
+
+shared_ptr<CineVolume> CineVolume::Load(const string& folder) {
+	shared_ptr<CineVolume> cine(new CineVolume());
+	shared_ptr<Phases> phases = cine->mPhases;
+	ThreadPool::Shared().Enqueue([phases, folder]() {
+		LoadPhases(phases, folder);
+	});
+	return cine;
+}
+
+CineVolume::CineVolume() : mPhases(new Phases()), mFront(0), mPhase(0), mBackPhase(-1), mBackSlices(0), mShown(false), mTime(0.0), mPhasesPerSecond(0.f), mPlaying(true) {}
+CineVolume::~CineVolume() {
+	mPhases->mCancelled = true;
+}
+
+unsigned int CineVolume::PhaseCount() const { return mPhases->mLoaded; }
+unsigned int CineVolume::TotalPhases() const { return mPhases->mLoaded > 0 ? (unsigned int)mPhases->mSeries.size() : 0; }
+vec3 CineVolume::Size() const { return mPhases->mSize; }
+const VolumeStats& CineVolume::Stats() const { return mPhases->mStats; }
+bool CineVolume::Failed() const { return mPhases->mFailed; }
+
+void CineVolume::Decode(unsigned int phase) {
+	if (mPhases->mDecoding || mPhases->mStagingPhase == (int)phase) return;
+	mPhases->mDecoding = true;
+	mPhases->mStagingPhase = -1;
+
+	shared_ptr<Phases> phases = mPhases;
+	ThreadPool::Shared().Enqueue([phases, phase]() {
+		uvec3 d = phases->mDimensions;
+		size_t sliceSize = (size_t)d.x * d.y;
+		phases->mStaging.resize(sliceSize * d.z);
+
+		const auto& chunks = phases->mChunks[phase];
+		atomic<bool> corrupt(false);
+		ThreadPool::Shared().ParallelFor(0, chunks.size(), [&](size_t i) {
+			size_t z = i * CINE_CHUNK_SLICES;
+			size_t bytes = std::min<size_t>(CINE_CHUNK_SLICES, d.z - z) * sliceSize * sizeof(uint16_t);
+			MemoryStream src(chunks[i]->Ptr(), chunks[i]->Tell(), false);
+			MemoryStream dst(bytes, false);
+			if (!src.Decompress(dst, chunks[i]->Tell())) {
+				corrupt = true;
+				return;
+			}
+			memcpy(phases->mStaging.data() + z * sliceSize, dst.Ptr(), bytes);
+		});
+
+		// a chunk that doesn't decompress to a whole slab means the phases can't be trusted, stop playback
+		if (corrupt) {
+			printf("phase %u is corrupt\n", phase);
+			phases->mFailed = true;
+			phases->mCancelled = true;
+			phases->mDecoding = false;
+			return;
+		}
+
+		phases->mStagingPhase = (int)phase;
+		phases->mDecoding = false;
+	});
+}
+
+bool CineVolume::Update(double deltaTime, double budget, const shared_ptr<::Texture>& busy) {
+	unsigned int count = mPhases->mLoaded;
+	if (count == 0 || mPhases->mFailed) return false;
+
+	uvec3 d = mPhases->mDimensions;
+	if (!mTextures[0]) {
+		GLint maxSize;
+		glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &maxSize);
+		if (d.x > (unsigned int)maxSize || d.y > (unsigned int)maxSize || d.z > (unsigned int)maxSize) {
+			printf("%ux%ux%u exceeds the texture limits, can't play it back\n", d.x, d.y, d.z);
+			mPhases->mFailed = true;
+			mPhases->mCancelled = true;
+			return false;
+		}
+		if (mPhasesPerSecond <= 0.f) mPhasesPerSecond = mPhases->mPhasesPerSecond;
+		for (unsigned int i = 0; i < 2; i++)
+			mTextures[i] = shared_ptr<::Texture>(new ::Texture(d.x, d.y, d.z, GL_R16, GL_RED, GL_UNSIGNED_SHORT, GL_LINEAR));
+	}
+
+	// the phase that goes into the back texture
+	unsigned int next = mShown ? (mPhase + 1) % count : 0;
+	if (mShown && next == mPhase) return false;
+	if (mBackPhase != (int)next) {
+		mBackPhase = (int)next;
+		mBackSlices = 0;
+	}
+	if (mBackSlices < d.z) Decode(next);
+
+	// upload the staged phase a few slices at a time, at least once per call so it always advances. The back texture
+	// held the phase before the one on screen, a bake of it may still be reading it.
+	if (!mPhases->mDecoding && mPhases->mStagingPhase == mBackPhase && mTextures[1 - mFront] != busy) {
+		auto start = chrono::high_resolution_clock::now();
+		bool uploaded = false;
+		while (mBackSlices < d.z && (!uploaded || budget <= 0.0 || chrono::duration<double>(chrono::high_resolution_clock::now() - start).count() < budget)) {
+			unsigned int n = std::min<unsigned int>(CINE_UPLOAD_SLICES, d.z - mBackSlices);
+			mTextures[1 - mFront]->Upload(0, 0, mBackSlices, d.x, d.y, n, mPhases->mStaging.data() + (size_t)mBackSlices * d.x * d.y);
+			mBackSlices += n;
+			uploaded = true;
+		}
+	}
+	bool ready = mBackSlices == d.z;
+
+	if (!mShown) {
+		if (!ready) return false;
+		mShown = true;
+	} else {
+		if (mPlaying) mTime += deltaTime;
+		double period = 1.0 / mPhasesPerSecond;
+		// a phase that isn't uploaded yet holds the current one on screen instead of stalling the frame
+		if (mTime < period || !ready) return false;
+		mTime = std::min(mTime - period, period);
+	}
+
+	mFront = 1 - mFront;
+	mPhase = next;
+	return true;
+}
\ No newline at end of file
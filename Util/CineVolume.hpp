@@ -0,0 +1,61 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <memory>
+#include <string>
+
+#include "../Pipeline/Texture.hpp"
+#include "VolumeStats.hpp"
+
+// Time series of volumes with the same geometry (cardiac CT/MR phases), played back in a loop
+// Phases are decoded in the background and kept zlib compressed in memory. During playback the next phase is
+// decompressed on the loader pool and uploaded into the back texture of a ping-pong pair within a time budget per
+// frame, then swapped to the front when its turn comes, so showing a phase never waits on decoding or a reallocation.
+class CineVolume {
+public:
+	struct Phases;
+
+	// Starts loading every series in folder that has the geometry of the largest one, each is a phase.
+	// Phases are ordered by TemporalPositionIdentifier, TriggerTime and SeriesNumber.
+	static std::shared_ptr<CineVolume> Load(const std::string& folder);
+	~CineVolume();
+
+	// Phases loaded so far, playback cycles through them while the rest load
+	unsigned int PhaseCount() const;
+	unsigned int TotalPhases() const;
+	// Size and statistics of the first phase, valid once PhaseCount() > 0. Later phases are remapped to its texel range.
+	inline unsigned int Phase() const { return mPhase; }
+	// nullptr until the first phase is shown
+	inline std::shared_ptr<::Texture> Texture() const { return mShown ? mTextures[mFront] : nullptr; }
+	glm::vec3 Size() const;
+	const VolumeStats& Stats() const;
+	bool Failed() const;
+
+	// From the trigger times if the series is gated
+	inline float PhasesPerSecond() const { return mPhasesPerSecond; }
+	inline void PhasesPerSecond(float x) { mPhasesPerSecond = x > 0.f ? x : mPhasesPerSecond; }
+	inline bool Playing() const { return mPlaying; }
+	inline void Playing(bool x) { mPlaying = x; }
+
+	// Advances playback and uploads the next phase for up to budget seconds, on the GL thread.
+	// Returns true when the texture changed to the next phase. Nothing is uploaded while the back texture is busy, a
+	// texture something still reads (Volume::BakeSource).
+	bool Update(double deltaTime, double budget, const std::shared_ptr<::Texture>& busy = nullptr);
+
+private:
+	std::shared_ptr<Phases> mPhases;
+	std::shared_ptr<::Texture> mTextures[2];
+	unsigned int mFront;
+	unsigned int mPhase;
+	// phase the back texture is being filled with, and how many of its slices are uploaded
+	int mBackPhase;
+	unsigned int mBackSlices;
+	bool mShown;
+	double mTime;
+	float mPhasesPerSecond;
+	bool mPlaying;
+
+	CineVolume();
+	void Decode(unsigned int phase);
+};
\ No newline at end of file
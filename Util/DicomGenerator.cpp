@@ -0,0 +1,175 @@
+#include "DicomGenerator.hpp"
+
+#include <dcmtk/dcmdata/dctk.h>
+#include <dcmtk/dcmjpeg/djrplol.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <vector>
+
+#include "ImageLoader.hpp"
+#include "ThreadPool.hpp"
+
+using namespace std;
+
+namespace fs = std::filesystem;
+
+E_TransferSyntax TransferSyntax(DicomEncoding encoding) {
+	switch (encoding) {
+	case DICOM_RLE: return EXS_RLELossless;
+	case DICOM_JPEG_LOSSLESS: return EXS_JPEGProcess14SV1;
+	case DICOM_JPEG_LS: return EXS_JPEGLSLossless;
+	case DICOM_JPEG_2000: return EXS_JPEG2000LosslessOnly;
+	default: return EXS_LittleEndianExplicit;
+	}
+}
+
+const char* DicomGenerator::EncodingName(DicomEncoding encoding) {
+	switch (encoding) {
+	case DICOM_RLE: return "rle";
+	case DICOM_JPEG_LOSSLESS: return "jpeg-lossless";
+	case DICOM_JPEG_LS: return "jpeg-ls";
+	case DICOM_JPEG_2000: return "jpeg2000";
+	default: return "uncompressed";
+	}
+}
+
+DicomEncoding DicomGenerator::ParseEncoding(const string& name) {
+	for (int e = 0; e < DICOM_ENCODING_COUNT; e++)
+		if (name == EncodingName((DicomEncoding)e))
+			return (DicomEncoding)e;
+	return DICOM_ENCODING_COUNT;
+}
+
+bool DicomGenerator::Supported(DicomEncoding encoding) {
+	#ifndef DCMTK_WITH_FMJPEG2K
+	if (encoding == DICOM_JPEG_2000) return false;
+	#endif
+	return encoding < DICOM_ENCODING_COUNT;
+}
+
+// Hounsfield units of the phantom at x, y in [-1, 1] on slice z in [0, 1]
+float Phantom(float x, float y, float z, uint32_t& rng) {
+	auto inside = [](float x, float y, float cx, float cy, float rx, float ry) {
+		float dx = (x - cx) / rx;
+		float dy = (y - cy) / ry;
+		return dx * dx + dy * dy < 1.f;
+	};
+
+	// xorshift noise, so the compressors have something realistic to work with
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	float noise = (float)(rng & 0xFF) / 255.f * 20.f - 10.f;
+
+	float taper = .85f + .15f * sinf(z * 3.1415926f);
+	if (!inside(x, y, 0.f, 0.f, .8f * taper, .6f * taper)) return -1000.f;
+	if (inside(x, y, 0.f, .35f, .1f, .1f)) return 700.f + noise * 4.f; // spine
+	if (inside(x, y, -.35f, -.05f, .25f, .35f) || inside(x, y, .35f, -.05f, .25f, .35f)) return -800.f + noise * 3.f; // lungs
+	if (!inside(x, y, 0.f, 0.f, .75f * taper, .55f * taper)) return -100.f + noise; // fat
+	return 40.f + noise; // soft tissue
+}
+
+bool DicomGenerator::WriteSeries(const string& folder, unsigned int w, unsigned int h, unsigned int d, DicomEncoding encoding, unsigned int bits) {
+	if (!Supported(encoding)) {
+		printf("%s is not supported by this build\n", EncodingName(encoding));
+		return false;
+	}
+	if (bits != 8 && bits != 12 && bits != 16) {
+		printf("%u bit samples are not supported, use 8, 12 or 16\n", bits);
+		return false;
+	}
+	ImageLoader::RegisterCodecs();
+
+	error_code ec;
+	fs::create_directories(folder, ec);
+
+	char studyUID[DCM_MAXUIDLENGTH + 1];
+	char seriesUID[DCM_MAXUIDLENGTH + 1];
+	dcmGenerateUniqueIdentifier(studyUID, SITE_STUDY_UID_ROOT);
+	dcmGenerateUniqueIdentifier(seriesUID, SITE_SERIES_UID_ROOT);
+
+	E_TransferSyntax xfer = TransferSyntax(encoding);
+	const float spacing = .7f;
+	const float thickness = 1.f;
+	// Hounsfield units from -1024 to 3071 spread over the stored range
+	const float slope = 4096.f / (1 << bits);
+	const float maxSample = (float)((1 << bits) - 1);
+	char slopeStr[32];
+	snprintf(slopeStr, 32, "%g", slope);
+
+	atomic<bool> failed(false);
+	ThreadPool::Shared().ParallelFor(0, d, [&](size_t z) {
+		vector<Uint16> pixels((size_t)w * h);
+		uint32_t rng = (uint32_t)z * 747796405u + 1u;
+		for (unsigned int y = 0; y < h; y++)
+			for (unsigned int x = 0; x < w; x++) {
+				float hu = Phantom(2.f * x / w - 1.f, 2.f * y / h - 1.f, (float)z / d, rng);
+				pixels[x + (size_t)y * w] = (Uint16)std::min(std::max((hu + 1024.f) / slope + .5f, 0.f), maxSample);
+			}
+
+		DcmFileFormat fileFormat;
+		DcmDataset* ds = fileFormat.getDataset();
+
+		char uid[DCM_MAXUIDLENGTH + 1];
+		char str[128];
+		ds->putAndInsertString(DCM_SOPClassUID, UID_CTImageStorage);
+		ds->putAndInsertString(DCM_SOPInstanceUID, dcmGenerateUniqueIdentifier(uid, SITE_INSTANCE_UID_ROOT));
+		ds->putAndInsertString(DCM_StudyInstanceUID, studyUID);
+		ds->putAndInsertString(DCM_SeriesInstanceUID, seriesUID);
+		ds->putAndInsertString(DCM_Modality, "CT");
+		snprintf(str, 128, "Synthetic %s", EncodingName(encoding));
+		ds->putAndInsertString(DCM_SeriesDescription, str);
+		snprintf(str, 128, "%u", (unsigned int)z + 1);
+		ds->putAndInsertString(DCM_InstanceNumber, str);
+
+		ds->putAndInsertUint16(DCM_Rows, (Uint16)h);
+		ds->putAndInsertUint16(DCM_Columns, (Uint16)w);
+		snprintf(str, 128, "%g\\%g", spacing, spacing);
+		ds->putAndInsertString(DCM_PixelSpacing, str);
+		snprintf(str, 128, "%g", thickness);
+		ds->putAndInsertString(DCM_SliceThickness, str);
+		snprintf(str, 128, "%g", z * thickness);
+		ds->putAndInsertString(DCM_SliceLocation, str);
+		snprintf(str, 128, "%g\\%g\\%g", -.5f * spacing * w, -.5f * spacing * h, z * thickness);
+		ds->putAndInsertString(DCM_ImagePositionPatient, str);
+		ds->putAndInsertString(DCM_ImageOrientationPatient, "1\\0\\0\\0\\1\\0");
+
+		ds->putAndInsertUint16(DCM_SamplesPerPixel, 1);
+		ds->putAndInsertString(DCM_PhotometricInterpretation, "MONOCHROME2");
+		ds->putAndInsertUint16(DCM_BitsAllocated, bits == 8 ? 8 : 16);
+		ds->putAndInsertUint16(DCM_BitsStored, (Uint16)bits);
+		ds->putAndInsertUint16(DCM_HighBit, (Uint16)(bits - 1));
+		ds->putAndInsertUint16(DCM_PixelRepresentation, 0);
+		ds->putAndInsertString(DCM_RescaleIntercept, "-1024");
+		ds->putAndInsertString(DCM_RescaleSlope, slopeStr);
+		if (bits == 8) {
+			vector<Uint8> bytes(pixels.begin(), pixels.end());
+			ds->putAndInsertUint8Array(DCM_PixelData, bytes.data(), (unsigned long)bytes.size());
+		} else
+			ds->putAndInsertUint16Array(DCM_PixelData, pixels.data(), (unsigned long)pixels.size());
+
+		// first order prediction, the usual choice for lossless JPEG
+		DJ_RPLossless lossless;
+		const DcmRepresentationParameter* params = encoding == DICOM_JPEG_LOSSLESS ? &lossless : nullptr;
+
+		snprintf(str, 128, "%05u.dcm", (unsigned int)z);
+		string path = (fs::path(folder) / str).string();
+		ds->chooseRepresentation(xfer, params);
+		if (!ds->canWriteXfer(xfer)) {
+			printf("Failed to encode %s as %s\n", path.c_str(), EncodingName(encoding));
+			failed = true;
+			return;
+		}
+		OFCondition cnd = fileFormat.saveFile(path.c_str(), xfer);
+		if (cnd.bad()) {
+			printf("Failed to write %s: %s\n", path.c_str(), cnd.text());
+			failed = true;
+		}
+	});
+
+	return !failed;
+}
\ No newline at end of file
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+
+enum DicomEncoding {
+	DICOM_UNCOMPRESSED,
+	DICOM_RLE,
+	DICOM_JPEG_LOSSLESS,
+	DICOM_JPEG_LS,
+	DICOM_JPEG_2000,
+	DICOM_ENCODING_COUNT,
+};
+
+// Writes synthetic CT series, so the loaders can be benchmarked without patient data
+// The phantom is an elliptical body with lungs, a spine and some noise, stored as 12 bit samples with a
+// rescale intercept of -1024 like most CT scanners write them. 8 and 16 bit series keep the same Hounsfield
+// units through the rescale slope.
+class DicomGenerator {
+public:
+	static const char* EncodingName(DicomEncoding encoding);
+	// DICOM_ENCODING_COUNT if the name is unknown
+	static DicomEncoding ParseEncoding(const std::string& name);
+	// False if the codec isn't part of this build
+	static bool Supported(DicomEncoding encoding);
+
+	// Writes depth slices of width x height into folder as <index>.dcm, the slices are encoded in parallel
+	// bits is the number of bits stored: 8, 12 or 16
+	static bool WriteSeries(const std::string& folder, unsigned int width, unsigned int height, unsigned int depth, DicomEncoding encoding, unsigned int bits = 12);
+};
\ No newline at end of file
@@ -1,24 +1,44 @@
 #pragma warning(disable: 26451)
 #pragma warning(disable: 4005)
 
-#define THREAD_COUNT 6
-
-#ifdef WINDOWS
-#include <Shlwapi.h>
-#endif
-
 #include <dcmtk/dcmimgle/dcmimage.h>
 #include <dcmtk/dcmdata/dctk.h>
+#include <dcmtk/dcmdata/dcrledrg.h>
+#include <dcmtk/dcmdata/dcrleerg.h>
+#include <dcmtk/dcmjpeg/djdecode.h>
+#include <dcmtk/dcmjpeg/djencode.h>
+#include <dcmtk/dcmjpls/djdecode.h>
+#include <dcmtk/dcmjpls/djencode.h>
+#ifdef DCMTK_WITH_FMJPEG2K
+#include <fmjpeg2k/djdecode.h>
+#include <fmjpeg2k/djencode.h>
+#endif
 
+#include <atomic>
+#include <cstring>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <unordered_map>
+#include <mutex>
 #include <thread>
 #include <vector>
 #include <algorithm>
 
+#include "../ThirdParty/stb_image.hpp"
+
 #include "ImageLoader.hpp"
+#include "MappedFile.hpp"
+#include "SliceKernels.hpp"
+#include "ThreadPool.hpp"
+#include "VolumeCache.hpp"
+#include "VolumeResampler.hpp"
 
 using namespace std;
 using namespace glm;
 
+namespace fs = std::filesystem;
+
 string GetExt(const string& path) {
 	size_t k = path.rfind('.');
 	if (k == string::npos) return "";
@@ -38,146 +58,846 @@ string GetName(const string& path) {
 
 	return path.substr(f, l - f);
 }
-string GetFullPath(const string& str) {
-#ifdef WINDOWS
-	char buf[MAX_PATH];
-	if (GetFullPathName(str.c_str(), 256, buf, nullptr) == 0) {
-		printf("Failed to get full file path of %s (%d)", str.c_str(), GetLastError());
-		return str;
+
+// Codecs stay registered until the program exits
+struct CodecRegistration {
+	CodecRegistration() {
+		DcmRLEDecoderRegistration::registerCodecs();
+		DcmRLEEncoderRegistration::registerCodecs();
+		DJDecoderRegistration::registerCodecs();
+		DJEncoderRegistration::registerCodecs();
+		DJLSDecoderRegistration::registerCodecs();
+		DJLSEncoderRegistration::registerCodecs();
+		#ifdef DCMTK_WITH_FMJPEG2K
+		FMJPEG2KDecoderRegistration::registerCodecs();
+		FMJPEG2KEncoderRegistration::registerCodecs();
+		#endif
 	}
-	return string(buf);
-#endif
+	~CodecRegistration() {
+		DcmRLEDecoderRegistration::cleanup();
+		DcmRLEEncoderRegistration::cleanup();
+		DJDecoderRegistration::cleanup();
+		DJEncoderRegistration::cleanup();
+		DJLSDecoderRegistration::cleanup();
+		DJLSEncoderRegistration::cleanup();
+		#ifdef DCMTK_WITH_FMJPEG2K
+		FMJPEG2KDecoderRegistration::cleanup();
+		FMJPEG2KEncoderRegistration::cleanup();
+		#endif
+	}
+};
+void ImageLoader::RegisterCodecs() {
+	// thread safe, the first caller registers and everyone else waits for it
+	static CodecRegistration registration;
+}
+
+bool ImageLoader::sProfile = false;
+atomic<uint64_t> gStageTime[LOADER_STAGE_COUNT];
+
+void ImageLoader::ResetProfile() {
+	for (auto& t : gStageTime) t = 0;
 }
+double ImageLoader::ProfileSeconds(LoaderStage stage) {
+	return gStageTime[stage] * 1e-9;
+}
+const char* ImageLoader::StageName(LoaderStage stage) {
+	switch (stage) {
+	case LOADER_SCAN: return "scan";
+	case LOADER_HEADERS: return "headers";
+	case LOADER_DECODE: return "decode";
+	case LOADER_INTERLEAVE: return "interleave";
+	case LOADER_UPLOAD: return "upload";
+	default: return "unknown";
+	}
+}
+
+// Adds the time until Stop() or the end of the scope to a stage
+struct StageTimer {
+	LoaderStage mStage;
+	chrono::high_resolution_clock::time_point mStart;
+	bool mRunning;
 
-struct Slice {
-	DicomImage* image;
-	double location;
+	StageTimer(LoaderStage stage) : mStage(stage), mStart(chrono::high_resolution_clock::now()), mRunning(ImageLoader::sProfile) {}
+	~StageTimer() { Stop(); }
+	void Stop() {
+		if (!mRunning) return;
+		gStageTime[mStage] += (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::high_resolution_clock::now() - mStart).count();
+		mRunning = false;
+	}
 };
 
-void ReadDicomSlice(DicomImage*& img, double& x, const string& file, double& spacingX, double& spacingY, double& thickness) {
-	OFCondition cnd;
+struct DicomSlice {
+	string mFile;
+	// parsed header, kept around so the pixel data can be decoded without parsing the file again
+	unique_ptr<DcmFileFormat> mFileFormat;
+	double mLocation;
+	unsigned int mWidth;
+	unsigned int mHeight;
+	unsigned int mFrameCount;
+	double mSpacingX;
+	double mSpacingY;
+	double mThickness;
 
-	DcmFileFormat fileFormat;
-	assert((cnd = fileFormat.loadFile(file.c_str())).good());
-	DcmDataset * dataset = fileFormat.getDataset();
-
-	double sx;
-	double sy;
-	double th;
-	cnd = dataset->findAndGetFloat64(DCM_PixelSpacing, sx, 0);
-	cnd = dataset->findAndGetFloat64(DCM_PixelSpacing, sy, 1);
-	cnd = dataset->findAndGetFloat64(DCM_SliceThickness, th, 0);
-
-	spacingX = std::max(sx, spacingX);
-	spacingY = std::max(sy, spacingY);
-	thickness = std::max(th, thickness);
-
-	cnd = dataset->findAndGetFloat64(DCM_SliceLocation, x, 0);
-
-	img = new DicomImage(file.c_str());
-	assert(img != NULL);
-	assert(img->getStatus() == EIS_Normal);
-}
-void ReadDicomImage(DicomImage* img, uint16_t* slice, int w, int h) {
-	img->setMinMaxWindow();
-	uint16_t* pixelData = (uint16_t*)img->getOutputData(16);
-	int j = 0;
-	for (int x = 0; x < w; x++)
-		for (int y = 0; y < h; y++) {
-			j = 2 * (x + y * w);
-			slice[j] = pixelData[x + y * w];
+	// uncompressed little endian pixel data that can be read straight from the file
+	bool mRaw;
+	bool mExplicitVR;
+	bool mSigned;
+	unsigned int mBitsStored;
+	double mRescaleSlope;
+	double mRescaleIntercept;
+
+	// modality values mapped to 0 and 65535, the same for every slice of a volume
+	double mWindowMin;
+	double mWindowMax;
+};
+
+// Sets the window to every value the header allows, so slices can be converted before the rest of the volume is read
+void StoredRangeWindow(DicomSlice& slice) {
+	unsigned int bits = std::min(std::max(slice.mBitsStored, 1u), 16u);
+	double lo = slice.mSigned ? -(double)(1 << (bits - 1)) : 0.0;
+	double hi = slice.mSigned ? (double)((1 << (bits - 1)) - 1) : (double)((1 << bits) - 1);
+	slice.mWindowMin = lo * slice.mRescaleSlope + slice.mRescaleIntercept;
+	slice.mWindowMax = hi * slice.mRescaleSlope + slice.mRescaleIntercept;
+	if (slice.mWindowMin > slice.mWindowMax) std::swap(slice.mWindowMin, slice.mWindowMax);
+}
+
+// Reads the header information of a single slice
+// Element values longer than DICOM_PRESCAN_LENGTH are not read here, the parser skips over them and DCMTK
+// only loads them from the file when they are first accessed. That leaves PixelData on disk until
+// ReadDicomImage decodes it from the same dataset.
+#define DICOM_PRESCAN_LENGTH 4096
+bool ReadDicomSlice(DicomSlice& slice) {
+	ImageLoader::RegisterCodecs();
+
+	slice.mFileFormat = unique_ptr<DcmFileFormat>(new DcmFileFormat());
+	OFCondition cnd = slice.mFileFormat->loadFile(slice.mFile.c_str(), EXS_Unknown, EGL_noChange, DICOM_PRESCAN_LENGTH);
+	if (cnd.bad()) {
+		printf("Failed to read %s: %s\n", slice.mFile.c_str(), cnd.text());
+		slice.mFileFormat.reset();
+		return false;
+	}
+	DcmDataset* dataset = slice.mFileFormat->getDataset();
+
+	Uint16 w = 0;
+	Uint16 h = 0;
+	dataset->findAndGetUint16(DCM_Columns, w);
+	dataset->findAndGetUint16(DCM_Rows, h);
+	slice.mWidth = w;
+	slice.mHeight = h;
+
+	slice.mSpacingX = 0.0;
+	slice.mSpacingY = 0.0;
+	slice.mThickness = 0.0;
+	slice.mLocation = 0.0;
+	dataset->findAndGetFloat64(DCM_PixelSpacing, slice.mSpacingX, 0);
+	dataset->findAndGetFloat64(DCM_PixelSpacing, slice.mSpacingY, 1);
+	dataset->findAndGetFloat64(DCM_SliceThickness, slice.mThickness, 0);
+	dataset->findAndGetFloat64(DCM_SliceLocation, slice.mLocation, 0);
+
+	// distance along the slice normal, SliceLocation is optional and often missing
+	Float64 o[6] = { 1, 0, 0, 0, 1, 0 };
+	Float64 p[3];
+	for (unsigned long i = 0; i < 6; i++)
+		dataset->findAndGetFloat64(DCM_ImageOrientationPatient, o[i], i);
+	if (dataset->findAndGetFloat64(DCM_ImagePositionPatient, p[0], 0).good() &&
+		dataset->findAndGetFloat64(DCM_ImagePositionPatient, p[1], 1).good() &&
+		dataset->findAndGetFloat64(DCM_ImagePositionPatient, p[2], 2).good())
+		slice.mLocation = p[0] * (o[1] * o[5] - o[2] * o[4]) + p[1] * (o[2] * o[3] - o[0] * o[5]) + p[2] * (o[0] * o[4] - o[1] * o[3]);
+
+	Uint16 bitsAllocated = 0;
+	Uint16 bitsStored = 0;
+	Uint16 highBit = 0;
+	Uint16 pixelRepresentation = 0;
+	Uint16 samplesPerPixel = 1;
+	Sint32 frames = 1;
+	OFString photometric;
+	dataset->findAndGetUint16(DCM_BitsAllocated, bitsAllocated);
+	dataset->findAndGetUint16(DCM_BitsStored, bitsStored);
+	dataset->findAndGetUint16(DCM_HighBit, highBit);
+	dataset->findAndGetUint16(DCM_PixelRepresentation, pixelRepresentation);
+	dataset->findAndGetUint16(DCM_SamplesPerPixel, samplesPerPixel);
+	dataset->findAndGetSint32(DCM_NumberOfFrames, frames);
+	dataset->findAndGetOFString(DCM_PhotometricInterpretation, photometric);
+
+	slice.mRescaleSlope = 1.0;
+	slice.mRescaleIntercept = 0.0;
+	dataset->findAndGetFloat64(DCM_RescaleSlope, slice.mRescaleSlope);
+	dataset->findAndGetFloat64(DCM_RescaleIntercept, slice.mRescaleIntercept);
+
+	E_TransferSyntax xfer = dataset->getOriginalXfer();
+	slice.mFrameCount = (unsigned int)std::max(frames, 1);
+	slice.mExplicitVR = xfer == EXS_LittleEndianExplicit;
+	slice.mSigned = pixelRepresentation == 1;
+	slice.mBitsStored = bitsStored;
+	slice.mRaw = (xfer == EXS_LittleEndianExplicit || xfer == EXS_LittleEndianImplicit) &&
+		bitsAllocated == 16 && bitsStored > 0 && bitsStored <= 16 && highBit == bitsStored - 1 &&
+		samplesPerPixel == 1 && photometric == "MONOCHROME2" && slice.mRescaleSlope != 0.0;
+	StoredRangeWindow(slice);
+
+	return w > 0 && h > 0;
+}
+
+// Finds uncompressed little endian pixel data in a mapped file, so it can be read without DicomImage
+// PixelData is expected to be the last element in the file. If the element header in front of the last
+// w*h*frames*2 bytes doesn't match, returns nullptr and the caller falls back to DCMTK.
+const uint16_t* FindRawPixelData(const MappedFile& file, const DicomSlice& src) {
+	if (!file.Data()) return nullptr;
+
+	size_t bytes = (size_t)src.mWidth * src.mHeight * src.mFrameCount * sizeof(uint16_t);
+	size_t header = src.mExplicitVR ? 12 : 8;
+	if (file.Size() < bytes + header) return nullptr;
+
+	const uint8_t* pixels = file.Data() + file.Size() - bytes;
+	const uint8_t* e = pixels - header;
+
+	// (7FE0,0010) little endian
+	if (e[0] != 0xE0 || e[1] != 0x7F || e[2] != 0x10 || e[3] != 0x00) return nullptr;
+	if (src.mExplicitVR && (e[4] != 'O' || (e[5] != 'W' && e[5] != 'B'))) return nullptr;
+	const uint8_t* l = e + header - 4;
+	uint32_t length = (uint32_t)l[0] | ((uint32_t)l[1] << 8) | ((uint32_t)l[2] << 16) | ((uint32_t)l[3] << 24);
+	if (length != bytes) return nullptr;
+
+	return (const uint16_t*)pixels;
+}
+// Converts one frame of raw samples into the texture, row by row
+void RescaleRawSlice(const uint16_t* pixels, const DicomSlice& src, uint16_t* slice) {
+	StageTimer timer(LOADER_INTERLEAVE);
+	size_t count = (size_t)src.mWidth * src.mHeight;
+
+	// rescale to modality values and map the window to [0, 65535] in one multiply-add
+	double range = src.mWindowMax > src.mWindowMin ? 65535.0 / (src.mWindowMax - src.mWindowMin) : 0.0;
+	float scale = (float)(src.mRescaleSlope * range);
+	float bias = (float)((src.mRescaleIntercept - src.mWindowMin) * range);
+
+	RescaleSamples(pixels, count, src.mBitsStored, src.mSigned, scale, bias, slice);
+}
+bool ReadRawDicomImage(const DicomSlice& src, uint16_t* slice) {
+	StageTimer timer(LOADER_DECODE);
+	MappedFile file(src.mFile);
+	const uint16_t* pixels = FindRawPixelData(file, src);
+	timer.Stop();
+	if (!pixels) return false;
+	RescaleRawSlice(pixels, src, slice);
+	return true;
+}
+// Copies one frame of a DicomImage into the texture
+bool CopyDicomImage(DicomImage& img, const DicomSlice& src, unsigned long frame, uint16_t* slice) {
+	StageTimer timer(LOADER_INTERLEAVE);
+	// linear VOI window that maps [mWindowMin, mWindowMax] to the full output range
+	img.setWindow((src.mWindowMin + src.mWindowMax) * .5 + .5, src.mWindowMax - src.mWindowMin + 1.0);
+	const uint16_t* pixelData = (const uint16_t*)img.getOutputData(16, frame);
+	if (!pixelData) return false;
+
+	memcpy(slice, pixelData, (size_t)src.mWidth * src.mHeight * sizeof(uint16_t));
+	return true;
+}
+// Decodes the pixel data of a slice read by ReadDicomSlice, then releases its dataset
+bool ReadDicomImage(DicomSlice& src, uint16_t* slice) {
+	if (src.mRaw) {
+		if (ReadRawDicomImage(src, slice)) return true;
+
+		// unexpected layout, parse the file again and let DCMTK deal with it
+		StageTimer timer(LOADER_HEADERS);
+		src.mRaw = false;
+		src.mFileFormat = unique_ptr<DcmFileFormat>(new DcmFileFormat());
+		OFCondition cnd = src.mFileFormat->loadFile(src.mFile.c_str(), EXS_Unknown, EGL_noChange, DICOM_PRESCAN_LENGTH);
+		if (cnd.bad()) {
+			printf("Failed to read %s: %s\n", src.mFile.c_str(), cnd.text());
+			return false;
 		}
+	}
+
+	E_TransferSyntax xfer = src.mFileFormat->getDataset()->getOriginalXfer();
+
+	// the image takes over the dataset and deletes it along with itself
+	StageTimer timer(LOADER_DECODE);
+	unique_ptr<DicomImage> img(new DicomImage(src.mFileFormat.release(), xfer, CIF_TakeOverExternalDataset));
+	timer.Stop();
+	if (img->getStatus() != EIS_Normal) {
+		printf("Failed to decode %s: %s\n", src.mFile.c_str(), DicomImage::getString(img->getStatus()));
+		return false;
+	}
+
+	return CopyDicomImage(*img, src, 0, slice);
 }
-void ReadDicomImages(uint16_t* data, vector<Slice>& images, int j, int k, int w, int h) {
-	for (int i = j; i < k; i++) {
-		if (i >= (int)images.size()) break;
-		ReadDicomImage(images[i].image, data + 2 * i * w * h, w, h);
+
+// Reads the geometry of an enhanced multi-frame object
+// Spacing, orientation and rescale come from the functional groups, shared or of the first frame. Returns the
+// position of every frame along the slice normal, from its PlanePositionSequence.
+void ReadFrameGeometry(DicomSlice& src, vector<double>& locations) {
+	DcmDataset* dataset = src.mFileFormat->getDataset();
+
+	DcmItem* shared = nullptr;
+	dataset->findAndGetSequenceItem(DCM_SharedFunctionalGroupsSequence, shared, 0);
+	DcmSequenceOfItems* perFrame = nullptr;
+	dataset->findAndGetSequence(DCM_PerFrameFunctionalGroupsSequence, perFrame);
+
+	// a functional group macro from a frame's item, or from the shared item
+	auto group = [&](DcmItem* frame, const DcmTagKey& seq) -> DcmItem* {
+		DcmItem* item = nullptr;
+		if (frame && frame->findAndGetSequenceItem(seq, item, 0).good()) return item;
+		if (shared && shared->findAndGetSequenceItem(seq, item, 0).good()) return item;
+		return nullptr;
+	};
+	DcmItem* first = perFrame && perFrame->card() > 0 ? perFrame->getItem(0) : nullptr;
+
+	if (DcmItem* measures = group(first, DCM_PixelMeasuresSequence)) {
+		measures->findAndGetFloat64(DCM_PixelSpacing, src.mSpacingX, 0);
+		measures->findAndGetFloat64(DCM_PixelSpacing, src.mSpacingY, 1);
+		measures->findAndGetFloat64(DCM_SliceThickness, src.mThickness, 0);
+	}
+	if (DcmItem* transform = group(first, DCM_PixelValueTransformationSequence)) {
+		transform->findAndGetFloat64(DCM_RescaleSlope, src.mRescaleSlope);
+		transform->findAndGetFloat64(DCM_RescaleIntercept, src.mRescaleIntercept);
+		if (src.mRescaleSlope == 0.0) src.mRaw = false;
+		StoredRangeWindow(src);
+	}
+
+	Float64 o[6] = { 1, 0, 0, 0, 1, 0 };
+	if (DcmItem* orientation = group(first, DCM_PlaneOrientationSequence))
+		for (unsigned long i = 0; i < 6; i++)
+			orientation->findAndGetFloat64(DCM_ImageOrientationPatient, o[i], i);
+	double n[3] = {
+		o[1] * o[5] - o[2] * o[4],
+		o[2] * o[3] - o[0] * o[5],
+		o[0] * o[4] - o[1] * o[3]
+	};
+
+	locations.resize(src.mFrameCount);
+	for (unsigned int f = 0; f < src.mFrameCount; f++) {
+		DcmItem* frame = perFrame && f < perFrame->card() ? perFrame->getItem(f) : nullptr;
+		DcmItem* position = group(frame, DCM_PlanePositionSequence);
+		Float64 p[3] = { 0, 0, (double)f };
+		if (position)
+			for (unsigned long i = 0; i < 3; i++)
+				position->findAndGetFloat64(DCM_ImagePositionPatient, p[i], i);
+		locations[f] = position ? p[0] * n[0] + p[1] * n[1] + p[2] * n[2] : f * (src.mThickness > 0.0 ? src.mThickness : 1.0);
 	}
 }
 
 shared_ptr<Texture> LoadDicomImage(const string& path, vec3& size) {
 	// Get information
-	DicomImage* image = nullptr;
-	double x = 0.0;
-	double spacingX = 0.0;
-	double spacingY = 0.0;
-	double thickness = 0.0;
-	ReadDicomSlice(image, x, path, spacingX, spacingY, thickness);
-	
-	unsigned int w = image->getWidth();
-	unsigned int h = image->getHeight();
+	DicomSlice slice;
+	slice.mFile = path;
+	if (!ReadDicomSlice(slice)) return nullptr;
+	if (slice.mRaw) slice.mFileFormat.reset();
+
+	unsigned int w = slice.mWidth;
+	unsigned int h = slice.mHeight;
 	unsigned int d = 1;
 
 	// volume size in meters
-	size.x = .001f * (float)spacingX * w;
-	size.y = .001f * (float)spacingY * h;
-	size.z = .001f * (float)thickness;
+	size.x = .001f * (float)slice.mSpacingX * w;
+	size.y = .001f * (float)slice.mSpacingY * h;
+	size.z = .001f * (float)slice.mThickness;
 
-	uint16_t * data = new uint16_t[w * h * d * 2];
-	memset(data, 0xFF, w * h * d * sizeof(uint16_t) * 2);
-	ReadDicomImage(image, data, w, h);
+	uint16_t * data = new uint16_t[w * h * d];
+	if (!ReadDicomImage(slice, data)) {
+		delete[] data;
+		return nullptr;
+	}
 
-	auto tex = shared_ptr<Texture>(new Texture(w, h, d, GL_RG16, GL_RG, GL_UNSIGNED_SHORT, GL_LINEAR, data));
+	auto tex = shared_ptr<Texture>(new Texture(w, h, d, GL_R16, GL_RED, GL_UNSIGNED_SHORT, GL_LINEAR, data));
 	delete[] data;
 
 	return tex;
 }
 
-shared_ptr<Texture> LoadDicomVolume(const vector<string>& files, vec3& size) {
-	vector<Slice> images;
+// Number of slices uploaded together
+#define SLAB_SIZE 16
 
-	// Get information
-	double spacingX = 0.0;
-	double spacingY = 0.0;
-	double thickness = 0.0;
+struct VolumeStream::Slabs {
+	vector<DicomSlice> mSlices;
+	unsigned int mWidth;
+	unsigned int mHeight;
+	unsigned int mDepth;
+	vec3 mSize;
+	// staging buffer for the whole volume, slabs are uploaded out of it in place
+	uint16_t* mData;
+	// owns mData, the cache when the voxels come from one
+	shared_ptr<void> mDataOwner;
+	bool mCached;
+
+	unsigned int mSlabCount;
+	unique_ptr<atomic<unsigned int>[]> mRemaining;
+	unsigned int mUploaded;
+	mutex mMutex;
+	vector<unsigned int> mFinished;
 
-	for (unsigned int i = 0; i < (int)files.size(); i++) {
-		DicomImage* img;
-		double x;
-		ReadDicomSlice(img, x, files[i], spacingX, spacingY, thickness);
-		images.push_back({ img, x });
+	// slice each frame of a multi-frame object goes to
+	vector<unsigned int> mFrameSlice;
+	// the slices as decoded, for VolumeResampler and the masks
+	SliceGrid mGrid;
+
+	// modality values of texels 0 and 65535
+	double mWindowMin;
+	double mWindowMax;
+	bool mReducing;
+	// set once the statistics and the pyramid are built
+	atomic<bool> mStatsReady;
+	VolumeStats mStats;
+	shared_ptr<VolumePyramid> mPyramid;
+	// false if the full resolution doesn't fit, the slabs are only uploaded from the pyramid then
+	bool mDirectUpload;
+
+	// set by the background job once the dimensions are known and the staging buffer exists
+	atomic<bool> mReady;
+	atomic<bool> mFailed;
+	atomic<bool> mCancelled;
+	atomic<unsigned int> mDecoded;
+
+	string mCachePath;
+	uint64_t mCacheKey;
+	chrono::high_resolution_clock::time_point mStart;
+
+	Slabs() : mWidth(0), mHeight(0), mDepth(0), mData(nullptr), mCached(false), mSlabCount(0), mUploaded(0), mWindowMin(0.0), mWindowMax(65535.0),
+		mReducing(false), mStatsReady(false), mDirectUpload(true), mReady(false), mFailed(false), mCancelled(false), mDecoded(0), mCacheKey(0) {}
+};
+
+VolumeStream::VolumeStream(const shared_ptr<::Texture>& texture, const vec3& size, const VolumeStats& stats)
+	: mTexture(texture), mSize(size), mStats(stats), mLevel(0), mFailed(false), mUploadedSlices(0) {}
+VolumeStream::VolumeStream(const shared_ptr<Slabs>& slabs)
+	: mTexture(nullptr), mSize(vec3(1.f)), mSlabs(slabs), mLevel(0), mFailed(false), mUploadedSlices(0) {}
+VolumeStream::~VolumeStream() {
+	// queued slices are skipped once nobody is waiting for them
+	if (mSlabs) mSlabs->mCancelled = true;
+}
+
+void VolumeStream::Cancel() {
+	if (mSlabs) mSlabs->mCancelled = true;
+}
+
+float VolumeStream::Progress() const {
+	if (!mSlabs) return mFailed ? 0.f : 1.f;
+	if (!mSlabs->mReady || mSlabs->mDepth == 0) return 0.f;
+	// the dimensions change while resampling
+	if (mSlabs->mReducing) return 1.f;
+	// decoding and uploading weigh the same, the statistics pass is quick enough to ignore
+	return .5f * mSlabs->mDecoded / mSlabs->mDepth + .5f * mSlabs->mUploaded / mSlabs->mSlabCount;
+}
+
+// Statistics until the volume is decoded, the value mapping is known but the range is the whole window
+VolumeStats WindowStats(const VolumeStream::Slabs& slabs) {
+	VolumeStats stats;
+	stats.mValueScale = (float)(slabs.mWindowMax - slabs.mWindowMin);
+	stats.mValueOffset = (float)slabs.mWindowMin;
+	stats.mMin = (float)slabs.mWindowMin;
+	stats.mMax = (float)slabs.mWindowMax;
+	return stats;
+}
+
+bool VolumeStream::Update(double budget) {
+	mUploadedSlices = uvec2(0);
+	if (!mSlabs) return false;
+
+	if (mSlabs->mFailed || mSlabs->mCancelled) {
+		if (mSlabs->mCancelled) printf("cancelled loading\n");
+		mFailed = true;
+		mSlabs.reset();
+		return false;
+	}
+	if (!mSlabs->mReady) return false;
+
+	if (!mTexture && mSlabs->mDirectUpload) {
+		mSize = mSlabs->mSize;
+		mStats = WindowStats(*mSlabs);
+
+		// anything larger than the GL limit or the budget waits for the pyramid
+		GLint maxSize;
+		glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &maxSize);
+		size_t bytes = (size_t)mSlabs->mWidth * mSlabs->mHeight * mSlabs->mDepth * sizeof(uint16_t);
+		if (VolumeResampler::sEnabled && !mSlabs->mCached && !mSlabs->mGrid.mPositions.empty()) {
+			// the resampled grid is uploaded once it exists
+			mSlabs->mDirectUpload = false;
+		} else if (mSlabs->mWidth > (unsigned int)maxSize || mSlabs->mHeight > (unsigned int)maxSize || mSlabs->mDepth > (unsigned int)maxSize || bytes > VolumePyramid::sBudget) {
+			printf("%ux%ux%u exceeds the texture limits, drawing a lower resolution\n", mSlabs->mWidth, mSlabs->mHeight, mSlabs->mDepth);
+			mSlabs->mDirectUpload = false;
+		} else {
+			mTexture = shared_ptr<::Texture>(new ::Texture(mSlabs->mWidth, mSlabs->mHeight, mSlabs->mDepth, GL_R16, GL_RED, GL_UNSIGNED_SHORT, GL_LINEAR));
+			mTexture->Clear();
+		}
+	}
+
+	// upload finished slabs until the budget is used up, at least one per call so the load always advances
+	auto start = chrono::high_resolution_clock::now();
+	bool uploaded = false;
+	while (!uploaded || budget <= 0.0 || chrono::duration<double>(chrono::high_resolution_clock::now() - start).count() < budget) {
+		unsigned int s;
+		{
+			lock_guard<mutex> lock(mSlabs->mMutex);
+			if (mSlabs->mFinished.empty()) break;
+			s = mSlabs->mFinished.back();
+			mSlabs->mFinished.pop_back();
+		}
+
+		// only read while slabs are pending, the resampler changes the dimensions afterwards
+		unsigned int w = mSlabs->mWidth;
+		unsigned int h = mSlabs->mHeight;
+		unsigned int z = s * SLAB_SIZE;
+		unsigned int d = std::min<unsigned int>(SLAB_SIZE, mSlabs->mDepth - z);
+		if (mSlabs->mDirectUpload) {
+			StageTimer timer(LOADER_UPLOAD);
+			mTexture->Upload(0, 0, z, w, h, d, mSlabs->mData + (size_t)z * w * h);
+			if (mUploadedSlices.x < mUploadedSlices.y)
+				mUploadedSlices = uvec2(std::min(mUploadedSlices.x, z), std::max(mUploadedSlices.y, z + d));
+			else
+				mUploadedSlices = uvec2(z, z + d);
+		}
+		mSlabs->mUploaded++;
+		uploaded = true;
+	}
+
+	if (mSlabs->mUploaded == mSlabs->mSlabCount && !mSlabs->mReducing) {
+		double seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - mSlabs->mStart).count();
+		printf("read %u slices in %.2fs (%.1f slices/s, %u threads)\n", mSlabs->mDepth, seconds, mSlabs->mDepth / seconds, ThreadPool::Shared().ThreadCount());
+
+		// the task holds on to the staging buffer until the statistics and the cache are written
+		mSlabs->mReducing = true;
+		shared_ptr<Slabs> slabs = mSlabs;
+		ThreadPool::Shared().Enqueue([slabs]() {
+			if (!slabs->mCached && VolumeResampler::sEnabled && !slabs->mGrid.mPositions.empty()) {
+				SliceGrid& grid = slabs->mGrid;
+				shared_ptr<vector<uint16_t>> resampled(new vector<uint16_t>());
+				*resampled = VolumeResampler::Resample(slabs->mData, grid, slabs->mSize);
+				slabs->mWidth = grid.mResampledDimensions.x;
+				slabs->mHeight = grid.mResampledDimensions.y;
+				slabs->mDepth = grid.mResampledDimensions.z;
+				slabs->mData = resampled->data();
+				slabs->mDataOwner = resampled;
+			}
+			if (!slabs->mCached) {
+				slabs->mStats = VolumeStats::Compute(slabs->mData, (size_t)slabs->mWidth * slabs->mHeight * slabs->mDepth, 1,
+					(float)(slabs->mWindowMax - slabs->mWindowMin), (float)slabs->mWindowMin);
+				printf("values %.1f to %.1f\n", slabs->mStats.mMin, slabs->mStats.mMax);
+			}
+			slabs->mPyramid = VolumePyramid::Build(slabs->mDataOwner, slabs->mData, slabs->mWidth, slabs->mHeight, slabs->mDepth, VolumePyramid::sFilter);
+			slabs->mStatsReady = true;
+
+			if (!slabs->mCachePath.empty())
+				VolumeCache::Save(slabs->mCachePath, slabs->mCacheKey, slabs->mSize, slabs->mStats, slabs->mGrid,
+					slabs->mWidth, slabs->mHeight, slabs->mDepth, GL_R16, GL_RED, GL_UNSIGNED_SHORT, slabs->mData);
+		});
+	}
+
+	if (mSlabs->mUploaded == mSlabs->mSlabCount && mSlabs->mStatsReady) {
+		mStats = mSlabs->mStats;
+		mSize = mSlabs->mSize;
+		mPyramid = mSlabs->mPyramid;
+		mGrid = mSlabs->mGrid;
+		if (!mSlabs->mDirectUpload) {
+			GLint maxSize;
+			glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &maxSize);
+			Level(mPyramid->FinestLevel((unsigned int)maxSize, VolumePyramid::sBudget));
+		}
+		mSlabs.reset();
+		return true;
+	}
+
+	return uploaded;
+}
+
+void VolumeStream::Level(unsigned int level) {
+	if (!mPyramid) return;
+	mLevel = std::min(level, mPyramid->LevelCount() - 1);
+	StageTimer timer(LOADER_UPLOAD);
+	mTexture = mPyramid->Upload(mLevel);
+	timer.Stop();
+	const VolumePyramid::Level& l = mPyramid->GetLevel(mLevel);
+	printf("level %u: %ux%ux%u\n", mLevel, l.mWidth, l.mHeight, l.mDepth);
+}
+
+// Sets the dimensions and allocates the staging buffer, the texture is created by VolumeStream::Update
+void AllocateSlabs(VolumeStream::Slabs& slabs, unsigned int w, unsigned int h, unsigned int d, const vec3& size) {
+	slabs.mWidth = w;
+	slabs.mHeight = h;
+	slabs.mDepth = d;
+	slabs.mSize = size;
+	if (!slabs.mCached) {
+		slabs.mData = new uint16_t[(size_t)w * h * d];
+		memset(slabs.mData, 0, (size_t)w * h * d * sizeof(uint16_t));
+		slabs.mDataOwner = shared_ptr<uint16_t>(slabs.mData, default_delete<uint16_t[]>());
 	}
 
-	std::sort(images.begin(), images.end(), [](const Slice& a, const Slice& b) {
-		return a.location < b.location;
+	slabs.mSlabCount = (d + SLAB_SIZE - 1) / SLAB_SIZE;
+	slabs.mRemaining = unique_ptr<atomic<unsigned int>[]>(new atomic<unsigned int>[slabs.mSlabCount]);
+	for (unsigned int s = 0; s < slabs.mSlabCount; s++)
+		slabs.mRemaining[s] = std::min<unsigned int>(SLAB_SIZE, d - s * SLAB_SIZE);
+}
+// Called once slice z is in the staging buffer, the last slice of a slab queues it for upload
+void FinishSlice(VolumeStream::Slabs& slabs, unsigned int z) {
+	slabs.mDecoded++;
+	unsigned int s = z / SLAB_SIZE;
+	if (--slabs.mRemaining[s] == 0) {
+		lock_guard<mutex> lock(slabs.mMutex);
+		slabs.mFinished.push_back(s);
+	}
+}
+
+// Uploads a cached volume through the same slabs, the voxels are already there
+bool StartCachedVolume(const shared_ptr<VolumeStream::Slabs>& slabs, const shared_ptr<VolumeCache::Data>& cache) {
+	if (cache->mInternalFormat != GL_R16) return false;
+
+	slabs->mCached = true;
+	slabs->mDataOwner = cache;
+	slabs->mData = (uint16_t*)cache->mVoxels;
+	AllocateSlabs(*slabs, cache->mWidth, cache->mHeight, cache->mDepth, cache->mSize);
+	slabs->mStats = cache->mStats;
+	slabs->mGrid = cache->mGrid;
+	slabs->mWindowMin = cache->mStats.mValueOffset;
+	slabs->mWindowMax = cache->mStats.mValueOffset + cache->mStats.mValueScale;
+
+	for (unsigned int z = 0; z < slabs->mDepth; z++)
+		FinishSlice(*slabs, z);
+	slabs->mReady = true;
+	return true;
+}
+
+// Reads every header and queues the slices for decoding
+// The result is written to the cache (if it has a path) once every slab has been uploaded.
+bool StartDicomVolume(const shared_ptr<VolumeStream::Slabs>& slabs, const vector<string>& files) {
+	ThreadPool& pool = ThreadPool::Shared();
+
+	// Read the headers of every slice in parallel
+	vector<DicomSlice> slices(files.size());
+	vector<char> valid(files.size());
+	pool.ParallelFor(0, files.size(), [&](size_t i) {
+		if (slabs->mCancelled) return;
+		StageTimer timer(LOADER_HEADERS);
+		slices[i].mFile = files[i];
+		valid[i] = ReadDicomSlice(slices[i]);
+		// the raw path never touches the dataset again
+		if (slices[i].mRaw) slices[i].mFileFormat.reset();
+	});
+	if (slabs->mCancelled) return false;
+
+	vector<DicomSlice>& images = slabs->mSlices;
+	images.reserve(slices.size());
+	for (size_t i = 0; i < slices.size(); i++)
+		if (valid[i]) images.push_back(move(slices[i]));
+	if (images.empty()) return false;
+
+	std::sort(images.begin(), images.end(), [](const DicomSlice& a, const DicomSlice& b) {
+		return a.mLocation < b.mLocation;
 	});
 
-	unsigned int w = images[0].image->getWidth();
-	unsigned int h = images[0].image->getHeight();
+	unsigned int w = images[0].mWidth;
+	unsigned int h = images[0].mHeight;
+
+	// slices with another pixel spacing would be stretched onto the grid of the others
+	double spacingX = images[0].mSpacingX;
+	double spacingY = images[0].mSpacingY;
+	double thickness = 0.0;
+	for (auto it = images.begin(); it != images.end();) {
+		if (it->mWidth != w || it->mHeight != h) {
+			printf("Skipping %s: %ux%u does not match %ux%u\n", it->mFile.c_str(), it->mWidth, it->mHeight, w, h);
+			it = images.erase(it);
+			continue;
+		}
+		if (fabs(it->mSpacingX - spacingX) > .001 * spacingX || fabs(it->mSpacingY - spacingY) > .001 * spacingY) {
+			printf("Skipping %s: %.4fx%.4fmm pixels do not match %.4fx%.4fmm\n", it->mFile.c_str(), it->mSpacingX, it->mSpacingY, spacingX, spacingY);
+			it = images.erase(it);
+			continue;
+		}
+		thickness = std::max(it->mThickness, thickness);
+		it++;
+	}
+
 	unsigned int d = (unsigned int)images.size();
 
-	// volume size in meters
+	// one window for the whole volume, so slices keep their relative intensities
+	double windowMin = images[0].mWindowMin;
+	double windowMax = images[0].mWindowMax;
+	for (const auto& i : images) {
+		windowMin = std::min(windowMin, i.mWindowMin);
+		windowMax = std::max(windowMax, i.mWindowMax);
+	}
+	for (auto& i : images) {
+		i.mWindowMin = windowMin;
+		i.mWindowMax = windowMax;
+	}
+	slabs->mWindowMin = windowMin;
+	slabs->mWindowMax = windowMax;
+
+	// slices without positions are stacked at their thickness
+	SliceGrid& grid = slabs->mGrid;
+	grid.mPositions.resize(d);
+	for (unsigned int i = 0; i < d; i++)
+		grid.mPositions[i] = images[i].mLocation;
+	double spacingZ = VolumeResampler::SliceSpacing(grid.mPositions);
+	if (spacingZ == 0.0) {
+		spacingZ = thickness > 0.0 ? thickness : 1.0;
+		for (unsigned int i = 0; i < d; i++)
+			grid.mPositions[i] = i * spacingZ;
+	} else if (thickness > 0.0 && fabs(spacingZ - thickness) > .01 * thickness)
+		printf("slices are %.3fmm apart but %.3fmm thick\n", spacingZ, thickness);
+	grid.mWidth = w;
+	grid.mHeight = h;
+	grid.mSpacingX = spacingX;
+	grid.mSpacingY = spacingY;
+
+	// volume size in meters, from the slice positions rather than the thickness
+	vec3 size;
 	size.x = .001f * (float)spacingX * w;
 	size.y = .001f * (float)spacingY * h;
-	size.z = .001f * (float)thickness * images.size();
+	size.z = .001f * (float)(grid.mPositions[d - 1] - grid.mPositions[0] + spacingZ);
 
 	printf("%fm x %fm x %fm\n", size.x, size.y, size.z);
 
-	uint16_t* data = new uint16_t[w * h * d * 2];
-	memset(data, 0xFFFF, w * h * d * sizeof(uint16_t) * 2);
-
-	if (THREAD_COUNT > 1) {
-		printf("reading %d slices\n", d);
-		vector<thread> threads;
-		int s = ((int)images.size() + THREAD_COUNT - 1) / THREAD_COUNT;
-		for (int i = 0; i < (int)images.size(); i += s)
-			threads.push_back(thread(ReadDicomImages, data, images, i, i + s, w, h));
-		for (int i = 0; i < (int)threads.size(); i++)
-			threads[i].join();
-	} else {
-		ReadDicomImages(data, images, 0, (int)images.size(), w, h);
+	AllocateSlabs(*slabs, w, h, d, size);
+	slabs->mReady = true;
+
+	// Decode every slice straight into its place in the volume
+	printf("reading %d slices\n", d);
+	for (unsigned int i = 0; i < d; i++)
+		pool.Enqueue([slabs, i]() {
+			unsigned int w = slabs->mWidth;
+			unsigned int h = slabs->mHeight;
+			if (!slabs->mCancelled) ReadDicomImage(slabs->mSlices[i], slabs->mData + (size_t)i * w * h);
+			FinishSlice(*slabs, i);
+		});
+
+	return true;
+}
+
+// Decodes frames [first, first + count) of a multi-frame object into their slices
+void ReadDicomFrames(VolumeStream::Slabs& slabs, unsigned int first, unsigned int count) {
+	const DicomSlice& src = slabs.mSlices[0];
+	unsigned int w = slabs.mWidth;
+	unsigned int h = slabs.mHeight;
+	size_t sliceSize = (size_t)w * h;
+
+	if (src.mRaw && !slabs.mCancelled) {
+		StageTimer timer(LOADER_DECODE);
+		MappedFile file(src.mFile);
+		const uint16_t* pixels = FindRawPixelData(file, src);
+		timer.Stop();
+		if (pixels) {
+			for (unsigned int f = first; f < first + count; f++) {
+				unsigned int z = slabs.mFrameSlice[f];
+				if (!slabs.mCancelled) RescaleRawSlice(pixels + f * sliceSize, src, slabs.mData + z * sliceSize);
+				FinishSlice(slabs, z);
+			}
+			return;
+		}
 	}
 
-	auto tex = shared_ptr<Texture>(new Texture(w, h, d, GL_RG16, GL_RG, GL_UNSIGNED_SHORT, GL_LINEAR, data));
-	delete[] data;
+	// every task parses the header once and decodes its frames one at a time
+	StageTimer timer(LOADER_HEADERS);
+	DcmFileFormat fileFormat;
+	OFCondition cnd = fileFormat.loadFile(src.mFile.c_str(), EXS_Unknown, EGL_noChange, DICOM_PRESCAN_LENGTH);
+	timer.Stop();
+	if (cnd.bad()) printf("Failed to read %s: %s\n", src.mFile.c_str(), cnd.text());
 
-	return tex;
+	for (unsigned int f = first; f < first + count; f++) {
+		unsigned int z = slabs.mFrameSlice[f];
+		if (cnd.good() && !slabs.mCancelled) {
+			StageTimer decode(LOADER_DECODE);
+			DicomImage img(fileFormat.getDataset(), fileFormat.getDataset()->getOriginalXfer(), CIF_UsePartialAccessToPixelData, f, 1);
+			decode.Stop();
+			if (img.getStatus() == EIS_Normal)
+				CopyDicomImage(img, src, 0, slabs.mData + z * sliceSize);
+			else
+				printf("Failed to decode frame %u of %s: %s\n", f, src.mFile.c_str(), DicomImage::getString(img.getStatus()));
+		}
+		FinishSlice(slabs, z);
+	}
+}
+
+// Reads an enhanced multi-frame object and queues its frames, ordered by their position along the slice normal
+bool StartMultiFrameVolume(const shared_ptr<VolumeStream::Slabs>& slabs, const string& file) {
+	ThreadPool& pool = ThreadPool::Shared();
+
+	slabs->mSlices.resize(1);
+	DicomSlice& src = slabs->mSlices[0];
+	src.mFile = file;
+	StageTimer timer(LOADER_HEADERS);
+	if (!ReadDicomSlice(src)) return false;
+
+	vector<double> locations;
+	ReadFrameGeometry(src, locations);
+	src.mFileFormat.reset();
+	timer.Stop();
+	slabs->mWindowMin = src.mWindowMin;
+	slabs->mWindowMax = src.mWindowMax;
+
+	unsigned int w = src.mWidth;
+	unsigned int h = src.mHeight;
+	unsigned int d = src.mFrameCount;
+
+	vector<unsigned int> order(d);
+	for (unsigned int i = 0; i < d; i++) order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) {
+		return locations[a] < locations[b];
+	});
+	SliceGrid& grid = slabs->mGrid;
+	slabs->mFrameSlice.resize(d);
+	grid.mPositions.resize(d);
+	for (unsigned int z = 0; z < d; z++) {
+		slabs->mFrameSlice[order[z]] = z;
+		grid.mPositions[z] = locations[order[z]];
+	}
+	grid.mWidth = w;
+	grid.mHeight = h;
+	grid.mSpacingX = src.mSpacingX;
+	grid.mSpacingY = src.mSpacingY;
+
+	// distance between frame positions if there is more than one, SliceThickness otherwise
+	double thickness = src.mThickness;
+	if (d > 1 && locations[order[d - 1]] > locations[order[0]])
+		thickness = (locations[order[d - 1]] - locations[order[0]]) / (d - 1);
+
+	// volume size in meters
+	vec3 size;
+	size.x = .001f * (float)src.mSpacingX * w;
+	size.y = .001f * (float)src.mSpacingY * h;
+	size.z = .001f * (float)thickness * d;
+
+	printf("%fm x %fm x %fm\n", size.x, size.y, size.z);
+
+	AllocateSlabs(*slabs, w, h, d, size);
+	slabs->mReady = true;
+
+	// split the frames into a few runs per thread
+	unsigned int run = std::max(1u, d / (pool.ThreadCount() * 4));
+	printf("reading %d frames\n", d);
+	for (unsigned int first = 0; first < d; first += run) {
+		unsigned int count = std::min(run, d - first);
+		pool.Enqueue([slabs, first, count]() {
+			ReadDicomFrames(*slabs, first, count);
+		});
+	}
+
+	return true;
+}
+
+// Background part of StreamVolume, the cache or the headers of a series
+// The cache is written to cachePath with key, it has been looked up already.
+void StartSeries(const shared_ptr<VolumeStream::Slabs>& slabs, const SeriesInfo& series, const string& cachePath, uint64_t key) {
+	slabs->mCachePath = cachePath;
+	slabs->mCacheKey = key;
+
+	bool started;
+	// more slices than files means enhanced multi-frame objects, each one is a whole volume
+	if (series.mSliceCount > series.mFiles.size()) {
+		if (series.mFiles.size() > 1) printf("%s has %u multi-frame objects, loading the first\n", series.mSeriesUID.c_str(), (unsigned int)series.mFiles.size());
+		started = StartMultiFrameVolume(slabs, series.mFiles[0]);
+	} else
+		started = StartDicomVolume(slabs, series.mFiles);
+
+	if (!started) slabs->mFailed = true;
+}
+void StartSeries(const shared_ptr<VolumeStream::Slabs>& slabs, const SeriesInfo& series) {
+	uint64_t key = VolumeCache::Key(series.mFiles) ^ VolumeResampler::Key();
+	string cachePath = VolumeCache::Path(series.mFolder + "/" + series.mSeriesUID + (series.mTemporalPosition ? "/" + to_string(series.mTemporalPosition) : ""));
+
+	if (auto cache = VolumeCache::Read(cachePath, key))
+		if (StartCachedVolume(slabs, cache)) return;
+	StartSeries(slabs, series, cachePath, key);
 }
 
 shared_ptr<Texture> ImageLoader::LoadImage(const string& path, vec3& size) {
-#ifdef WINDOWS
-	if (!PathFileExists(path.c_str())) {
-#endif
+	error_code ec;
+	if (!fs::is_regular_file(path, ec)) {
 		printf("%s Does not exist!\n", path.c_str());
 		return 0;
 	}
@@ -189,76 +909,484 @@ shared_ptr<Texture> ImageLoader::LoadImage(const string& path, vec3& size) {
 		return 0;
 }
 
-void GetFiles(const string& path, vector<string>& files) {
-#ifdef WINDOWS
-	string d = path + "\\*";
+// Lists the files in a folder with one of the given extensions
+void GetFiles(const string& path, vector<string>& files, const vector<string>& extensions) {
+	error_code ec;
+	for (fs::directory_iterator it(path, ec), end; !ec && it != end; it.increment(ec)) {
+		if (!it->is_regular_file(ec)) continue;
+		string c = it->path().string();
+		if (find(extensions.begin(), extensions.end(), GetExt(c)) != extensions.end())
+			files.push_back(fs::absolute(c, ec).string());
+	}
+}
+
+// Lists every file below dir, subdirectories are walked in parallel
+void ListFiles(const fs::path& dir, vector<string>& files, mutex& filesMutex) {
+	vector<fs::path> dirs;
+	vector<string> local;
 
-	WIN32_FIND_DATAA ffd;
-	HANDLE hFind = FindFirstFile(d.c_str(), &ffd);
-	if (hFind == INVALID_HANDLE_VALUE) {
-		assert(false);
-		return;
+	error_code ec;
+	for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+		string name = it->path().filename().string();
+		if (name.empty() || name[0] == '.') continue;
+
+		if (it->is_directory(ec))
+			dirs.push_back(it->path());
+		else if (it->is_regular_file(ec))
+			local.push_back(it->path().string());
+	}
+
+	{
+		lock_guard<mutex> lock(filesMutex);
+		files.insert(files.end(), local.begin(), local.end());
 	}
 
-	do {
-		if (ffd.cFileName[0] == L'.') continue;
+	ThreadPool::Shared().ParallelFor(0, dirs.size(), [&](size_t i) {
+		ListFiles(dirs[i], files, filesMutex);
+	});
+}
 
-		string c = path + "\\" + ffd.cFileName;
+// .dcm files, or any other file with the DICM magic after the 128 byte preamble
+bool IsDicomFile(const string& path) {
+	string ext = GetExt(path);
+	if (ext == "dcm" || ext == "DCM") return true;
 
-		if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-			// file is a directory
-		}
-		else {
-			string ext = GetExt(c);
-			if (ext == "dcm" || ext == "raw" || ext == "png")
-				files.push_back(GetFullPath(c));
-		}
-	} while (FindNextFileA(hFind, &ffd) != 0);
+	char magic[132];
+	ifstream file(path, ios::binary);
+	if (!file.read(magic, 132)) return false;
+	return memcmp(magic + 128, "DICM", 4) == 0;
+}
 
-	FindClose(hFind);
-#endif
+// Reads the tags that identify which series a file belongs to
+// Parsing stops at BitsAllocated (0028,0100), everything needed to group files comes before it.
+bool ReadSeriesTags(const string& file, SeriesInfo& info) {
+	DcmFileFormat fileFormat;
+	OFCondition cnd = fileFormat.loadFileUntilTag(file.c_str(), EXS_Unknown, EGL_noChange, DICOM_PRESCAN_LENGTH, ERM_autoDetect, DCM_BitsAllocated);
+	if (cnd.bad()) return false;
+	DcmDataset* dataset = fileFormat.getDataset();
+
+	OFString uid;
+	if (dataset->findAndGetOFString(DCM_SeriesInstanceUID, uid).bad()) return false;
+	info.mSeriesUID = uid.c_str();
+
+	OFString str;
+	if (dataset->findAndGetOFString(DCM_SeriesDescription, str).good()) info.mDescription = str.c_str();
+	if (dataset->findAndGetOFString(DCM_Modality, str).good()) info.mModality = str.c_str();
+
+	Sint32 number = 0;
+	if (dataset->findAndGetSint32(DCM_SeriesNumber, number).good()) info.mSeriesNumber = number;
+	if (dataset->findAndGetSint32(DCM_TemporalPositionIdentifier, number).good()) info.mTemporalPosition = number;
+	dataset->findAndGetFloat64(DCM_TriggerTime, info.mTriggerTime);
+
+	Uint16 w = 0;
+	Uint16 h = 0;
+	dataset->findAndGetUint16(DCM_Columns, w);
+	dataset->findAndGetUint16(DCM_Rows, h);
+	info.mWidth = w;
+	info.mHeight = h;
+
+	Sint32 frames = 1;
+	dataset->findAndGetSint32(DCM_NumberOfFrames, frames);
+	info.mSliceCount = (unsigned int)std::max(frames, 1);
+
+	Float64 o[6] = { 1, 0, 0, 0, 1, 0 };
+	for (unsigned long i = 0; i < 6; i++)
+		dataset->findAndGetFloat64(DCM_ImageOrientationPatient, o[i], i);
+	info.mRowDirection = vec3((float)o[0], (float)o[1], (float)o[2]);
+	info.mColumnDirection = vec3((float)o[3], (float)o[4], (float)o[5]);
+
+	return w > 0 && h > 0;
 }
-shared_ptr<Texture> ImageLoader::LoadVolume(const string& path, vec3& size) {
-#ifdef WINDOWS
-	if (!PathFileExists(path.c_str())) {
-#endif
+
+vector<SeriesInfo> ImageLoader::ScanSeries(const string& path) {
+	error_code ec;
+	if (!fs::is_directory(path, ec)) {
 		printf("%s Does not exist!\n", path.c_str());
-		return 0;
+		return vector<SeriesInfo>();
 	}
 
+	auto start = chrono::high_resolution_clock::now();
+	StageTimer timer(LOADER_SCAN);
+
 	vector<string> files;
-	GetFiles(path, files);
+	mutex filesMutex;
+	ListFiles(path, files, filesMutex);
 
-	if (files.size() == 0) return 0;
+	vector<SeriesInfo> entries(files.size());
+	vector<char> valid(files.size());
+	ThreadPool::Shared().ParallelFor(0, files.size(), [&](size_t i) {
+		valid[i] = IsDicomFile(files[i]) && ReadSeriesTags(files[i], entries[i]);
+	}, 8);
 
-	string ext = GetExt(files[0]);
-	if (ext == "dcm")
-		return LoadDicomVolume(files, size);
+	// group by series, orientation and slice size
+	vector<SeriesInfo> series;
+	unordered_map<string, size_t> index;
+	for (size_t i = 0; i < files.size(); i++) {
+		if (!valid[i]) continue;
+		SeriesInfo& e = entries[i];
+
+		char key[256];
+		snprintf(key, 256, "%.3f %.3f %.3f %.3f %.3f %.3f %ux%u %d",
+			e.mRowDirection.x, e.mRowDirection.y, e.mRowDirection.z,
+			e.mColumnDirection.x, e.mColumnDirection.y, e.mColumnDirection.z, e.mWidth, e.mHeight, e.mTemporalPosition);
+		string k = e.mSeriesUID + " " + key;
+
+		auto it = index.find(k);
+		if (it == index.end()) {
+			it = index.emplace(k, series.size()).first;
+			e.mFolder = path;
+			series.push_back(e);
+		}
+		else
+			series[it->second].mSliceCount += e.mSliceCount;
+		series[it->second].mFiles.push_back(files[i]);
+	}
+
+	std::sort(series.begin(), series.end(), [](const SeriesInfo& a, const SeriesInfo& b) {
+		return a.mSliceCount > b.mSliceCount;
+	});
+
+	double seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+	printf("scanned %u files in %.2fs, found %u series\n", (unsigned int)files.size(), seconds, (unsigned int)series.size());
+
+	return series;
+}
+
+bool ImageLoader::DecodeVolume(const SeriesInfo& series, vector<uint16_t>& voxels, uvec3& dimensions, vec3& size, VolumeStats& stats) {
+	if (series.mFiles.empty()) return false;
+	shared_ptr<VolumeStream::Slabs> slabs(new VolumeStream::Slabs());
+	StartSeries(slabs, series);
+	if (slabs->mFailed) return false;
+
+	// help decoding instead of waiting
+	ThreadPool& pool = ThreadPool::Shared();
+	while (slabs->mDecoded < slabs->mDepth)
+		if (!pool.RunPendingTask())
+			this_thread::yield();
+
+	// the same grid StreamVolume puts the series on, caches are stored resampled already
+	if (!slabs->mCached && VolumeResampler::sEnabled && !slabs->mGrid.mPositions.empty()) {
+		voxels = VolumeResampler::Resample(slabs->mData, slabs->mGrid, slabs->mSize);
+		dimensions = slabs->mGrid.mResampledDimensions;
+	} else {
+		voxels.assign(slabs->mData, slabs->mData + (size_t)slabs->mWidth * slabs->mHeight * slabs->mDepth);
+		dimensions = uvec3(slabs->mWidth, slabs->mHeight, slabs->mDepth);
+	}
+	size = slabs->mSize;
+	stats = slabs->mCached ? slabs->mStats : WindowStats(*slabs);
+	return true;
+}
+
+shared_ptr<Texture> ImageLoader::LoadVolume(const string& path, vec3& size) {
+	shared_ptr<VolumeStream> stream = StreamVolume(path);
+
+	// help decoding instead of waiting
+	ThreadPool& pool = ThreadPool::Shared();
+	while (!stream->Done())
+		if (!stream->Update() && !pool.RunPendingTask())
+			this_thread::yield();
+
+	if (stream->Failed()) return nullptr;
+	size = stream->Size();
+	return stream->Texture();
+}
+shared_ptr<VolumeStream> ImageLoader::StreamVolume(const string& path) {
+	shared_ptr<VolumeStream::Slabs> slabs(new VolumeStream::Slabs());
+	slabs->mStart = chrono::high_resolution_clock::now();
+
+	ThreadPool::Shared().Enqueue([slabs, path]() {
+		// the cache of a folder is keyed on its listing, so reopening it skips parsing the headers of every file
+		vector<string> files;
+		mutex filesMutex;
+		error_code ec;
+		if (VolumeCache::sEnabled && fs::is_directory(path, ec)) ListFiles(path, files, filesMutex);
+		uint64_t key = VolumeCache::Key(files) ^ VolumeResampler::Key();
+		string cachePath = VolumeCache::Path(path);
+		if (!files.empty())
+			if (auto cache = VolumeCache::Read(cachePath, key))
+				if (StartCachedVolume(slabs, cache)) return;
+
+		vector<SeriesInfo> series = ScanSeries(path);
+		for (const auto& s : series)
+			printf("  %s %s: %u slices, %ux%u\n", s.mModality.c_str(), s.mDescription.c_str(), s.mSliceCount, s.mWidth, s.mHeight);
+		if (series.empty() || slabs->mCancelled) {
+			slabs->mFailed = true;
+			return;
+		}
+
+		// the largest series in the folder
+		StartSeries(slabs, series[0], cachePath, key);
+	});
+
+	return shared_ptr<VolumeStream>(new VolumeStream(slabs));
+}
+shared_ptr<VolumeStream> ImageLoader::StreamVolume(const SeriesInfo& series) {
+	shared_ptr<VolumeStream::Slabs> slabs(new VolumeStream::Slabs());
+	slabs->mStart = chrono::high_resolution_clock::now();
+	if (series.mFiles.empty())
+		slabs->mFailed = true;
 	else
-		return 0;
+		ThreadPool::Shared().Enqueue([slabs, series]() {
+			StartSeries(slabs, series);
+		});
+
+	return shared_ptr<VolumeStream>(new VolumeStream(slabs));
 }
 
-void ImageLoader::LoadMask(const string& path, const shared_ptr<Texture>& texture) {
-#ifdef WINDOWS
-	if (!PathFileExists(path.c_str())) {
-#endif
-		printf("%s Does not exist!\n", path.c_str());
+// Packs one 8 bit mask slice
+// With bits = 1, bit (x & 7) of byte x / 8 is set for every nonzero pixel, bits = 8 copies the slice as is.
+void PackMaskSlice(const uint8_t* src, unsigned int w, unsigned int h, unsigned int bits, uint8_t* dst) {
+	if (bits == 8) {
+		memcpy(dst, src, (size_t)w * h);
 		return;
 	}
 
+	unsigned int stride = (w + 7) / 8;
+	for (unsigned int y = 0; y < h; y++) {
+		const uint8_t* row = src + (size_t)y * w;
+		uint8_t* out = dst + (size_t)y * stride;
+		for (unsigned int b = 0; b < stride; b++) {
+			uint8_t v = 0;
+			for (unsigned int i = 0; i < 8 && b * 8 + i < w; i++)
+				v |= (uint8_t)((row[b * 8 + i] != 0) << i);
+			out[b] = v;
+		}
+	}
+}
+
+// Reads one slice of a mask stack (PNG, raw 8/16 bit or DICOM) as 8 bits per pixel
+bool ReadMaskSlice(const string& file, unsigned int w, unsigned int h, vector<uint8_t>& pixels) {
+	size_t count = (size_t)w * h;
+	pixels.resize(count);
+
+	string ext = GetExt(file);
+	if (ext == "png") {
+		int x, y, c;
+		stbi_uc* data = stbi_load(file.c_str(), &x, &y, &c, 1);
+		if (!data) return false;
+		bool match = x == (int)w && y == (int)h;
+		if (match) memcpy(pixels.data(), data, count);
+		stbi_image_free(data);
+		return match;
+	}
+
+	if (ext == "raw") {
+		MappedFile raw(file);
+		if (!raw.Data()) return false;
+		if (raw.Size() == count)
+			memcpy(pixels.data(), raw.Data(), count);
+		else if (raw.Size() == count * sizeof(uint16_t)) {
+			const uint16_t* data = (const uint16_t*)raw.Data();
+			for (size_t i = 0; i < count; i++)
+				pixels[i] = (uint8_t)std::min<uint16_t>(data[i], 255);
+		} else
+			return false;
+		return true;
+	}
+
+	ImageLoader::RegisterCodecs();
+	DicomImage img(file.c_str());
+	if (img.getStatus() != EIS_Normal || img.getWidth() != w || img.getHeight() != h) return false;
+	const uint8_t* data = (const uint8_t*)img.getOutputData(8);
+	if (!data) return false;
+	memcpy(pixels.data(), data, count);
+	return true;
+}
+
+// Reads a DICOM SEG object into the mask
+// Frames are placed on the slice at their position along the slice normal, SEG objects leave out frames without any
+// segment so slices can stay empty. Frames of different segments on the same slice are merged, with bits = 8 every
+// pixel holds the number of the segment it belongs to.
+bool ReadSegmentation(const string& file, const SliceGrid& grid, unsigned int bits, uint8_t* mask) {
+	unsigned int w = grid.mWidth;
+	unsigned int h = grid.mHeight;
+	unsigned int d = grid.Depth();
+
+	DicomSlice src;
+	src.mFile = file;
+	if (!ReadDicomSlice(src)) return false;
+	if (src.mWidth != w || src.mHeight != h) {
+		printf("%s: %ux%u does not match %ux%u\n", file.c_str(), src.mWidth, src.mHeight, w, h);
+		return false;
+	}
+
+	DcmDataset* dataset = src.mFileFormat->getDataset();
+	Uint16 bitsAllocated = 0;
+	dataset->findAndGetUint16(DCM_BitsAllocated, bitsAllocated);
+	const Uint8* pixelData = nullptr;
+	unsigned long length = 0;
+	size_t frameBits = (size_t)w * h * bitsAllocated;
+	if ((bitsAllocated != 1 && bitsAllocated != 8) ||
+		dataset->findAndGetUint8Array(DCM_PixelData, pixelData, &length).bad() || length * 8 < frameBits * src.mFrameCount) {
+		printf("%s: unsupported segmentation pixel data\n", file.c_str());
+		return false;
+	}
+
+	vector<double> locations;
+	ReadFrameGeometry(src, locations);
+
+	// segment of every frame
+	vector<Uint16> segments(src.mFrameCount, 1);
+	DcmSequenceOfItems* perFrame = nullptr;
+	if (dataset->findAndGetSequence(DCM_PerFrameFunctionalGroupsSequence, perFrame).good())
+		for (unsigned int f = 0; f < src.mFrameCount && f < perFrame->card(); f++) {
+			DcmItem* id = nullptr;
+			if (perFrame->getItem(f)->findAndGetSequenceItem(DCM_SegmentIdentificationSequence, id, 0).good())
+				id->findAndGetUint16(DCM_ReferencedSegmentNumber, segments[f]);
+		}
+
+	// nearest slice within a quarter of the slice spacing
+	const vector<double>& positions = grid.mPositions;
+	double spacing = VolumeResampler::SliceSpacing(positions);
+	double tolerance = spacing > 0.0 ? .25 * spacing : .01;
+	vector<vector<unsigned int>> slices(d);
+	unsigned int skipped = 0;
+	for (unsigned int f = 0; f < src.mFrameCount; f++) {
+		size_t z = std::lower_bound(positions.begin(), positions.end(), locations[f]) - positions.begin();
+		if (z == d || (z > 0 && locations[f] - positions[z - 1] < positions[z] - locations[f])) z--;
+		if (fabs(positions[z] - locations[f]) > tolerance) {
+			skipped++;
+			continue;
+		}
+		slices[z].push_back(f);
+	}
+	if (skipped == src.mFrameCount) {
+		printf("%s: no frame lies on a slice of the volume\n", file.c_str());
+		return false;
+	}
+	if (skipped) printf("%s: %u frames don't lie on a slice of the volume, skipped them\n", file.c_str(), skipped);
+
+	size_t stride = bits == 1 ? (w + 7) / 8 : w;
+	ThreadPool::Shared().ParallelFor(0, d, [&](size_t z) {
+		vector<uint8_t> pixels((size_t)w * h);
+		for (unsigned int f : slices[z]) {
+			uint8_t value = (uint8_t)std::min<Uint16>(segments[f], 255);
+			if (bitsAllocated == 1) {
+				// frames are packed back to back and don't have to start on a byte
+				size_t offset = f * frameBits;
+				for (size_t i = 0; i < pixels.size(); i++) {
+					size_t b = offset + i;
+					if ((pixelData[b >> 3] >> (b & 7)) & 1) pixels[i] = value;
+				}
+			} else {
+				const Uint8* frame = pixelData + f * pixels.size();
+				for (size_t i = 0; i < pixels.size(); i++)
+					if (frame[i]) pixels[i] = value;
+			}
+		}
+		PackMaskSlice(pixels.data(), w, h, bits, mask + z * stride * h);
+	}, 4);
+	return true;
+}
+
+// GL-free part of LoadMask, texels receives the size of the R8UI texture mask is laid out for
+bool ReadMask(const string& path, const SliceGrid& grid, unsigned int bits, vector<uint8_t>& mask, uvec3& texels) {
+	auto start = chrono::high_resolution_clock::now();
+
+	unsigned int w = grid.mWidth;
+	unsigned int h = grid.mHeight;
+	unsigned int d = grid.Depth();
+	if (d == 0) {
+		printf("The volume has no slices to place a mask on\n");
+		return false;
+	}
+
+	bits = bits == 8 ? 8 : 1;
+	// a resampled volume gets the mask read on the slices with its labels, then moved onto the volume's grid
+	unsigned int readBits = grid.Resampled() ? 8 : bits;
+	size_t stride = readBits == 1 ? (w + 7) / 8 : w;
+	mask.assign(stride * h * d, 0);
+
+	error_code ec;
 	vector<string> files;
-	GetFiles(path, files);
+	if (fs::is_regular_file(path, ec))
+		files.push_back(path);
+	else if (fs::is_directory(path, ec))
+		GetFiles(path, files, { "dcm", "raw", "png" });
+	else {
+		printf("%s Does not exist!\n", path.c_str());
+		return false;
+	}
 
-	if (files.size() != texture->Depth()) {
-		printf("Incorrect slice count! (%u != %u)\n", (unsigned int)files.size(), texture->Depth());
-		return;
+	if (files.size() == 1 && GetExt(files[0]) == "dcm") {
+		if (!ReadSegmentation(files[0], grid, readBits, mask.data())) return false;
+	} else {
+		if (files.size() != d) {
+			printf("Incorrect slice count! (%u != %u)\n", (unsigned int)files.size(), d);
+			return false;
+		}
+
+		std::sort(files.data(), files.data() + files.size(), [](const string & a, const string & b) {
+			return atoi(GetName(a).c_str()) > atoi(GetName(b).c_str());
+		});
+
+		atomic<bool> failed(false);
+		ThreadPool::Shared().ParallelFor(0, d, [&](size_t z) {
+			vector<uint8_t> pixels;
+			if (!ReadMaskSlice(files[z], w, h, pixels)) {
+				printf("Failed to read mask slice %s\n", files[z].c_str());
+				failed = true;
+				return;
+			}
+			PackMaskSlice(pixels.data(), w, h, readBits, mask.data() + z * stride * h);
+		});
+		if (failed) return false;
 	}
 
-	std::sort(files.data(), files.data() + files.size(), [](const string & a, const string & b) {
-		return atoi(GetName(a).c_str()) > atoi(GetName(b).c_str());
-	});
+	if (grid.Resampled()) {
+		vector<uint8_t> labels = VolumeResampler::ResampleMask(mask.data(), grid);
+		w = grid.mResampledDimensions.x;
+		h = grid.mResampledDimensions.y;
+		d = grid.mResampledDimensions.z;
+		stride = bits == 1 ? (w + 7) / 8 : w;
+		mask.resize(stride * h * d);
+		ThreadPool::Shared().ParallelFor(0, d, [&](size_t z) {
+			PackMaskSlice(labels.data() + z * w * h, w, h, bits, mask.data() + z * stride * h);
+		}, 4);
+	}
+
+	double seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+	printf("read %ux%ux%u %u bit mask in %.2fs (%.1f MB)\n", w, h, d, bits, seconds, mask.size() / 1048576.0);
+
+	texels = uvec3((unsigned int)stride, h, d);
+	return true;
+}
 
-	for (unsigned int i = 0; i < files.size(); i++) {
-		// TODO: load into new texture and blit over
+shared_ptr<Texture> ImageLoader::LoadMask(const string& path, const SliceGrid& grid, unsigned int bits) {
+	vector<uint8_t> mask;
+	uvec3 texels;
+	if (!ReadMask(path, grid, bits, mask, texels)) return nullptr;
+	return shared_ptr<Texture>(new Texture(texels.x, texels.y, texels.z, GL_R8UI, GL_RED_INTEGER, GL_UNSIGNED_BYTE, GL_NEAREST, mask.data()));
+}
+
+struct MaskStream::Data {
+	vector<uint8_t> mMask;
+	uvec3 mTexels;
+	atomic<bool> mDone;
+	atomic<bool> mFailed;
+	Data() : mTexels(0), mDone(false), mFailed(false) {}
+};
+
+MaskStream::MaskStream(const shared_ptr<Data>& data, unsigned int bits) : mData(data), mTexture(nullptr), mBits(bits), mFailed(false) {}
+
+bool MaskStream::Update() {
+	if (!mData || !mData->mDone) return false;
+	if (mData->mFailed)
+		mFailed = true;
+	else {
+		uvec3 t = mData->mTexels;
+		mTexture = shared_ptr<::Texture>(new ::Texture(t.x, t.y, t.z, GL_R8UI, GL_RED_INTEGER, GL_UNSIGNED_BYTE, GL_NEAREST, mData->mMask.data()));
 	}
+	mData.reset();
+	return true;
+}
+
+shared_ptr<MaskStream> ImageLoader::StreamMask(const string& path, const SliceGrid& grid, unsigned int bits) {
+	bits = bits == 8 ? 8 : 1;
+	shared_ptr<MaskStream::Data> data(new MaskStream::Data());
+	ThreadPool::Shared().Enqueue([data, path, grid, bits]() {
+		data->mFailed = !ReadMask(path, grid, bits, data->mMask, data->mTexels);
+		data->mDone = true;
+	});
+	return shared_ptr<MaskStream>(new MaskStream(data, bits));
 }
\ No newline at end of file
@@ -5,17 +5,163 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "../Pipeline/Texture.hpp"
+#include "SliceGrid.hpp"
+#include "VolumePyramid.hpp"
+#include "VolumeStats.hpp"
 
 // Win32 LoadImage macro
 #ifdef LoadImage
 #undef LoadImage
 #endif
 
+// A volume loading in the background
+// Finding the series, reading the headers and decoding run on the loader threads. Update() has to be called on
+// the GL thread: it creates the texture once the dimensions are known and uploads the slabs of slices that have
+// finished decoding, within a time budget per call so the render loop keeps its frame rate. Once every slab is
+// uploaded the statistics and a VolumePyramid are computed on the loader threads, then Done() returns true.
+// Volumes too large for one texture skip the slab uploads and start at the finest pyramid level that fits.
+class VolumeStream {
+public:
+	struct Slabs;
+
+	// A volume that is already loaded
+	VolumeStream(const std::shared_ptr<::Texture>& texture, const glm::vec3& size, const VolumeStats& stats);
+	VolumeStream(const std::shared_ptr<Slabs>& slabs);
+	// Cancels the load if it is still running
+	~VolumeStream();
+
+	// nullptr until the headers are read, fills in while loading
+	inline std::shared_ptr<::Texture> Texture() const { return mTexture; }
+	inline glm::vec3 Size() const { return mSize; }
+	// Until Done() returns true the range spans the whole window the slices are converted with
+	inline const VolumeStats& Stats() const { return mStats; }
+	inline bool Done() const { return !mSlabs; }
+	// True if the load failed or was cancelled, only meaningful once Done() returns true
+	inline bool Failed() const { return mFailed; }
+
+	// Downsampled copies of the volume, nullptr until Done() returns true
+	inline std::shared_ptr<VolumePyramid> Pyramid() const { return mPyramid; }
+	// The slices the volume was made from, for ImageLoader::LoadMask, filled in once Done() returns true
+	inline const SliceGrid& Grid() const { return mGrid; }
+	// Pyramid level the texture holds, volumes that don't fit start at the finest one that does
+	inline unsigned int Level() const { return mLevel; }
+	// Replaces the texture with another pyramid level
+	void Level(unsigned int level);
+
+	// Fraction of the volume decoded and uploaded
+	float Progress() const;
+	// Stops decoding, Done() returns true and Failed() reports the cancellation after the next Update()
+	void Cancel();
+
+	// Uploads finished slabs for up to budget seconds (0 uploads everything), returns true if the texture changed
+	bool Update(double budget = 0.0);
+	// Slices [x, y) of the texture the last Update() wrote, empty if it wrote none
+	inline glm::uvec2 UploadedSlices() const { return mUploadedSlices; }
+
+private:
+	std::shared_ptr<::Texture> mTexture;
+	glm::vec3 mSize;
+	VolumeStats mStats;
+	std::shared_ptr<Slabs> mSlabs;
+	std::shared_ptr<VolumePyramid> mPyramid;
+	SliceGrid mGrid;
+	unsigned int mLevel;
+	bool mFailed;
+	glm::uvec2 mUploadedSlices;
+};
+
+// A mask decoding on the loader threads, see ImageLoader::StreamMask
+// Update() has to be called on the GL thread, it creates the texture once the mask is decoded.
+class MaskStream {
+public:
+	struct Data;
+
+	MaskStream(const std::shared_ptr<Data>& data, unsigned int bits);
+
+	// nullptr until Done() returns true, and if the mask couldn't be read
+	inline std::shared_ptr<::Texture> Texture() const { return mTexture; }
+	inline unsigned int Bits() const { return mBits; }
+	inline bool Done() const { return !mData; }
+	inline bool Failed() const { return mFailed; }
+
+	// Returns true once, when the mask is done
+	bool Update();
+
+private:
+	std::shared_ptr<Data> mData;
+	std::shared_ptr<::Texture> mTexture;
+	unsigned int mBits;
+	bool mFailed;
+};
+
+// A set of slices that can be loaded as one volume
+struct SeriesInfo {
+	std::string mFolder;
+	std::string mSeriesUID;
+	std::string mDescription;
+	std::string mModality;
+	glm::vec3 mRowDirection;
+	glm::vec3 mColumnDirection;
+	unsigned int mWidth;
+	unsigned int mHeight;
+	// slices in the series, frames of multi-frame objects count individually
+	unsigned int mSliceCount;
+	int mSeriesNumber;
+	// TemporalPositionIdentifier, phases of a cine series sharing one SeriesInstanceUID become separate series
+	int mTemporalPosition;
+	// TriggerTime in ms, negative if the series isn't gated
+	double mTriggerTime;
+	std::vector<std::string> mFiles;
+
+	SeriesInfo() : mWidth(0), mHeight(0), mSliceCount(0), mSeriesNumber(0), mTemporalPosition(0), mTriggerTime(-1.0) {}
+};
+
+// Stages of loading a DICOM volume, timed while ImageLoader::sProfile is set
+enum LoaderStage {
+	LOADER_SCAN,
+	LOADER_HEADERS,
+	LOADER_DECODE,
+	LOADER_INTERLEAVE,
+	LOADER_UPLOAD,
+	LOADER_STAGE_COUNT,
+};
+
 class ImageLoader {
 public:
+	// Registers the DCMTK decoders (and encoders) for compressed transfer syntaxes, only the first call does anything
+	static void RegisterCodecs();
+
 	static std::shared_ptr<Texture> LoadImage(const std::string& imagePath, glm::vec3& size);
+	// Loads a volume, blocking until every slice is decoded and uploaded
 	static std::shared_ptr<Texture> LoadVolume(const std::string& folder, glm::vec3& size);
-	static void LoadMask(const std::string& folder, const std::shared_ptr<Texture>& texture);
+	// Starts loading the largest series in a folder in the background, returns immediately
+	// Its cache is keyed on the paths, sizes and modification times of every file in the folder, so a cached folder
+	// opens without reading any DICOM headers.
+	static std::shared_ptr<VolumeStream> StreamVolume(const std::string& folder);
+	static std::shared_ptr<VolumeStream> StreamVolume(const SeriesInfo& series);
+	// Decodes a series into memory, on the calling thread and the loader pool without touching GL.
+	// The texels map to modality values through stats (only the mapping and range are set). Resampled like StreamVolume
+	// while VolumeResampler::sEnabled is set.
+	static bool DecodeVolume(const SeriesInfo& series, std::vector<uint16_t>& voxels, glm::uvec3& dimensions, glm::vec3& size, VolumeStats& stats);
+	// Walks a folder and its subfolders, grouping DICOM files by series, orientation and slice size.
+	// Only the identifying tags are read. Sorted by slice count, largest first.
+	static std::vector<SeriesInfo> ScanSeries(const std::string& folder);
+	// Loads a segmentation mask for the slices of a volume (VolumeStream::Grid), from a folder with one PNG, raw or
+	// DICOM file per slice or a DICOM SEG object. SEG frames are placed on the slice at their position, slices
+	// without a frame stay empty. Masks of resampled volumes are moved onto the same grid as the volume.
+	// bits = 1 packs 8 voxels along x into every byte (a sixteenth of the GL_R16 source), bits = 8 keeps segment numbers.
+	// Returns a GL_R8UI texture, (width + 7) / 8 texels wide when packed.
+	static std::shared_ptr<Texture> LoadMask(const std::string& path, const SliceGrid& grid, unsigned int bits = 1);
+	// LoadMask in the background, returns immediately
+	static std::shared_ptr<MaskStream> StreamMask(const std::string& path, const SliceGrid& grid, unsigned int bits = 1);
+
+	// Collects the time spent in every LoaderStage, for the benchmarks
+	// Stages that run on the pool are summed over its threads, so they can add up to more than the wall time.
+	static bool sProfile;
+	static void ResetProfile();
+	static double ProfileSeconds(LoaderStage stage);
+	static const char* StageName(LoaderStage stage);
 };
\ No newline at end of file
@@ -0,0 +1,58 @@
+#include "MappedFile.hpp"
+
+#ifdef WINDOWS
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#ifdef WINDOWS
+
+MappedFile::MappedFile(const string& path) : mData(nullptr), mSize(0), mFile(INVALID_HANDLE_VALUE), mMapping(nullptr) {
+	mFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (mFile == INVALID_HANDLE_VALUE) return;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(mFile, &size) || size.QuadPart == 0) return;
+
+	mMapping = CreateFileMappingA(mFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mMapping) return;
+
+	mData = (const uint8_t*)MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0);
+	if (mData) mSize = (size_t)size.QuadPart;
+}
+MappedFile::~MappedFile() {
+	if (mData) UnmapViewOfFile(mData);
+	if (mMapping) CloseHandle(mMapping);
+	if (mFile != INVALID_HANDLE_VALUE) CloseHandle(mFile);
+}
+
+#else
+
+MappedFile::MappedFile(const string& path) : mData(nullptr), mSize(0), mFile(-1) {
+	mFile = open(path.c_str(), O_RDONLY);
+	if (mFile < 0) return;
+
+	struct stat st;
+	if (fstat(mFile, &st) != 0 || st.st_size == 0) return;
+
+	void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, mFile, 0);
+	if (data == MAP_FAILED) return;
+
+	// slices are read front to back exactly once
+	madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+	mData = (const uint8_t*)data;
+	mSize = (size_t)st.st_size;
+}
+MappedFile::~MappedFile() {
+	if (mData) munmap((void*)mData, mSize);
+	if (mFile >= 0) close(mFile);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+	MappedFile(const std::string& path);
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	// nullptr if the file could not be mapped
+	inline const uint8_t* Data() const { return mData; }
+	inline size_t Size() const { return mSize; }
+
+private:
+	const uint8_t* mData;
+	size_t mSize;
+
+#ifdef WINDOWS
+	void* mFile;
+	void* mMapping;
+#else
+	int mFile;
+#endif
+};
\ No newline at end of file
@@ -25,7 +25,7 @@ void MemoryStream::WriteString(const string& str) {
 string MemoryStream::ReadString() {
 	uint32_t sz = Read<uint32_t>();
 	if (sz > 0) {
-		if (mCurrent + sz > mSize) throw std::exception("Read out of bounds!");
+		if (mCurrent + sz > mSize) throw std::runtime_error("Read out of bounds!");
 		string str(mBuffer + mCurrent, sz);
 		mCurrent += sz;
 		return str;
@@ -35,14 +35,14 @@ string MemoryStream::ReadString() {
 
 void MemoryStream::Write(const char* ptr, size_t sz) {
 	if (mCurrent + sz > mSize) {
-		if (!mExpand) throw std::exception("Write out of bounds!");
+		if (!mExpand) throw std::runtime_error("Write out of bounds!");
 		Fit(mCurrent + sz);
 	}
 	memcpy(mBuffer + mCurrent, ptr, sz);
 	mCurrent += sz;
 }
 void MemoryStream::Read(char* ptr, size_t sz) {
-	if (mCurrent + sz > mSize) throw std::exception("Read out of bounds!");
+	if (mCurrent + sz > mSize) throw std::runtime_error("Read out of bounds!");
 	memcpy(ptr, mBuffer + mCurrent, sz);
 	mCurrent += sz;
 }
@@ -100,7 +100,7 @@ void MemoryStream::Compress(MemoryStream &ms) {
 	ms.Write(reinterpret_cast<const char*>(temp_buffer), BUFSIZE - strm.avail_out);
 	deflateEnd(&strm);
 }
-void MemoryStream::Decompress(MemoryStream &ms, size_t len) {
+bool MemoryStream::Decompress(MemoryStream &ms, size_t len) {
 	z_stream zInfo = { 0 };
 	zInfo.next_in = (Bytef*)(mBuffer + mCurrent);
 	zInfo.total_in = zInfo.avail_in = (uInt)len;
@@ -109,10 +109,11 @@ void MemoryStream::Decompress(MemoryStream &ms, size_t len) {
 
 	int nErr = -1;
 	nErr = inflateInit(&zInfo);
-	assert(nErr == Z_OK);
+	if (nErr != Z_OK) return false;
 
 	nErr = inflate(&zInfo, Z_FINISH);
-	assert(nErr == Z_STREAM_END);
+	bool complete = nErr == Z_STREAM_END && zInfo.avail_out == 0;
 
 	inflateEnd(&zInfo);
+	return complete;
 }
\ No newline at end of file
@@ -1,7 +1,8 @@
 #pragma once
 
 #include <memory>
-#include <exception>
+#include <cstring>
+#include <stdexcept>
 #include <string>
 
 class MemoryStream {
@@ -13,7 +14,7 @@ public:
 	template<typename T>
 	inline void Write(T t) {
 		if (mCurrent + sizeof(T) > mSize) {
-			if (!mExpand) throw new std::exception("Out of memory!");
+			if (!mExpand) throw new std::runtime_error("Out of memory!");
 			Fit(mCurrent + sizeof(T));
 		}
 		memcpy(mBuffer + mCurrent, reinterpret_cast<char*>(&t), sizeof(T));
@@ -22,7 +23,7 @@ public:
 
 	template<typename T>
 	inline T Read() {
-		if (mCurrent + sizeof(T) > mSize) throw new std::exception("Not enough room to read T!");
+		if (mCurrent + sizeof(T) > mSize) throw new std::runtime_error("Not enough room to read T!");
 		T v(*reinterpret_cast<T*>(mBuffer + mCurrent));
 		mCurrent += sizeof(T);
 		return v;
@@ -35,14 +36,15 @@ public:
 	std::string ReadString();
 
 	void Fit(size_t s);
-	void Seek(size_t p) { if (p >= mSize || p < 0) throw new std::exception("Invalid seek pos."); mCurrent = p; }
+	void Seek(size_t p) { if (p >= mSize || p < 0) throw new std::runtime_error("Invalid seek pos."); mCurrent = p; }
 	size_t Tell() const { return mCurrent; }
 	char* Ptr() const { return mBuffer; }
 	
 	// Compress from 0 to current
 	void Compress(MemoryStream &ms);
 	// Decompress from current to current + len
-	void Decompress(MemoryStream &ms, size_t len);
+	// Returns false if the data is corrupt or doesn't exactly fill ms from its current position
+	bool Decompress(MemoryStream &ms, size_t len);
 
 private:
 	bool mExpand = false;
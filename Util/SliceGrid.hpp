@@ -0,0 +1,25 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+// Where the slices of a series were acquired
+// Masks are drawn on these slices, so the grid travels with the volume (and its cache) to place them.
+struct SliceGrid {
+	unsigned int mWidth;
+	unsigned int mHeight;
+	// pixel spacing in mm
+	double mSpacingX;
+	double mSpacingY;
+	// position of every slice along the slice normal in mm, ascending, empty if the volume has no slices (cine, bricks)
+	std::vector<double> mPositions;
+	// grid VolumeResampler put the volume on (its voxel size in mm), 0 if the volume keeps the slices
+	glm::uvec3 mResampledDimensions;
+	glm::dvec3 mResampledSpacing;
+
+	SliceGrid() : mWidth(0), mHeight(0), mSpacingX(1.0), mSpacingY(1.0), mResampledDimensions(0), mResampledSpacing(0.0) {}
+
+	inline unsigned int Depth() const { return (unsigned int)mPositions.size(); }
+	inline bool Resampled() const { return mResampledDimensions.x > 0; }
+};
\ No newline at end of file
@@ -0,0 +1,137 @@
+#include "SliceKernels.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SLICE_KERNELS_SSE2
+#include <emmintrin.h>
+#endif
+
+// AVX2 is compiled per function and only called when the CPU reports it
+#if defined(SLICE_KERNELS_SSE2) && (defined(_MSC_VER) || defined(__GNUC__))
+#define SLICE_KERNELS_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AVX2_FUNCTION
+#else
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#endif
+#endif
+
+using namespace std;
+
+SliceKernelIsa SupportedIsa() {
+#ifdef SLICE_KERNELS_AVX2
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] >= 7) {
+		__cpuidex(info, 7, 0);
+		bool avx2 = (info[1] & (1 << 5)) != 0;
+		__cpuid(info, 1);
+		// the OS has to save the ymm registers too
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		if (avx2 && osxsave && (_xgetbv(0) & 6) == 6) return SLICE_KERNEL_AVX2;
+	}
+#else
+	if (__builtin_cpu_supports("avx2")) return SLICE_KERNEL_AVX2;
+#endif
+#endif
+#ifdef SLICE_KERNELS_SSE2
+	return SLICE_KERNEL_SSE2;
+#else
+	return SLICE_KERNEL_SCALAR;
+#endif
+}
+
+SliceKernelIsa gSupportedIsa = SupportedIsa();
+SliceKernelIsa gSliceKernelIsa = gSupportedIsa;
+
+SliceKernelIsa GetSliceKernelIsa() { return gSliceKernelIsa; }
+void SetSliceKernelIsa(SliceKernelIsa isa) { gSliceKernelIsa = std::min(isa, gSupportedIsa); }
+const char* SliceKernelIsaName(SliceKernelIsa isa) {
+	switch (isa) {
+	case SLICE_KERNEL_AVX2: return "avx2";
+	case SLICE_KERNEL_SSE2: return "sse2";
+	default: return "scalar";
+	}
+}
+
+inline int32_t LoadSample(uint16_t s, unsigned int shift, bool isSigned) {
+	s <<= shift;
+	return isSigned ? (int32_t)((int16_t)s >> shift) : (int32_t)(s >> shift);
+}
+// rounds halves up like the SIMD conversions, lrint is a library call on some compilers
+inline uint16_t StoreSample(float v) {
+	return (uint16_t)(std::min(std::max(v, 0.f), 65535.f) + .5f);
+}
+
+#ifdef SLICE_KERNELS_SSE2
+// masks 8 samples to bitsStored and sign extends them
+inline __m128i LoadSamples(const uint16_t* src, __m128i shift, bool isSigned) {
+	__m128i v = _mm_sll_epi16(_mm_loadu_si128((const __m128i*)src), shift);
+	return isSigned ? _mm_sra_epi16(v, shift) : _mm_srl_epi16(v, shift);
+}
+inline __m128i RescaleSamples4(__m128i v, __m128 scale, __m128 bias) {
+	__m128 f = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(v), scale), bias);
+	f = _mm_min_ps(_mm_max_ps(f, _mm_setzero_ps()), _mm_set1_ps(65535.f));
+	// shift into the signed range so the saturating pack keeps the full 16 bits
+	return _mm_sub_epi32(_mm_cvttps_epi32(_mm_add_ps(f, _mm_set1_ps(.5f))), _mm_set1_epi32(32768));
+}
+#endif
+
+#ifdef SLICE_KERNELS_AVX2
+// 8 samples per step in 8 wide floats, returns the number of samples converted
+AVX2_FUNCTION size_t RescaleSamplesAVX2(const uint16_t* src, size_t count, unsigned int shift, bool isSigned, float scale, float bias, uint16_t* dst) {
+	__m128i sh = _mm_cvtsi32_si128((int)shift);
+	__m256 vscale = _mm256_set1_ps(scale);
+	__m256 vbias = _mm256_set1_ps(bias);
+	__m256 vmax = _mm256_set1_ps(65535.f);
+
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i v = _mm_sll_epi16(_mm_loadu_si128((const __m128i*)(src + i)), sh);
+		__m256i v32 = isSigned ? _mm256_cvtepi16_epi32(_mm_sra_epi16(v, sh)) : _mm256_cvtepu16_epi32(_mm_srl_epi16(v, sh));
+
+		__m256 f = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(v32), vscale), vbias);
+		f = _mm256_min_ps(_mm256_max_ps(f, _mm256_setzero_ps()), vmax);
+		__m256i r32 = _mm256_cvttps_epi32(_mm256_add_ps(f, _mm256_set1_ps(.5f)));
+
+		// packus works per 128 bit lane, gather both lanes into the low half
+		__m256i r16 = _mm256_permute4x64_epi64(_mm256_packus_epi32(r32, r32), 0x08);
+		_mm_storeu_si128((__m128i*)(dst + i), _mm256_castsi256_si128(r16));
+	}
+	return i;
+}
+#endif
+
+void RescaleSamples(const uint16_t* src, size_t count, unsigned int bitsStored, bool isSigned, float scale, float bias, uint16_t* dst) {
+	unsigned int shift = 16 - std::min(std::max(bitsStored, 1u), 16u);
+	size_t i = 0;
+
+#ifdef SLICE_KERNELS_AVX2
+	if (gSliceKernelIsa >= SLICE_KERNEL_AVX2)
+		i = RescaleSamplesAVX2(src, count, shift, isSigned, scale, bias, dst);
+#endif
+#ifdef SLICE_KERNELS_SSE2
+	if (gSliceKernelIsa >= SLICE_KERNEL_SSE2) {
+		__m128i sh = _mm_cvtsi32_si128((int)shift);
+		__m128 vscale = _mm_set1_ps(scale);
+		__m128 vbias = _mm_set1_ps(bias);
+		__m128i flip = _mm_set1_epi16((short)0x8000);
+		for (; i + 8 <= count; i += 8) {
+			__m128i v = LoadSamples(src + i, sh, isSigned);
+			__m128i lo = isSigned ? _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16) : _mm_unpacklo_epi16(v, _mm_setzero_si128());
+			__m128i hi = isSigned ? _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16) : _mm_unpackhi_epi16(v, _mm_setzero_si128());
+
+			__m128i r = _mm_packs_epi32(RescaleSamples4(lo, vscale, vbias), RescaleSamples4(hi, vscale, vbias));
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(r, flip));
+		}
+	}
+#endif
+
+	for (; i < count; i++)
+		dst[i] = StoreSample(LoadSample(src[i], shift, isSigned) * scale + bias);
+}
\ No newline at end of file
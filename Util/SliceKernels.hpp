@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// Kernels that turn uncompressed 16 bit DICOM samples into texture data
+// Samples are masked to bitsStored bits and sign extended when isSigned is set (PixelRepresentation = 1).
+// The widest instruction set the CPU supports is picked at runtime.
+
+enum SliceKernelIsa {
+	SLICE_KERNEL_SCALAR,
+	SLICE_KERNEL_SSE2,
+	SLICE_KERNEL_AVX2,
+};
+
+// Instruction set the kernels currently use
+SliceKernelIsa GetSliceKernelIsa();
+// Forces a narrower instruction set (for benchmarks), requests wider than the CPU supports are clamped
+void SetSliceKernelIsa(SliceKernelIsa isa);
+const char* SliceKernelIsaName(SliceKernelIsa isa);
+
+// dst[i] = clamp(src[i] * scale + bias, 0, 65535)
+void RescaleSamples(const uint16_t* src, size_t count, unsigned int bitsStored, bool isSigned, float scale, float bias, uint16_t* dst);
\ No newline at end of file
@@ -0,0 +1,166 @@
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+// index of the worker running on this thread, or -1 for threads that don't belong to a pool
+thread_local int tWorkerIndex = -1;
+thread_local ThreadPool* tWorkerPool = nullptr;
+
+ThreadPool::ThreadPool(unsigned int threadCount) : mQueued(0), mNext(0), mStop(false) {
+	if (threadCount == 0) threadCount = std::max(1u, thread::hardware_concurrency());
+
+	for (unsigned int i = 0; i < threadCount; i++)
+		mQueues.push_back(unique_ptr<Queue>(new Queue()));
+	for (unsigned int i = 0; i < threadCount; i++)
+		mThreads.push_back(thread(&ThreadPool::WorkerMain, this, i));
+}
+ThreadPool::~ThreadPool() {
+	{
+		lock_guard<mutex> lock(mMutex);
+		mStop = true;
+	}
+	mCondition.notify_all();
+	for (auto& t : mThreads)
+		t.join();
+}
+
+ThreadPool& ThreadPool::Shared() {
+	static ThreadPool pool;
+	return pool;
+}
+
+void ThreadPool::Enqueue(function<void()> task) {
+	// tasks spawned from a worker stay local to that worker, others are spread round-robin
+	unsigned int q;
+	if (tWorkerPool == this && tWorkerIndex >= 0)
+		q = (unsigned int)tWorkerIndex;
+	else
+		q = mNext++ % (unsigned int)mQueues.size();
+
+	{
+		lock_guard<mutex> lock(mQueues[q]->mMutex);
+		mQueues[q]->mTasks.push_back(move(task));
+	}
+	{
+		lock_guard<mutex> lock(mMutex);
+		mQueued++;
+	}
+	mCondition.notify_one();
+}
+
+bool ThreadPool::Pop(unsigned int index, function<void()>& task) {
+	if (mQueued == 0) return false;
+
+	unsigned int n = (unsigned int)mQueues.size();
+
+	// newest task from our own queue
+	{
+		Queue& q = *mQueues[index];
+		lock_guard<mutex> lock(q.mMutex);
+		if (!q.mTasks.empty()) {
+			task = move(q.mTasks.back());
+			q.mTasks.pop_back();
+			mQueued--;
+			return true;
+		}
+	}
+
+	// steal the oldest task from someone else
+	for (unsigned int i = 1; i < n; i++) {
+		Queue& q = *mQueues[(index + i) % n];
+		lock_guard<mutex> lock(q.mMutex);
+		if (!q.mTasks.empty()) {
+			task = move(q.mTasks.front());
+			q.mTasks.pop_front();
+			mQueued--;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool ThreadPool::RunPendingTask() {
+	unsigned int index = (tWorkerPool == this && tWorkerIndex >= 0) ? (unsigned int)tWorkerIndex : 0;
+
+	function<void()> task;
+	if (!Pop(index, task)) return false;
+	task();
+	return true;
+}
+
+void ThreadPool::ParallelFor(size_t begin, size_t end, const function<void(size_t)>& func, size_t grain) {
+	if (end <= begin) return;
+	grain = std::max<size_t>(grain, 1);
+
+	// chunks are claimed from a counter, helpers that start after the last chunk was claimed return without touching func
+	struct Job {
+		atomic<size_t> mNext;
+		atomic<size_t> mRemaining;
+		atomic<bool> mFailed;
+		exception_ptr mException;
+		mutex mMutex;
+		condition_variable mDone;
+	};
+	size_t chunks = (end - begin + grain - 1) / grain;
+	shared_ptr<Job> job(new Job());
+	job->mNext = 0;
+	job->mRemaining = chunks;
+	job->mFailed = false;
+
+	auto run = [job, chunks, begin, end, grain, &func]() {
+		size_t c;
+		while ((c = job->mNext++) < chunks) {
+			// after a throw the remaining chunks are only counted down
+			if (!job->mFailed) {
+				try {
+					size_t s = begin + c * grain;
+					size_t e = std::min(end, s + grain);
+					for (size_t i = s; i < e; i++)
+						func(i);
+				} catch (...) {
+					lock_guard<mutex> lock(job->mMutex);
+					if (!job->mFailed) job->mException = current_exception();
+					job->mFailed = true;
+				}
+			}
+			if (--job->mRemaining == 0) {
+				lock_guard<mutex> lock(job->mMutex);
+				job->mDone.notify_all();
+			}
+		}
+	};
+
+	size_t helpers = std::min<size_t>(chunks - 1, mThreads.size());
+	for (size_t h = 0; h < helpers; h++)
+		Enqueue(run);
+
+	// the caller works through chunks of this loop only, never unrelated tasks, and since it can run every chunk itself
+	// nested calls can't deadlock
+	run();
+	{
+		unique_lock<mutex> lock(job->mMutex);
+		job->mDone.wait(lock, [&]() { return job->mRemaining == 0; });
+	}
+
+	if (job->mException) rethrow_exception(job->mException);
+}
+
+void ThreadPool::WorkerMain(unsigned int index) {
+	tWorkerIndex = (int)index;
+	tWorkerPool = this;
+
+	while (true) {
+		function<void()> task;
+		if (Pop(index, task)) {
+			task();
+			continue;
+		}
+
+		unique_lock<mutex> lock(mMutex);
+		mCondition.wait(lock, [&]() { return mStop || mQueued > 0; });
+		if (mStop && mQueued == 0) return;
+	}
+}
\ No newline at end of file
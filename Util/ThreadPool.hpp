@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool
+// Every worker owns a deque. Workers pop their own newest task first and steal the oldest task from
+// other workers when they run dry, so uneven tasks (slow network files, compressed slices) balance out.
+class ThreadPool {
+public:
+	// threadCount = 0 uses std::thread::hardware_concurrency()
+	ThreadPool(unsigned int threadCount = 0);
+	~ThreadPool();
+
+	inline unsigned int ThreadCount() const { return (unsigned int)mThreads.size(); }
+
+	void Enqueue(std::function<void()> task);
+
+	// Calls func(i) for every i in [begin, end) and blocks until all calls have returned.
+	// The calling thread runs chunks of this loop while it waits, so this can be nested inside other pool tasks. The
+	// first exception thrown by func is rethrown here once every chunk has finished or been skipped.
+	void ParallelFor(size_t begin, size_t end, const std::function<void(size_t)>& func, size_t grain = 1);
+
+	// Runs one queued task on the calling thread, returns false if there was nothing to run
+	bool RunPendingTask();
+
+	// Pool shared by the loaders and other CPU-side work
+	static ThreadPool& Shared();
+
+private:
+	struct Queue {
+		std::mutex mMutex;
+		std::deque<std::function<void()>> mTasks;
+	};
+
+	std::vector<std::unique_ptr<Queue>> mQueues;
+	std::vector<std::thread> mThreads;
+
+	std::mutex mMutex;
+	std::condition_variable mCondition;
+	std::atomic<size_t> mQueued;
+	std::atomic<unsigned int> mNext;
+	bool mStop;
+
+	bool Pop(unsigned int index, std::function<void()>& task);
+	void WorkerMain(unsigned int index);
+};
\ No newline at end of file
@@ -0,0 +1,60 @@
+#include "TransferFunction.hpp"
+
+#include <cmath>
+
+#include "ThreadPool.hpp"
+
+using namespace std;
+using namespace glm;
+
+// steps of the running integrals the pre-integrated table is read from
+#define PREINTEGRATION_STEPS 4096
+
+vector<vec4> TransferFunction::Table(unsigned int size) const {
+	vector<vec4> table(size);
+	for (unsigned int i = 0; i < size; i++) {
+		table[i] = Evaluate(size > 1 ? (float)i / (size - 1) : 0.f);
+		// the raymarcher composites a as the opacity of a sample, the density can push it past 1
+		table[i].w = std::min(table[i].w, 1.f);
+	}
+	return table;
+}
+
+vector<vec4> TransferFunction::Preintegrate(unsigned int size, ThreadPool& pool) const {
+	// colour weighted by the extinction coefficient, and the coefficient
+	auto weighted = [&](float s) {
+		vec4 c = Evaluate(s);
+		float sigma = -logf(1.f - std::min(c.w, .999f));
+		return vec4(vec3(c) * sigma, sigma);
+	};
+
+	// running integrals over intensity, trapezoids
+	vector<vec4> integral(PREINTEGRATION_STEPS + 1);
+	integral[0] = vec4(0.f);
+	vec4 prev = weighted(0.f);
+	for (unsigned int i = 1; i <= PREINTEGRATION_STEPS; i++) {
+		vec4 cur = weighted((float)i / PREINTEGRATION_STEPS);
+		integral[i] = integral[i - 1] + (prev + cur) * (.5f / PREINTEGRATION_STEPS);
+		prev = cur;
+	}
+	auto at = [&](float s) {
+		float x = s * PREINTEGRATION_STEPS;
+		unsigned int i = std::min((unsigned int)x, (unsigned int)PREINTEGRATION_STEPS - 1);
+		return integral[i] + (integral[i + 1] - integral[i]) * (x - i);
+	};
+
+	vector<vec4> table((size_t)size * size);
+	float scale = size > 1 ? 1.f / (size - 1) : 0.f;
+	pool.ParallelFor(0, size, [&](size_t b) {
+		float sb = b * scale;
+		for (unsigned int f = 0; f < size; f++) {
+			float sf = f * scale;
+			// too close together to tell the integrals apart, the segment is as good as constant
+			if (fabsf(sb - sf) * PREINTEGRATION_STEPS < 1.f)
+				table[f + b * size] = weighted((sf + sb) * .5f);
+			else
+				table[f + b * size] = (at(sb) - at(sf)) / (sb - sf);
+		}
+	}, 16);
+	return table;
+}
\ No newline at end of file
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <vector>
+
+class ThreadPool;
+
+// Maps the windowed intensity of a voxel, in [0, 1], to its colour and extinction
+// Applied while raymarching from a table, so changing it doesn't need a new bake. The lighting bake still integrates
+// the extinction along its shadow rays and catches up over the next frames.
+struct TransferFunction {
+	float mThreshold;
+	float mDensity;
+	float mExposure;
+
+	TransferFunction() : mThreshold(.2f), mDensity(.5f), mExposure(1.5f) {}
+
+	// rgb is the colour before lighting, a the extinction
+	inline glm::vec4 Evaluate(float s) const {
+		// subtractive for soft edges
+		float a = std::max(0.f, (s - mThreshold) / (1.f - mThreshold)) * mDensity;
+		return glm::vec4(glm::vec3(s * mExposure), a);
+	}
+	inline float Extinction(float s) const { return Evaluate(s).w; }
+
+	// size entries from intensity 0 to 1, entry i at i / (size - 1), with a clamped to an opacity of at most 1
+	std::vector<glm::vec4> Table(unsigned int size) const;
+
+	// Pre-integrated table, size x size entries for segments between a front (x) and a back (y) intensity
+	// Evaluate's extinction is taken as the opacity of a segment of length 1, rgb is the average of the colour weighted by
+	// -ln(1 - opacity) along the segment and a the average of -ln(1 - opacity). Neither depends on the segment length,
+	// a segment of length d gets opacity 1 - exp(-a * d) and colour rgb / a. Rows are built on the pool.
+	std::vector<glm::vec4> Preintegrate(unsigned int size, ThreadPool& pool) const;
+};
\ No newline at end of file
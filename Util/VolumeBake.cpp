@@ -0,0 +1,456 @@
+#include "VolumeBake.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "SliceKernels.hpp"
+#include "ThreadPool.hpp"
+
+// same instruction sets as SliceKernels.cpp
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SLICE_KERNELS_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(SLICE_KERNELS_SSE2) && (defined(_MSC_VER) || defined(__GNUC__))
+#define SLICE_KERNELS_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#define AVX2_FUNCTION
+#else
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#endif
+#endif
+
+using namespace std;
+using namespace glm;
+
+// ldt and ls in volume.glsl
+#define LIGHT_STEP .002f
+#define LIGHT_SAMPLES 10
+
+// Everything one bake needs, derived from the parameters once
+struct BakeContext {
+	const uint16_t* mVolume;
+	const uint8_t* mMask;
+	unsigned int mMaskBits;
+	size_t mMaskStride;
+	// voxels and mask bytes fit 32 bit offsets, so the AVX2 version can fetch shadow rays with gathers
+	bool mGather;
+	int mWidth;
+	int mHeight;
+	int mDepth;
+	VolumeBakeParams mParams;
+	vec3 mTexelSize;
+	// light position in voxels for point and spot lights, the step along a shadow ray in voxels for directional ones
+	vec3 mLightVoxel;
+	vec3 mLightStep;
+};
+
+// imageLoad returns 0 outside the image
+inline float Texel(const BakeContext& c, int x, int y, int z) {
+	if (x < 0 || y < 0 || z < 0 || x >= c.mWidth || y >= c.mHeight || z >= c.mDepth) return 0.f;
+	return c.mVolume[x + (size_t)c.mWidth * (y + (size_t)c.mHeight * z)] * (1.f / 65535.f);
+}
+inline float InMask(const BakeContext& c, int x, int y, int z) {
+	if (!c.mMask) return 1.f;
+	if (x < 0 || y < 0 || z < 0 || x >= c.mWidth || y >= c.mHeight || z >= c.mDepth) return 0.f;
+	const uint8_t* row = c.mMask + ((size_t)z * c.mHeight + y) * c.mMaskStride;
+	bool m = c.mMaskBits == 1 ? ((row[x >> 3] >> (x & 7)) & 1) != 0 : row[x] != 0;
+	return m ? 1.f : 0.f;
+}
+
+// Intensity() in volume.glsl, split into the window and the mask
+inline float Normalize(const BakeContext& c, float t) {
+	const VolumeBakeParams& b = c.mParams;
+	return std::min(std::max((t - b.mWindowMin) / std::max(b.mWindowMax - b.mWindowMin, 1e-6f), 0.f), 1.f);
+}
+inline float Extinction(const BakeContext& c, float n, float inMask) {
+	return c.mParams.mTransfer.Extinction(n * inMask);
+}
+inline float Extinction(const BakeContext& c, int x, int y, int z) {
+	return Extinction(c, Normalize(c, Texel(c, x, y, z)), InMask(c, x, y, z));
+}
+
+// Light() in volume.glsl for the voxel at p
+float LightScalar(const BakeContext& c, const vec3& p) {
+	const VolumeBakeParams& b = c.mParams;
+	float ld = 0.f;
+	switch (b.mLight) {
+	case BAKE_LIGHT_DIRECTIONAL:
+		for (int i = 1; i < LIGHT_SAMPLES; i++) {
+			vec3 q = p + c.mLightStep * (float)i;
+			ld += Extinction(c, (int)q.x, (int)q.y, (int)q.z);
+		}
+		return expf(ld * (-b.mLightDensity * LIGHT_STEP)) * b.mLightIntensity + b.mLightAmbient;
+
+	case BAKE_LIGHT_POINT:
+	case BAKE_LIGHT_SPOT: {
+		// same order of operations as the SIMD versions
+		vec3 ldir = (p * c.mTexelSize - .5f) * b.mWorldScale - b.mLightPosition;
+		float dist = length(ldir);
+		for (int i = 1; i <= LIGHT_SAMPLES; i++) {
+			float t = (float)i / (float)LIGHT_SAMPLES;
+			vec3 q = p * (1.f - t) + c.mLightVoxel * t;
+			ld += Extinction(c, (int)q.x, (int)q.y, (int)q.z);
+		}
+		float att = dist * 75.f + 1.f;
+		att = b.mLightIntensity / (att * att);
+		if (b.mLight == BAKE_LIGHT_SPOT)
+			att *= std::min(std::max((std::max(0.f, -dot(ldir, b.mLightDirection) / dist) - b.mLightAngle) * 10.f, 0.f), 1.f);
+		return expf(ld * (-b.mLightDensity * LIGHT_STEP)) * att + b.mLightAmbient;
+	}
+
+	default:
+		return 1.f;
+	}
+}
+
+// the light isn't limited to [0, 1], l / (1 + l) keeps its range
+inline float EncodeLight(float l) {
+	return l / (1.f + l);
+}
+inline uint16_t Unorm16(float v) {
+	return (uint16_t)(std::min(std::max(v, 0.f), 1.f) * 65535.f + .5f);
+}
+
+void BakeVoxelScalar(const BakeContext& c, int x, int y, int z, uint16_t* dst) {
+	// the window is applied while raymarching, so windowing doesn't need a new bake
+	float g = Texel(c, x, y, z) * InMask(c, x, y, z);
+	dst[0] = Unorm16(EncodeLight(LightScalar(c, vec3((float)x, (float)y, (float)z))));
+	dst[1] = Unorm16(g);
+}
+
+void BakeRowScalar(const BakeContext& c, int y, int z, int x, uint16_t* dst) {
+	for (; x < c.mWidth; x++)
+		BakeVoxelScalar(c, x, y, z, dst + 2 * (size_t)x);
+}
+
+// Extinction of n voxels at arbitrary positions, one at a time where there are no gathers
+inline void GatherExtinction(const BakeContext& c, const int* x, const int* y, const int* z, float* texel, float* inMask, int n) {
+	for (int k = 0; k < n; k++) {
+		texel[k] = Texel(c, x[k], y[k], z[k]);
+		inMask[k] = InMask(c, x[k], y[k], z[k]);
+	}
+}
+
+#ifdef SLICE_KERNELS_SSE2
+inline __m128 Normalize4(const BakeContext& c, __m128 t) {
+	const VolumeBakeParams& b = c.mParams;
+	__m128 n = _mm_div_ps(_mm_sub_ps(t, _mm_set1_ps(b.mWindowMin)), _mm_set1_ps(std::max(b.mWindowMax - b.mWindowMin, 1e-6f)));
+	return _mm_min_ps(_mm_max_ps(n, _mm_setzero_ps()), _mm_set1_ps(1.f));
+}
+inline __m128 Extinction4(const BakeContext& c, __m128 n, __m128 inMask) {
+	const VolumeBakeParams& b = c.mParams;
+	__m128 g = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(n, inMask), _mm_set1_ps(b.mTransfer.mThreshold)), _mm_set1_ps(1.f - b.mTransfer.mThreshold));
+	return _mm_mul_ps(_mm_max_ps(g, _mm_setzero_ps()), _mm_set1_ps(b.mTransfer.mDensity));
+}
+// expf of 4 lanes, Cephes' polynomial. Within 2 ulp of expf, which the 16 bit light doesn't resolve.
+inline __m128 Exp4(__m128 x) {
+	x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-87.3f)), _mm_set1_ps(88.3f));
+	// x = n ln 2 + r, floor without SSE4.1
+	__m128 fx = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504f)), _mm_set1_ps(.5f));
+	__m128 n = _mm_cvtepi32_ps(_mm_cvttps_epi32(fx));
+	n = _mm_sub_ps(n, _mm_and_ps(_mm_cmpgt_ps(n, fx), _mm_set1_ps(1.f)));
+	x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(.693359375f)));
+	x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(-2.12194440e-4f)));
+
+	__m128 y = _mm_set1_ps(1.9875691500e-4f);
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.3981999507e-3f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(8.3334519073e-3f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(4.1665795894e-2f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.6666665459e-1f));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(5.0000001201e-1f));
+	y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(y, _mm_mul_ps(x, x)), x), _mm_set1_ps(1.f));
+
+	// 2^n straight into the exponent bits
+	__m128i e = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(n), _mm_set1_epi32(127)), 23);
+	return _mm_mul_ps(y, _mm_castsi128_ps(e));
+}
+
+// SSE2 has no gather, the voxels are fetched one at a time
+inline __m128 GatherExtinction4(const BakeContext& c, __m128 x, __m128 y, __m128 z) {
+	alignas(16) int qx[4], qy[4], qz[4];
+	alignas(16) float texel[4], inMask[4];
+	// truncates towards zero like ivec3()
+	_mm_store_si128((__m128i*)qx, _mm_cvttps_epi32(x));
+	_mm_store_si128((__m128i*)qy, _mm_cvttps_epi32(y));
+	_mm_store_si128((__m128i*)qz, _mm_cvttps_epi32(z));
+	GatherExtinction(c, qx, qy, qz, texel, inMask, 4);
+	return Extinction4(c, Normalize4(c, _mm_load_ps(texel)), _mm_load_ps(inMask));
+}
+
+__m128 Light4(const BakeContext& c, __m128 px, __m128 py, __m128 pz) {
+	const VolumeBakeParams& b = c.mParams;
+	__m128 ld = _mm_setzero_ps();
+
+	switch (b.mLight) {
+	case BAKE_LIGHT_DIRECTIONAL:
+		for (int i = 1; i < LIGHT_SAMPLES; i++) {
+			vec3 s = c.mLightStep * (float)i;
+			ld = _mm_add_ps(ld, GatherExtinction4(c, _mm_add_ps(px, _mm_set1_ps(s.x)), _mm_add_ps(py, _mm_set1_ps(s.y)), _mm_add_ps(pz, _mm_set1_ps(s.z))));
+		}
+		ld = Exp4(_mm_mul_ps(ld, _mm_set1_ps(-b.mLightDensity * LIGHT_STEP)));
+		return _mm_add_ps(_mm_mul_ps(ld, _mm_set1_ps(b.mLightIntensity)), _mm_set1_ps(b.mLightAmbient));
+
+	case BAKE_LIGHT_POINT:
+	case BAKE_LIGHT_SPOT: {
+		__m128 dx = _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(_mm_mul_ps(px, _mm_set1_ps(c.mTexelSize.x)), _mm_set1_ps(.5f)), _mm_set1_ps(b.mWorldScale.x)), _mm_set1_ps(b.mLightPosition.x));
+		__m128 dy = _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(_mm_mul_ps(py, _mm_set1_ps(c.mTexelSize.y)), _mm_set1_ps(.5f)), _mm_set1_ps(b.mWorldScale.y)), _mm_set1_ps(b.mLightPosition.y));
+		__m128 dz = _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(_mm_mul_ps(pz, _mm_set1_ps(c.mTexelSize.z)), _mm_set1_ps(.5f)), _mm_set1_ps(b.mWorldScale.z)), _mm_set1_ps(b.mLightPosition.z));
+		__m128 dist = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+
+		for (int i = 1; i <= LIGHT_SAMPLES; i++) {
+			float t = (float)i / (float)LIGHT_SAMPLES;
+			__m128 it = _mm_set1_ps(1.f - t);
+			__m128 qx = _mm_add_ps(_mm_mul_ps(px, it), _mm_set1_ps(c.mLightVoxel.x * t));
+			__m128 qy = _mm_add_ps(_mm_mul_ps(py, it), _mm_set1_ps(c.mLightVoxel.y * t));
+			__m128 qz = _mm_add_ps(_mm_mul_ps(pz, it), _mm_set1_ps(c.mLightVoxel.z * t));
+			ld = _mm_add_ps(ld, GatherExtinction4(c, qx, qy, qz));
+		}
+
+		__m128 att = _mm_add_ps(_mm_mul_ps(dist, _mm_set1_ps(75.f)), _mm_set1_ps(1.f));
+		att = _mm_div_ps(_mm_set1_ps(b.mLightIntensity), _mm_mul_ps(att, att));
+		if (b.mLight == BAKE_LIGHT_SPOT) {
+			// -dot(LightDirection, ldir / dist)
+			__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, _mm_set1_ps(b.mLightDirection.x)), _mm_mul_ps(dy, _mm_set1_ps(b.mLightDirection.y))), _mm_mul_ps(dz, _mm_set1_ps(b.mLightDirection.z)));
+			d = _mm_max_ps(_mm_setzero_ps(), _mm_div_ps(_mm_sub_ps(_mm_setzero_ps(), d), dist));
+			d = _mm_mul_ps(_mm_sub_ps(d, _mm_set1_ps(b.mLightAngle)), _mm_set1_ps(10.f));
+			att = _mm_mul_ps(att, _mm_min_ps(_mm_max_ps(d, _mm_setzero_ps()), _mm_set1_ps(1.f)));
+		}
+
+		ld = Exp4(_mm_mul_ps(ld, _mm_set1_ps(-b.mLightDensity * LIGHT_STEP)));
+		return _mm_add_ps(_mm_mul_ps(ld, att), _mm_set1_ps(b.mLightAmbient));
+	}
+
+	default:
+		return _mm_set1_ps(1.f);
+	}
+}
+
+// 4 RG pairs, rounded like Unorm16
+inline void StoreRG4(__m128 r, __m128 g, uint16_t* dst) {
+	__m128 one = _mm_set1_ps(1.f);
+	__m128 scale = _mm_set1_ps(65535.f);
+	__m128 half = _mm_set1_ps(.5f);
+	__m128i ri = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_min_ps(_mm_max_ps(r, _mm_setzero_ps()), one), scale), half));
+	__m128i gi = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_min_ps(_mm_max_ps(g, _mm_setzero_ps()), one), scale), half));
+	// shift into the signed range so the saturating pack keeps the full 16 bits
+	__m128i bias = _mm_set1_epi32(32768);
+	__m128i lo = _mm_sub_epi32(_mm_unpacklo_epi32(ri, gi), bias);
+	__m128i hi = _mm_sub_epi32(_mm_unpackhi_epi32(ri, gi), bias);
+	_mm_storeu_si128((__m128i*)dst, _mm_xor_si128(_mm_packs_epi32(lo, hi), _mm_set1_epi16((short)0x8000)));
+}
+
+void BakeRowSse2(const BakeContext& c, int y, int z, uint16_t* dst) {
+	const uint16_t* src = c.mVolume + (size_t)c.mWidth * (y + (size_t)c.mHeight * z);
+	__m128 py = _mm_set1_ps((float)y);
+	__m128 pz = _mm_set1_ps((float)z);
+	alignas(16) float inMask[4];
+
+	int x = 0;
+	for (; x + 4 <= c.mWidth; x += 4) {
+		__m128 px = _mm_add_ps(_mm_set1_ps((float)x), _mm_set_ps(3.f, 2.f, 1.f, 0.f));
+
+		// the voxels themselves are next to each other
+		__m128i t = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)(src + x)), _mm_setzero_si128());
+		for (int k = 0; k < 4; k++) inMask[k] = InMask(c, x + k, y, z);
+		__m128 g = _mm_mul_ps(_mm_mul_ps(_mm_cvtepi32_ps(t), _mm_set1_ps(1.f / 65535.f)), _mm_load_ps(inMask));
+
+		__m128 l = Light4(c, px, py, pz);
+		StoreRG4(_mm_div_ps(l, _mm_add_ps(l, _mm_set1_ps(1.f))), g, dst + 2 * (size_t)x);
+	}
+	BakeRowScalar(c, y, z, x, dst);
+}
+#endif
+
+#ifdef SLICE_KERNELS_AVX2
+AVX2_FUNCTION inline __m256 Normalize8(const BakeContext& c, __m256 t) {
+	const VolumeBakeParams& b = c.mParams;
+	__m256 n = _mm256_div_ps(_mm256_sub_ps(t, _mm256_set1_ps(b.mWindowMin)), _mm256_set1_ps(std::max(b.mWindowMax - b.mWindowMin, 1e-6f)));
+	return _mm256_min_ps(_mm256_max_ps(n, _mm256_setzero_ps()), _mm256_set1_ps(1.f));
+}
+AVX2_FUNCTION inline __m256 Extinction8(const BakeContext& c, __m256 n, __m256 inMask) {
+	const VolumeBakeParams& b = c.mParams;
+	__m256 g = _mm256_div_ps(_mm256_sub_ps(_mm256_mul_ps(n, inMask), _mm256_set1_ps(b.mTransfer.mThreshold)), _mm256_set1_ps(1.f - b.mTransfer.mThreshold));
+	return _mm256_mul_ps(_mm256_max_ps(g, _mm256_setzero_ps()), _mm256_set1_ps(b.mTransfer.mDensity));
+}
+// Exp4 with 8 lanes
+AVX2_FUNCTION inline __m256 Exp8(__m256 x) {
+	x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.3f)), _mm256_set1_ps(88.3f));
+	__m256 n = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)), _mm256_set1_ps(.5f)));
+	x = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(.693359375f)));
+	x = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(-2.12194440e-4f)));
+
+	__m256 y = _mm256_set1_ps(1.9875691500e-4f);
+	y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.3981999507e-3f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(8.3334519073e-3f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(4.1665795894e-2f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.6666665459e-1f));
+	y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(5.0000001201e-1f));
+	y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(y, _mm256_mul_ps(x, x)), x), _mm256_set1_ps(1.f));
+
+	__m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(n), _mm256_set1_epi32(127)), 23);
+	return _mm256_mul_ps(y, _mm256_castsi256_ps(e));
+}
+
+// 16 or 8 bit values at the 32 bit offsets i of data, which holds count values
+// Gathers 32 bits each, the last 4 bytes are read from further back so nothing past the end is touched.
+AVX2_FUNCTION inline __m256i Gather8(const void* data, size_t count, __m256i i, int bytes) {
+	__m256i off = _mm256_min_epi32(i, _mm256_set1_epi32((int)(count - 4 / bytes)));
+	__m256i shift = _mm256_slli_epi32(_mm256_sub_epi32(i, off), bytes == 2 ? 4 : 3);
+	__m256i v = bytes == 2 ? _mm256_i32gather_epi32((const int*)data, off, 2) : _mm256_i32gather_epi32((const int*)data, off, 1);
+	return _mm256_and_si256(_mm256_srlv_epi32(v, shift), _mm256_set1_epi32(bytes == 2 ? 0xFFFF : 0xFF));
+}
+
+AVX2_FUNCTION inline __m256 GatherExtinction8(const BakeContext& c, __m256 x, __m256 y, __m256 z) {
+	alignas(32) int qx[8], qy[8], qz[8];
+	alignas(32) float texel[8], inMask[8];
+	// truncates towards zero like ivec3()
+	__m256i ix = _mm256_cvttps_epi32(x);
+	__m256i iy = _mm256_cvttps_epi32(y);
+	__m256i iz = _mm256_cvttps_epi32(z);
+	if (!c.mGather) {
+		_mm256_store_si256((__m256i*)qx, ix);
+		_mm256_store_si256((__m256i*)qy, iy);
+		_mm256_store_si256((__m256i*)qz, iz);
+		GatherExtinction(c, qx, qy, qz, texel, inMask, 8);
+		return Extinction8(c, Normalize8(c, _mm256_load_ps(texel)), _mm256_load_ps(inMask));
+	}
+
+	// lanes outside the volume read voxel 0 and count as 0, like Texel and InMask
+	__m256i minus1 = _mm256_set1_epi32(-1);
+	__m256i inside = _mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi32(ix, minus1), _mm256_cmpgt_epi32(_mm256_set1_epi32(c.mWidth), ix)),
+		_mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi32(iy, minus1), _mm256_cmpgt_epi32(_mm256_set1_epi32(c.mHeight), iy)),
+			_mm256_and_si256(_mm256_cmpgt_epi32(iz, minus1), _mm256_cmpgt_epi32(_mm256_set1_epi32(c.mDepth), iz))));
+	ix = _mm256_and_si256(ix, inside);
+	iy = _mm256_and_si256(iy, inside);
+	iz = _mm256_and_si256(iz, inside);
+	__m256i row = _mm256_add_epi32(_mm256_mullo_epi32(iz, _mm256_set1_epi32(c.mHeight)), iy);
+
+	__m256i i = _mm256_add_epi32(_mm256_mullo_epi32(row, _mm256_set1_epi32(c.mWidth)), ix);
+	__m256i t = _mm256_and_si256(Gather8(c.mVolume, (size_t)c.mWidth * c.mHeight * c.mDepth, i, 2), inside);
+
+	__m256i m = inside;
+	if (c.mMask) {
+		__m256i byte = c.mMaskBits == 1 ? _mm256_srli_epi32(ix, 3) : ix;
+		i = _mm256_add_epi32(_mm256_mullo_epi32(row, _mm256_set1_epi32((int)c.mMaskStride)), byte);
+		__m256i b = Gather8(c.mMask, c.mMaskStride * c.mHeight * c.mDepth, i, 1);
+		if (c.mMaskBits == 1) b = _mm256_and_si256(_mm256_srlv_epi32(b, _mm256_and_si256(ix, _mm256_set1_epi32(7))), _mm256_set1_epi32(1));
+		m = _mm256_andnot_si256(_mm256_cmpeq_epi32(b, _mm256_setzero_si256()), inside);
+	}
+
+	__m256 n = Normalize8(c, _mm256_mul_ps(_mm256_cvtepi32_ps(t), _mm256_set1_ps(1.f / 65535.f)));
+	return Extinction8(c, n, _mm256_and_ps(_mm256_castsi256_ps(m), _mm256_set1_ps(1.f)));
+}
+
+// Light4 with 8 lanes, no FMA so it rounds the same way
+AVX2_FUNCTION __m256 Light8(const BakeContext& c, __m256 px, __m256 py, __m256 pz) {
+	const VolumeBakeParams& b = c.mParams;
+	__m256 ld = _mm256_setzero_ps();
+
+	switch (b.mLight) {
+	case BAKE_LIGHT_DIRECTIONAL:
+		for (int i = 1; i < LIGHT_SAMPLES; i++) {
+			vec3 s = c.mLightStep * (float)i;
+			ld = _mm256_add_ps(ld, GatherExtinction8(c, _mm256_add_ps(px, _mm256_set1_ps(s.x)), _mm256_add_ps(py, _mm256_set1_ps(s.y)), _mm256_add_ps(pz, _mm256_set1_ps(s.z))));
+		}
+		ld = Exp8(_mm256_mul_ps(ld, _mm256_set1_ps(-b.mLightDensity * LIGHT_STEP)));
+		return _mm256_add_ps(_mm256_mul_ps(ld, _mm256_set1_ps(b.mLightIntensity)), _mm256_set1_ps(b.mLightAmbient));
+
+	case BAKE_LIGHT_POINT:
+	case BAKE_LIGHT_SPOT: {
+		__m256 dx = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(px, _mm256_set1_ps(c.mTexelSize.x)), _mm256_set1_ps(.5f)), _mm256_set1_ps(b.mWorldScale.x)), _mm256_set1_ps(b.mLightPosition.x));
+		__m256 dy = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(py, _mm256_set1_ps(c.mTexelSize.y)), _mm256_set1_ps(.5f)), _mm256_set1_ps(b.mWorldScale.y)), _mm256_set1_ps(b.mLightPosition.y));
+		__m256 dz = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(pz, _mm256_set1_ps(c.mTexelSize.z)), _mm256_set1_ps(.5f)), _mm256_set1_ps(b.mWorldScale.z)), _mm256_set1_ps(b.mLightPosition.z));
+		__m256 dist = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz)));
+
+		for (int i = 1; i <= LIGHT_SAMPLES; i++) {
+			float t = (float)i / (float)LIGHT_SAMPLES;
+			__m256 it = _mm256_set1_ps(1.f - t);
+			__m256 qx = _mm256_add_ps(_mm256_mul_ps(px, it), _mm256_set1_ps(c.mLightVoxel.x * t));
+			__m256 qy = _mm256_add_ps(_mm256_mul_ps(py, it), _mm256_set1_ps(c.mLightVoxel.y * t));
+			__m256 qz = _mm256_add_ps(_mm256_mul_ps(pz, it), _mm256_set1_ps(c.mLightVoxel.z * t));
+			ld = _mm256_add_ps(ld, GatherExtinction8(c, qx, qy, qz));
+		}
+
+		__m256 att = _mm256_add_ps(_mm256_mul_ps(dist, _mm256_set1_ps(75.f)), _mm256_set1_ps(1.f));
+		att = _mm256_div_ps(_mm256_set1_ps(b.mLightIntensity), _mm256_mul_ps(att, att));
+		if (b.mLight == BAKE_LIGHT_SPOT) {
+			__m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, _mm256_set1_ps(b.mLightDirection.x)), _mm256_mul_ps(dy, _mm256_set1_ps(b.mLightDirection.y))), _mm256_mul_ps(dz, _mm256_set1_ps(b.mLightDirection.z)));
+			d = _mm256_max_ps(_mm256_setzero_ps(), _mm256_div_ps(_mm256_sub_ps(_mm256_setzero_ps(), d), dist));
+			d = _mm256_mul_ps(_mm256_sub_ps(d, _mm256_set1_ps(b.mLightAngle)), _mm256_set1_ps(10.f));
+			att = _mm256_mul_ps(att, _mm256_min_ps(_mm256_max_ps(d, _mm256_setzero_ps()), _mm256_set1_ps(1.f)));
+		}
+
+		ld = Exp8(_mm256_mul_ps(ld, _mm256_set1_ps(-b.mLightDensity * LIGHT_STEP)));
+		return _mm256_add_ps(_mm256_mul_ps(ld, att), _mm256_set1_ps(b.mLightAmbient));
+	}
+
+	default:
+		return _mm256_set1_ps(1.f);
+	}
+}
+
+AVX2_FUNCTION void BakeRowAvx2(const BakeContext& c, int y, int z, uint16_t* dst) {
+	const uint16_t* src = c.mVolume + (size_t)c.mWidth * (y + (size_t)c.mHeight * z);
+	__m256 py = _mm256_set1_ps((float)y);
+	__m256 pz = _mm256_set1_ps((float)z);
+	alignas(32) float inMask[8];
+
+	int x = 0;
+	for (; x + 8 <= c.mWidth; x += 8) {
+		__m256 px = _mm256_add_ps(_mm256_set1_ps((float)x), _mm256_set_ps(7.f, 6.f, 5.f, 4.f, 3.f, 2.f, 1.f, 0.f));
+
+		__m256i t = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(src + x)));
+		for (int k = 0; k < 8; k++) inMask[k] = InMask(c, x + k, y, z);
+		__m256 g = _mm256_mul_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(t), _mm256_set1_ps(1.f / 65535.f)), _mm256_load_ps(inMask));
+
+		__m256 l = Light8(c, px, py, pz);
+		__m256 r = _mm256_div_ps(l, _mm256_add_ps(l, _mm256_set1_ps(1.f)));
+		StoreRG4(_mm256_castps256_ps128(r), _mm256_castps256_ps128(g), dst + 2 * (size_t)x);
+		StoreRG4(_mm256_extractf128_ps(r, 1), _mm256_extractf128_ps(g, 1), dst + 2 * (size_t)x + 8);
+	}
+	BakeRowScalar(c, y, z, x, dst);
+}
+#endif
+
+void VolumeBake::Bake(const uint16_t* volume, unsigned int width, unsigned int height, unsigned int depth, const VolumeBakeParams& params,
+	uint16_t* dst, ThreadPool& pool, const uint8_t* mask, unsigned int maskBits) {
+	BakeContext c;
+	c.mVolume = volume;
+	c.mMask = mask;
+	c.mMaskBits = maskBits;
+	c.mMaskStride = maskBits == 1 ? (width + 7) / 8 : width;
+	c.mWidth = (int)width;
+	c.mHeight = (int)height;
+	c.mDepth = (int)depth;
+	c.mParams = params;
+	size_t voxels = (size_t)width * height * depth;
+	size_t maskBytes = c.mMaskStride * height * depth;
+	c.mGather = voxels >= 2 && voxels < 0x7FFFFFFF && (!mask || (maskBytes >= 4 && maskBytes < 0x7FFFFFFF));
+
+	vec3 size((float)width, (float)height, (float)depth);
+	c.mTexelSize = 1.f / size;
+	c.mLightVoxel = (params.mLightPosition / params.mWorldScale + .5f) / c.mTexelSize;
+	c.mLightStep = vec3(0.f);
+	if (params.mLight == BAKE_LIGHT_DIRECTIONAL)
+		c.mLightStep = -normalize(params.mLightDirection / params.mWorldScale) / c.mTexelSize * LIGHT_STEP;
+
+	SliceKernelIsa isa = GetSliceKernelIsa();
+	// a few rows per task, neighbouring rows share most of the voxels their shadow rays pass through
+	pool.ParallelFor(0, (size_t)height * depth, [&](size_t row) {
+		int y = (int)(row % height);
+		int z = (int)(row / height);
+		uint16_t* d = dst + 2 * (size_t)width * row;
+		switch (isa) {
+#ifdef SLICE_KERNELS_AVX2
+		case SLICE_KERNEL_AVX2: BakeRowAvx2(c, y, z, d); break;
+#endif
+#ifdef SLICE_KERNELS_SSE2
+		case SLICE_KERNEL_SSE2: BakeRowSse2(c, y, z, d); break;
+#endif
+		default: BakeRowScalar(c, y, z, 0, d); break;
+		}
+	}, 4);
+}
\ No newline at end of file
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <cstddef>
+
+#include "TransferFunction.hpp"
+
+class ThreadPool;
+
+enum BakeLight {
+	BAKE_LIGHT_NONE,
+	BAKE_LIGHT_POINT,
+	BAKE_LIGHT_SPOT,
+	BAKE_LIGHT_DIRECTIONAL,
+};
+
+// Inputs of the volume.glsl bake, the values Volume sets as its uniforms
+struct VolumeBakeParams {
+	// only the extinction matters to the bake
+	TransferFunction mTransfer;
+	// texel values mapped to 0 and 1
+	float mWindowMin;
+	float mWindowMax;
+	glm::vec3 mWorldScale;
+
+	BakeLight mLight;
+	// relative to the volume, rotated but not scaled
+	glm::vec3 mLightPosition;
+	glm::vec3 mLightDirection;
+	float mLightDensity;
+	float mLightAngle;
+	float mLightAmbient;
+	float mLightIntensity;
+
+	VolumeBakeParams() : mWindowMin(0.f), mWindowMax(1.f), mWorldScale(1.f),
+		mLight(BAKE_LIGHT_POINT), mLightPosition(0.f, .1f, 0.f), mLightDirection(0.f, -1.f, 0.f),
+		mLightDensity(300.f), mLightAngle(.5f), mLightAmbient(.2f), mLightIntensity(100.f) {}
+};
+
+// CPU version of the volume.glsl bake, for hosts without a GPU and to check the shader against
+// Produces the RG16 texels of an unbricked bake with the lighting at full resolution (Volume::IlluminationLevel 0
+// without the sweep): the light l as l / (1 + l) in r and the masked texel in g, the window only shapes the shadows.
+// Voxels along a row are baked 4 or 8 at a time with the instruction set SliceKernels picked, rows are spread over
+// the pool.
+class VolumeBake {
+public:
+	// volume holds width x height x depth R16 texels. mask is optional and laid out like ImageLoader::LoadMask at the
+	// same resolution, 8 voxels per byte along x when maskBits is 1. dst receives 2 values per voxel.
+	static void Bake(const uint16_t* volume, unsigned int width, unsigned int height, unsigned int depth, const VolumeBakeParams& params,
+		uint16_t* dst, ThreadPool& pool, const uint8_t* mask = nullptr, unsigned int maskBits = 1);
+};
\ No newline at end of file
@@ -0,0 +1,353 @@
+#include "VolumeCache.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+
+#include "MappedFile.hpp"
+#include "MemoryStream.hpp"
+#include "ThreadPool.hpp"
+
+#define CACHE_MAGIC 0x4C4F5643 // CVOL
+#define CACHE_VERSION 5
+#define CACHE_FLAG_COMPRESSED 1
+#define CACHE_CHUNK_SLICES 16
+
+using namespace std;
+using namespace glm;
+
+namespace fs = std::filesystem;
+
+bool VolumeCache::sEnabled = true;
+bool VolumeCache::sCompress = false;
+uint64_t VolumeCache::sMaxBytes = 16ull << 30;
+
+#pragma pack(push, 1)
+struct CacheHeader {
+	uint32_t mMagic;
+	uint32_t mVersion;
+	uint64_t mKey;
+	uint32_t mWidth;
+	uint32_t mHeight;
+	uint32_t mDepth;
+	uint32_t mInternalFormat;
+	uint32_t mFormat;
+	uint32_t mType;
+	uint32_t mVoxelSize;
+	uint32_t mFlags;
+	float mSize[3];
+	float mValueScale;
+	float mValueOffset;
+	float mMin;
+	float mMax;
+	// histogram bins, stored as uint32_t after the header
+	uint32_t mHistogramBins;
+	// number of compressed chunks, their sizes follow the slice positions as uint64_t
+	uint32_t mChunkCount;
+	// SliceGrid, the slice positions follow the histogram as doubles
+	uint32_t mGridWidth;
+	uint32_t mGridHeight;
+	uint32_t mGridDepth;
+	double mGridSpacing[2];
+	uint32_t mResampledDimensions[3];
+	double mResampledSpacing[3];
+};
+#pragma pack(pop)
+
+inline uint64_t Hash(uint64_t h, const void* data, size_t len) {
+	// FNV-1a
+	const uint8_t* p = (const uint8_t*)data;
+	for (size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001B3ull;
+	}
+	return h;
+}
+
+uint32_t VoxelSize(GLenum format, GLenum type) {
+	uint32_t c = 1;
+	switch (format) {
+	case GL_RG: c = 2; break;
+	case GL_RGB: c = 3; break;
+	case GL_RGBA: c = 4; break;
+	}
+	switch (type) {
+	case GL_UNSIGNED_SHORT:
+	case GL_SHORT:
+	case GL_HALF_FLOAT:
+		return c * 2;
+	case GL_UNSIGNED_INT:
+	case GL_INT:
+	case GL_FLOAT:
+		return c * 4;
+	default:
+		return c;
+	}
+}
+
+uint64_t VolumeCache::Key(const vector<string>& files) {
+	// directory listings aren't guaranteed to come back in the same order
+	vector<string> sorted(files);
+	sort(sorted.begin(), sorted.end());
+
+	uint64_t h = 0xCBF29CE484222325ull;
+	for (const auto& f : sorted) {
+		error_code ec;
+		uint64_t sz = (uint64_t)fs::file_size(f, ec);
+		int64_t mt = (int64_t)fs::last_write_time(f, ec).time_since_epoch().count();
+		h = Hash(h, f.data(), f.length());
+		h = Hash(h, &sz, sizeof(sz));
+		h = Hash(h, &mt, sizeof(mt));
+	}
+	uint64_t n = files.size();
+	return Hash(h, &n, sizeof(n));
+}
+
+string VolumeCache::Path(const string& folder) {
+	error_code ec;
+	string full = fs::absolute(folder, ec).string();
+	uint64_t h = Hash(0xCBF29CE484222325ull, full.data(), full.length());
+
+	char name[32];
+	snprintf(name, 32, "%016llx.cdvol", (unsigned long long)h);
+
+	fs::path dir = fs::temp_directory_path(ec) / "CDVis";
+	return (dir / name).string();
+}
+
+shared_ptr<VolumeCache::Data> Corrupt(const string& path) {
+	printf("Volume cache %s is corrupt, rebuilding it\n", path.c_str());
+	return nullptr;
+}
+
+// Removes the least recently used caches until the folder fits in sMaxBytes, keep is never removed
+void Trim(const fs::path& dir, const fs::path& keep) {
+	struct Entry {
+		fs::path mPath;
+		fs::file_time_type mTime;
+		uintmax_t mSize;
+	};
+	vector<Entry> entries;
+	uintmax_t total = 0;
+
+	error_code ec;
+	for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+		if (it->path().extension() != ".cdvol" || it->path() == keep) continue;
+		Entry e;
+		e.mPath = it->path();
+		e.mTime = fs::last_write_time(e.mPath, ec);
+		e.mSize = fs::file_size(e.mPath, ec);
+		if (ec) {
+			ec.clear();
+			continue;
+		}
+		entries.push_back(e);
+		total += e.mSize;
+	}
+	total += fs::file_size(keep, ec);
+
+	sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.mTime < b.mTime; });
+	for (const auto& e : entries) {
+		if (total <= VolumeCache::sMaxBytes) break;
+		if (fs::remove(e.mPath, ec)) total -= e.mSize;
+	}
+}
+
+shared_ptr<VolumeCache::Data> VolumeCache::Read(const string& path, uint64_t key) {
+	if (!sEnabled) return nullptr;
+	auto start = chrono::high_resolution_clock::now();
+
+	unique_ptr<MappedFile> file(new MappedFile(path));
+	if (!file->Data() || file->Size() < sizeof(CacheHeader)) return nullptr;
+
+	const CacheHeader& header = *(const CacheHeader*)file->Data();
+	if (header.mMagic != CACHE_MAGIC || header.mVersion != CACHE_VERSION || header.mKey != key) return nullptr;
+
+	// everything past the key comes from a file that may be truncated or corrupt, a bad cache just gets rebuilt
+	if (header.mWidth == 0 || header.mHeight == 0 || header.mDepth == 0 ||
+		header.mVoxelSize != VoxelSize(header.mFormat, header.mType)) return Corrupt(path);
+	size_t sliceSize = (size_t)header.mWidth * header.mHeight * header.mVoxelSize;
+	if (sliceSize / header.mVoxelSize / header.mWidth != header.mHeight || SIZE_MAX / sliceSize < header.mDepth) return Corrupt(path);
+	size_t voxelBytes = sliceSize * header.mDepth;
+
+	const uint8_t* payload = file->Data() + sizeof(CacheHeader);
+	size_t remaining = file->Size() - sizeof(CacheHeader);
+
+	const uint32_t* histogram = (const uint32_t*)payload;
+	if (remaining / sizeof(uint32_t) < header.mHistogramBins) return Corrupt(path);
+	payload += sizeof(uint32_t) * header.mHistogramBins;
+	remaining -= sizeof(uint32_t) * header.mHistogramBins;
+
+	const double* positions = (const double*)payload;
+	if (remaining / sizeof(double) < header.mGridDepth) return Corrupt(path);
+	payload += sizeof(double) * header.mGridDepth;
+	remaining -= sizeof(double) * header.mGridDepth;
+
+	shared_ptr<Data> data(new Data());
+	data->mWidth = header.mWidth;
+	data->mHeight = header.mHeight;
+	data->mDepth = header.mDepth;
+	data->mInternalFormat = header.mInternalFormat;
+	data->mFormat = header.mFormat;
+	data->mType = header.mType;
+	data->mSize = vec3(header.mSize[0], header.mSize[1], header.mSize[2]);
+	data->mStats.mValueScale = header.mValueScale;
+	data->mStats.mValueOffset = header.mValueOffset;
+	data->mStats.mMin = header.mMin;
+	data->mStats.mMax = header.mMax;
+	data->mStats.mHistogram.assign(histogram, histogram + header.mHistogramBins);
+	data->mGrid.mWidth = header.mGridWidth;
+	data->mGrid.mHeight = header.mGridHeight;
+	data->mGrid.mSpacingX = header.mGridSpacing[0];
+	data->mGrid.mSpacingY = header.mGridSpacing[1];
+	data->mGrid.mPositions.assign(positions, positions + header.mGridDepth);
+	for (unsigned int i = 0; i < 3; i++) {
+		data->mGrid.mResampledDimensions[i] = header.mResampledDimensions[i];
+		data->mGrid.mResampledSpacing[i] = header.mResampledSpacing[i];
+	}
+
+	if (header.mFlags & CACHE_FLAG_COMPRESSED) {
+		if (header.mChunkCount != (header.mDepth + CACHE_CHUNK_SLICES - 1) / CACHE_CHUNK_SLICES ||
+			remaining / sizeof(uint64_t) < header.mChunkCount) return Corrupt(path);
+		const uint64_t* chunkSizes = (const uint64_t*)payload;
+		payload += sizeof(uint64_t) * header.mChunkCount;
+		remaining -= sizeof(uint64_t) * header.mChunkCount;
+
+		vector<size_t> offsets(header.mChunkCount);
+		size_t offset = 0;
+		for (uint32_t i = 0; i < header.mChunkCount; i++) {
+			if (chunkSizes[i] > remaining - offset) return Corrupt(path);
+			offsets[i] = offset;
+			offset += (size_t)chunkSizes[i];
+		}
+
+		data->mBuffer.resize(voxelBytes);
+		uint8_t* voxels = data->mBuffer.data();
+		atomic<bool> failed(false);
+		ThreadPool::Shared().ParallelFor(0, header.mChunkCount, [&](size_t i) {
+			size_t z = i * CACHE_CHUNK_SLICES;
+			size_t bytes = std::min<size_t>(CACHE_CHUNK_SLICES, header.mDepth - z) * sliceSize;
+			MemoryStream src((const char*)payload + offsets[i], (size_t)chunkSizes[i], false);
+			MemoryStream dst(bytes, false);
+			if (!src.Decompress(dst, (size_t)chunkSizes[i])) {
+				failed = true;
+				return;
+			}
+			memcpy(voxels + z * sliceSize, dst.Ptr(), bytes);
+		});
+		if (failed) return Corrupt(path);
+		data->mVoxels = voxels;
+	} else {
+		if (remaining < voxelBytes) return Corrupt(path);
+		// uploaded straight out of the mapping
+		data->mVoxels = payload;
+		data->mFile = move(file);
+	}
+
+	// recently read caches are the last to be trimmed
+	error_code ec;
+	fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+
+	double seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+	printf("read %ux%ux%u volume from cache %s in %.2fs\n", header.mWidth, header.mHeight, header.mDepth, path.c_str(), seconds);
+	return data;
+}
+
+shared_ptr<Texture> VolumeCache::Load(const string& path, uint64_t key, vec3& size, VolumeStats& stats) {
+	shared_ptr<Data> data = Read(path, key);
+	if (!data) return nullptr;
+
+	size = data->mSize;
+	stats = data->mStats;
+	return shared_ptr<Texture>(new Texture(data->mWidth, data->mHeight, data->mDepth, data->mInternalFormat, data->mFormat, data->mType, GL_LINEAR, (void*)data->mVoxels));
+}
+
+bool VolumeCache::Save(const string& path, uint64_t key, const vec3& size, const VolumeStats& stats, const SliceGrid& grid,
+	unsigned int width, unsigned int height, unsigned int depth, GLenum internalFormat, GLenum format, GLenum type, const void* data) {
+	if (!sEnabled) return false;
+
+	CacheHeader header;
+	header.mMagic = CACHE_MAGIC;
+	header.mVersion = CACHE_VERSION;
+	header.mKey = key;
+	header.mWidth = width;
+	header.mHeight = height;
+	header.mDepth = depth;
+	header.mInternalFormat = internalFormat;
+	header.mFormat = format;
+	header.mType = type;
+	header.mVoxelSize = VoxelSize(format, type);
+	header.mFlags = sCompress ? CACHE_FLAG_COMPRESSED : 0;
+	header.mSize[0] = size.x;
+	header.mSize[1] = size.y;
+	header.mSize[2] = size.z;
+	header.mValueScale = stats.mValueScale;
+	header.mValueOffset = stats.mValueOffset;
+	header.mMin = stats.mMin;
+	header.mMax = stats.mMax;
+	header.mHistogramBins = (uint32_t)stats.mHistogram.size();
+	header.mChunkCount = sCompress ? (depth + CACHE_CHUNK_SLICES - 1) / CACHE_CHUNK_SLICES : 0;
+	header.mGridWidth = grid.mWidth;
+	header.mGridHeight = grid.mHeight;
+	header.mGridDepth = grid.Depth();
+	header.mGridSpacing[0] = grid.mSpacingX;
+	header.mGridSpacing[1] = grid.mSpacingY;
+	for (unsigned int i = 0; i < 3; i++) {
+		header.mResampledDimensions[i] = grid.mResampledDimensions[i];
+		header.mResampledSpacing[i] = grid.mResampledSpacing[i];
+	}
+
+	size_t sliceSize = (size_t)width * height * header.mVoxelSize;
+
+	error_code ec;
+	fs::create_directories(fs::path(path).parent_path(), ec);
+
+	// write to a temporary file first so an interrupted write never leaves a valid looking cache behind
+	string tmp = path + ".tmp";
+	ofstream file(tmp, ios::binary);
+	if (!file) {
+		printf("Failed to write volume cache %s\n", path.c_str());
+		return false;
+	}
+
+	file.write((const char*)&header, sizeof(CacheHeader));
+	file.write((const char*)stats.mHistogram.data(), sizeof(uint32_t) * stats.mHistogram.size());
+	file.write((const char*)grid.mPositions.data(), sizeof(double) * grid.mPositions.size());
+
+	if (sCompress) {
+		vector<unique_ptr<MemoryStream>> chunks(header.mChunkCount);
+		ThreadPool::Shared().ParallelFor(0, header.mChunkCount, [&](size_t i) {
+			size_t z = i * CACHE_CHUNK_SLICES;
+			size_t bytes = std::min<size_t>(CACHE_CHUNK_SLICES, depth - z) * sliceSize;
+			MemoryStream src(bytes, false);
+			src.Write((const char*)data + z * sliceSize, bytes);
+			chunks[i] = unique_ptr<MemoryStream>(new MemoryStream());
+			src.Compress(*chunks[i]);
+		});
+		for (const auto& c : chunks) {
+			uint64_t sz = (uint64_t)c->Tell();
+			file.write((const char*)&sz, sizeof(uint64_t));
+		}
+		for (const auto& c : chunks)
+			file.write(c->Ptr(), c->Tell());
+	} else
+		file.write((const char*)data, sliceSize * depth);
+
+	file.close();
+	if (!file) {
+		fs::remove(tmp, ec);
+		printf("Failed to write volume cache %s\n", path.c_str());
+		return false;
+	}
+
+	fs::rename(tmp, path, ec);
+	if (ec) {
+		fs::remove(tmp, ec);
+		return false;
+	}
+	Trim(fs::path(path).parent_path(), fs::path(path));
+	return true;
+}
\ No newline at end of file
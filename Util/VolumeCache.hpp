@@ -0,0 +1,57 @@
+#pragma once
+
+#include <gl/glew.h>
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../Pipeline/Texture.hpp"
+#include "MappedFile.hpp"
+#include "SliceGrid.hpp"
+#include "VolumeStats.hpp"
+
+// Preprocessed volumes stored on disk (.cdvol) so a series only has to be decoded once
+// The file holds the dimensions, physical size, texture format, intensity statistics, the SliceGrid and a content key
+// of the source files, followed by the voxels. Uncompressed caches are memory mapped and handed to the texture as-is,
+// compressed caches store the voxels as zlib chunks of CACHE_CHUNK_SLICES slices each.
+class VolumeCache {
+public:
+	// Voxels of a cache read on another thread, ready to upload
+	struct Data {
+		unsigned int mWidth;
+		unsigned int mHeight;
+		unsigned int mDepth;
+		GLenum mInternalFormat;
+		GLenum mFormat;
+		GLenum mType;
+		glm::vec3 mSize;
+		VolumeStats mStats;
+		SliceGrid mGrid;
+		// points into the mapping for uncompressed caches, into mBuffer for compressed ones
+		const uint8_t* mVoxels;
+		std::unique_ptr<MappedFile> mFile;
+		std::vector<uint8_t> mBuffer;
+	};
+
+	// Hash over the paths, sizes and modification times of the source files
+	static uint64_t Key(const std::vector<std::string>& files);
+	// Where the cache for a source folder lives
+	static std::string Path(const std::string& folder);
+
+	// Returns nullptr if the cache doesn't exist, was made from different files or is truncated or corrupt
+	// Read() doesn't touch GL and can run on any thread, Load() also creates the texture.
+	static std::shared_ptr<Data> Read(const std::string& path, uint64_t key);
+	static std::shared_ptr<Texture> Load(const std::string& path, uint64_t key, glm::vec3& size, VolumeStats& stats);
+	static bool Save(const std::string& path, uint64_t key, const glm::vec3& size, const VolumeStats& stats, const SliceGrid& grid,
+		unsigned int width, unsigned int height, unsigned int depth, GLenum internalFormat, GLenum format, GLenum type, const void* data);
+
+	// Disabled caches are neither read nor written (benchmarks measure decoding)
+	static bool sEnabled;
+	// Compress newly written caches. Off by default, since compressed caches can't be uploaded straight from the mapping.
+	static bool sCompress;
+	// Saving a cache removes the least recently read ones until the cache folder fits in this many bytes
+	static uint64_t sMaxBytes;
+};
\ No newline at end of file
@@ -0,0 +1,99 @@
+#include "VolumePyramid.hpp"
+
+#include <algorithm>
+
+#include "ThreadPool.hpp"
+#include "../Pipeline/Texture.hpp"
+
+using namespace std;
+
+// smallest level along the longest axis
+#define PYRAMID_MIN_SIZE 16
+
+size_t VolumePyramid::sBudget = (size_t)1 << 30;
+PyramidFilter VolumePyramid::sFilter = PYRAMID_AVERAGE;
+
+// Halves src into dst, sizes are rounded up and the last row/column/slice is repeated at odd edges
+void Downsample(const VolumePyramid::Level& src, VolumePyramid::Level& dst, PyramidFilter filter) {
+	size_t sw = src.mWidth;
+	size_t sh = src.mHeight;
+	size_t dw = dst.mWidth;
+	size_t dh = dst.mHeight;
+
+	ThreadPool::Shared().ParallelFor(0, dst.mDepth, [&](size_t z) {
+		size_t z0 = 2 * z;
+		size_t z1 = std::min<size_t>(z0 + 1, src.mDepth - 1);
+		for (size_t y = 0; y < dh; y++) {
+			size_t y0 = 2 * y;
+			size_t y1 = std::min(y0 + 1, sh - 1);
+			const uint16_t* r[4] = {
+				src.mVoxels + (z0 * sh + y0) * sw,
+				src.mVoxels + (z0 * sh + y1) * sw,
+				src.mVoxels + (z1 * sh + y0) * sw,
+				src.mVoxels + (z1 * sh + y1) * sw,
+			};
+			uint16_t* out = dst.mBuffer.data() + (z * dh + y) * dw;
+
+			for (size_t x = 0; x < dw; x++) {
+				size_t x0 = 2 * x;
+				size_t x1 = std::min(x0 + 1, sw - 1);
+				if (filter == PYRAMID_MAX) {
+					uint16_t m = 0;
+					for (unsigned int i = 0; i < 4; i++)
+						m = std::max(m, std::max(r[i][x0], r[i][x1]));
+					out[x] = m;
+				} else {
+					uint32_t s = 4;
+					for (unsigned int i = 0; i < 4; i++)
+						s += r[i][x0] + r[i][x1];
+					out[x] = (uint16_t)(s >> 3);
+				}
+			}
+		}
+	});
+}
+
+shared_ptr<VolumePyramid> VolumePyramid::Build(const shared_ptr<void>& owner, const uint16_t* data,
+	unsigned int width, unsigned int height, unsigned int depth, PyramidFilter filter) {
+	shared_ptr<VolumePyramid> pyramid(new VolumePyramid());
+	pyramid->mOwner = owner;
+
+	Level l0;
+	l0.mWidth = width;
+	l0.mHeight = height;
+	l0.mDepth = depth;
+	l0.mVoxels = data;
+	pyramid->mLevels.push_back(move(l0));
+
+	while (true) {
+		const Level& src = pyramid->mLevels.back();
+		if (std::max(std::max(src.mWidth, src.mHeight), src.mDepth) <= PYRAMID_MIN_SIZE) break;
+
+		Level dst;
+		dst.mWidth = (src.mWidth + 1) / 2;
+		dst.mHeight = (src.mHeight + 1) / 2;
+		dst.mDepth = (src.mDepth + 1) / 2;
+		dst.mBuffer.resize((size_t)dst.mWidth * dst.mHeight * dst.mDepth);
+		dst.mVoxels = dst.mBuffer.data();
+		Downsample(src, dst, filter);
+		pyramid->mLevels.push_back(move(dst));
+	}
+
+	return pyramid;
+}
+
+unsigned int VolumePyramid::FinestLevel(unsigned int maxSize, size_t budget) const {
+	for (unsigned int i = 0; i < mLevels.size(); i++) {
+		const Level& l = mLevels[i];
+		if (l.mWidth <= maxSize && l.mHeight <= maxSize && l.mDepth <= maxSize && l.Bytes() <= budget)
+			return i;
+	}
+	return (unsigned int)mLevels.size() - 1;
+}
+
+shared_ptr<Texture> VolumePyramid::Upload(unsigned int level) const {
+	const Level& l = mLevels[std::min(level, (unsigned int)mLevels.size() - 1)];
+	shared_ptr<Texture> tex(new Texture(l.mWidth, l.mHeight, l.mDepth, GL_R16, GL_RED, GL_UNSIGNED_SHORT, GL_LINEAR));
+	tex->Upload(0, 0, 0, l.mWidth, l.mHeight, l.mDepth, l.mVoxels);
+	return tex;
+}
\ No newline at end of file
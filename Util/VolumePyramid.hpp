@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class Texture;
+
+enum PyramidFilter {
+	// mean of the 2x2x2 block, smooth but thin bright structures fade out
+	PYRAMID_AVERAGE,
+	// maximum of the 2x2x2 block, keeps vessels and contrast-filled structures visible
+	PYRAMID_MAX,
+};
+
+// 16 bit volume at successively halved resolutions, built on the CPU
+// Volumes larger than GL_MAX_3D_TEXTURE_SIZE or the memory budget are drawn from the finest level that fits,
+// and the levels stay in memory so the resolution can be changed without reloading.
+class VolumePyramid {
+public:
+	struct Level {
+		unsigned int mWidth;
+		unsigned int mHeight;
+		unsigned int mDepth;
+		const uint16_t* mVoxels;
+		// empty for level 0, which points into the source
+		std::vector<uint16_t> mBuffer;
+
+		inline size_t Bytes() const { return (size_t)mWidth * mHeight * mDepth * sizeof(uint16_t); }
+	};
+
+	// Largest texture the renderer may allocate for a volume, in bytes
+	static size_t sBudget;
+	static PyramidFilter sFilter;
+
+	// Builds levels down to 16 voxels along the longest axis. The source is not copied, owner keeps it alive.
+	static std::shared_ptr<VolumePyramid> Build(const std::shared_ptr<void>& owner, const uint16_t* data,
+		unsigned int width, unsigned int height, unsigned int depth, PyramidFilter filter);
+
+	inline unsigned int LevelCount() const { return (unsigned int)mLevels.size(); }
+	inline const Level& GetLevel(unsigned int level) const { return mLevels[level]; }
+
+	// Finest level that is at most maxSize texels along every axis and fits in budget bytes
+	unsigned int FinestLevel(unsigned int maxSize, size_t budget) const;
+	// Creates a GL_R16 texture holding a level, has to be called on the GL thread
+	std::shared_ptr<Texture> Upload(unsigned int level) const;
+
+private:
+	std::shared_ptr<void> mOwner;
+	std::vector<Level> mLevels;
+};
\ No newline at end of file
@@ -0,0 +1,236 @@
+#include "VolumeResampler.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+#include "ThreadPool.hpp"
+
+#define LANCZOS_RADIUS 3
+
+using namespace std;
+using namespace glm;
+
+bool VolumeResampler::sEnabled = false;
+ResampleFilter VolumeResampler::sFilter = RESAMPLE_TRILINEAR;
+vec3 VolumeResampler::sSpacing = vec3(0.f);
+
+// Source samples and weights of every output sample along one axis
+struct Taps {
+	unsigned int mCount;
+	vector<int> mFirst;
+	vector<float> mWeights;
+};
+
+inline double Lanczos(double x) {
+	if (x == 0.0) return 1.0;
+	if (fabs(x) >= LANCZOS_RADIUS) return 0.0;
+	double px = 3.14159265358979 * x;
+	return LANCZOS_RADIUS * sin(px) * sin(px / LANCZOS_RADIUS) / (px * px);
+}
+
+// coords holds the continuous source index of every output sample, scale is output spacing / source spacing
+Taps BuildTaps(const vector<double>& coords, unsigned int srcCount, ResampleFilter filter, double scale) {
+	Taps taps;
+	double width = filter == RESAMPLE_LANCZOS ? LANCZOS_RADIUS * std::max(scale, 1.0) : 1.0;
+	taps.mCount = filter == RESAMPLE_LANCZOS ? (unsigned int)ceil(2 * width) + 1 : 2;
+	taps.mFirst.resize(coords.size());
+	taps.mWeights.resize(coords.size() * taps.mCount);
+
+	for (size_t i = 0; i < coords.size(); i++) {
+		double c = std::min(std::max(coords[i], 0.0), (double)srcCount - 1);
+		int first = filter == RESAMPLE_LANCZOS ? (int)floor(c - width) + 1 : (int)floor(c);
+		float* w = taps.mWeights.data() + i * taps.mCount;
+
+		double sum = 0.0;
+		for (unsigned int t = 0; t < taps.mCount; t++) {
+			double d = c - (first + (int)t);
+			double v = filter == RESAMPLE_LANCZOS ? Lanczos(d / std::max(scale, 1.0)) : std::max(0.0, 1.0 - fabs(d));
+			// samples past the edges are left out, the rest is renormalized
+			if (first + (int)t < 0 || first + (int)t >= (int)srcCount) v = 0.0;
+			w[t] = (float)v;
+			sum += v;
+		}
+		if (sum == 0.0) {
+			// only happens on the edges, fall back to the nearest sample
+			first = (int)lround(c);
+			w[0] = 1.f;
+			for (unsigned int t = 1; t < taps.mCount; t++) w[t] = 0.f;
+		} else
+			for (unsigned int t = 0; t < taps.mCount; t++) w[t] = (float)(w[t] / sum);
+		taps.mFirst[i] = first;
+	}
+	return taps;
+}
+
+inline uint16_t ToTexel(float v) {
+	return (uint16_t)std::min(std::max(v + .5f, 0.f), 65535.f);
+}
+
+uint64_t VolumeResampler::Key() {
+	if (!sEnabled) return 0;
+	uint64_t k = 0xCBF29CE484222325ull ^ (uint64_t)(sFilter + 1);
+	for (unsigned int i = 0; i < 3; i++)
+		k = (k * 0x100000001B3ull) ^ (uint64_t)lround(sSpacing[i] * 1000.0);
+	return k;
+}
+
+double VolumeResampler::SliceSpacing(const vector<double>& positions) {
+	vector<double> d;
+	for (size_t i = 1; i < positions.size(); i++)
+		if (positions[i] > positions[i - 1])
+			d.push_back(positions[i] - positions[i - 1]);
+	if (d.empty()) return 0.0;
+	nth_element(d.begin(), d.begin() + d.size() / 2, d.end());
+	return d[d.size() / 2];
+}
+
+// Source spacing of grid, with the same fallbacks for missing values Resample uses
+dvec3 SourceSpacing(const SliceGrid& grid) {
+	double spacingX = grid.mSpacingX > 0.0 ? grid.mSpacingX : 1.0;
+	double spacingY = grid.mSpacingY > 0.0 ? grid.mSpacingY : spacingX;
+	double spacingZ = VolumeResampler::SliceSpacing(grid.mPositions);
+	if (spacingZ <= 0.0) spacingZ = std::min(spacingX, spacingY);
+	return dvec3(spacingX, spacingY, spacingZ);
+}
+
+// Continuous source index of every voxel of the resampled grid along each axis
+void SourceCoordinates(const SliceGrid& grid, const dvec3& source, vector<double>& cx, vector<double>& cy, vector<double>& cz) {
+	const vector<double>& positions = grid.mPositions;
+	unsigned int d = grid.Depth();
+	uvec3 out = grid.mResampledDimensions;
+	dvec3 spacing = grid.mResampledSpacing;
+
+	// the slab covers half a slice spacing past the first and last slice
+	double z0 = positions.front() - .5 * source.z;
+	cx.resize(out.x);
+	cy.resize(out.y);
+	cz.resize(out.z);
+	for (unsigned int i = 0; i < out.x; i++) cx[i] = (i + .5) * spacing.x / source.x - .5;
+	for (unsigned int i = 0; i < out.y; i++) cy[i] = (i + .5) * spacing.y / source.y - .5;
+	for (unsigned int i = 0; i < out.z; i++) {
+		// between the slices around it, wherever they are
+		double z = z0 + (i + .5) * spacing.z;
+		size_t j = upper_bound(positions.begin(), positions.end(), z) - positions.begin();
+		if (j == 0) cz[i] = (z - positions[0]) / source.z;
+		else if (j == d) cz[i] = (d - 1) + (z - positions[d - 1]) / source.z;
+		else {
+			double gap = positions[j] - positions[j - 1];
+			cz[i] = (j - 1) + (gap > 0.0 ? (z - positions[j - 1]) / gap : 0.0);
+		}
+	}
+}
+
+vector<uint16_t> VolumeResampler::Resample(const uint16_t* src, SliceGrid& grid, vec3& size) {
+	auto start = chrono::high_resolution_clock::now();
+	ThreadPool& pool = ThreadPool::Shared();
+	unsigned int w = grid.mWidth;
+	unsigned int h = grid.mHeight;
+	unsigned int d = grid.Depth();
+
+	dvec3 source = SourceSpacing(grid);
+	double spacingX = source.x;
+	double spacingY = source.y;
+	double spacingZ = source.z;
+
+	double finest = std::min(std::min(spacingX, spacingY), spacingZ);
+	dvec3 spacing(sSpacing.x > 0.f ? sSpacing.x : finest, sSpacing.y > 0.f ? sSpacing.y : finest, sSpacing.z > 0.f ? sSpacing.z : finest);
+
+	double extentZ = grid.mPositions.back() - grid.mPositions.front() + spacingZ;
+	unsigned int outW = std::max(1u, (unsigned int)lround(w * spacingX / spacing.x));
+	unsigned int outH = std::max(1u, (unsigned int)lround(h * spacingY / spacing.y));
+	unsigned int outD = std::max(1u, (unsigned int)lround(extentZ / spacing.z));
+	grid.mResampledDimensions = uvec3(outW, outH, outD);
+	grid.mResampledSpacing = spacing;
+
+	vector<double> cx, cy, cz;
+	SourceCoordinates(grid, source, cx, cy, cz);
+	Taps tx = BuildTaps(cx, w, sFilter, spacing.x / spacingX);
+	Taps ty = BuildTaps(cy, h, sFilter, spacing.y / spacingY);
+	Taps tz = BuildTaps(cz, d, sFilter, spacing.z / spacingZ);
+
+	// in-plane, every source slice on its own
+	size_t outSlice = (size_t)outW * outH;
+	vector<uint16_t> plane;
+	const uint16_t* planar = src;
+	if (outW != w || outH != h || spacing.x != spacingX || spacing.y != spacingY) {
+		plane.resize(outSlice * d);
+		pool.ParallelFor(0, d, [&](size_t z) {
+			const uint16_t* s = src + z * w * h;
+			vector<float> rows((size_t)outW * h);
+			for (unsigned int y = 0; y < h; y++)
+				for (unsigned int x = 0; x < outW; x++) {
+					const float* wt = tx.mWeights.data() + x * tx.mCount;
+					const uint16_t* r = s + (size_t)y * w + tx.mFirst[x];
+					float v = 0.f;
+					for (unsigned int t = 0; t < tx.mCount; t++)
+						if (wt[t] != 0.f) v += wt[t] * r[t];
+					rows[(size_t)y * outW + x] = v;
+				}
+
+			uint16_t* dst = plane.data() + z * outSlice;
+			vector<float> row(outW);
+			for (unsigned int y = 0; y < outH; y++) {
+				fill(row.begin(), row.end(), 0.f);
+				const float* wt = ty.mWeights.data() + y * ty.mCount;
+				for (unsigned int t = 0; t < ty.mCount; t++) {
+					if (wt[t] == 0.f) continue;
+					const float* r = rows.data() + (size_t)(ty.mFirst[y] + (int)t) * outW;
+					for (unsigned int x = 0; x < outW; x++)
+						row[x] += wt[t] * r[x];
+				}
+				for (unsigned int x = 0; x < outW; x++)
+					dst[(size_t)y * outW + x] = ToTexel(row[x]);
+			}
+		});
+		planar = plane.data();
+	}
+
+	// along the slice normal, every output slice blends the source slices around it
+	vector<uint16_t> out(outSlice * outD);
+	pool.ParallelFor(0, outD, [&](size_t z) {
+		vector<float> acc(outSlice, 0.f);
+		const float* wt = tz.mWeights.data() + z * tz.mCount;
+		for (unsigned int t = 0; t < tz.mCount; t++) {
+			if (wt[t] == 0.f) continue;
+			const uint16_t* s = planar + (size_t)(tz.mFirst[z] + (int)t) * outSlice;
+			for (size_t i = 0; i < outSlice; i++)
+				acc[i] += wt[t] * s[i];
+		}
+		uint16_t* dst = out.data() + z * outSlice;
+		for (size_t i = 0; i < outSlice; i++)
+			dst[i] = ToTexel(acc[i]);
+	});
+
+	size = vec3((float)(.001 * outW * spacing.x), (float)(.001 * outH * spacing.y), (float)(.001 * outD * spacing.z));
+
+	double seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+	printf("resampled %ux%ux%u to %ux%ux%u (%.3f x %.3f x %.3f mm) in %.2fs\n", w, h, d, outW, outH, outD, spacing.x, spacing.y, spacing.z, seconds);
+	return out;
+}
+
+vector<uint8_t> VolumeResampler::ResampleMask(const uint8_t* src, const SliceGrid& grid) {
+	unsigned int w = grid.mWidth;
+	unsigned int h = grid.mHeight;
+	unsigned int d = grid.Depth();
+	uvec3 out = grid.mResampledDimensions;
+
+	// labels can't be blended, every voxel takes the nearest one
+	vector<double> cx, cy, cz;
+	SourceCoordinates(grid, SourceSpacing(grid), cx, cy, cz);
+	auto nearest = [](double c, unsigned int n) { return (size_t)std::min(std::max(lround(c), 0l), (long)n - 1); };
+	vector<size_t> ix(out.x), iy(out.y);
+	for (unsigned int i = 0; i < out.x; i++) ix[i] = nearest(cx[i], w);
+	for (unsigned int i = 0; i < out.y; i++) iy[i] = nearest(cy[i], h);
+
+	vector<uint8_t> mask((size_t)out.x * out.y * out.z);
+	ThreadPool::Shared().ParallelFor(0, out.z, [&](size_t z) {
+		const uint8_t* s = src + nearest(cz[z], d) * w * h;
+		uint8_t* dst = mask.data() + z * out.x * out.y;
+		for (unsigned int y = 0; y < out.y; y++)
+			for (unsigned int x = 0; x < out.x; x++)
+				dst[(size_t)y * out.x + x] = s[iy[y] * w + ix[x]];
+	});
+	return mask;
+}
\ No newline at end of file
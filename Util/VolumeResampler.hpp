@@ -0,0 +1,40 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+#include "SliceGrid.hpp"
+
+enum ResampleFilter {
+	RESAMPLE_TRILINEAR,
+	// Lanczos-3, sharper, widened when shrinking so it doesn't alias
+	RESAMPLE_LANCZOS,
+};
+
+// Resamples a stack of slices at arbitrary positions onto a regular grid
+// Series with gaps, overlaps or slices thicker than their pixels become a volume with the same voxel size along every
+// axis, so a fixed ray marching step matches the voxels everywhere. Runs separably on the loader pool: every source
+// slice is resampled in-plane, then every output slice is filtered along the slice normal.
+class VolumeResampler {
+public:
+	// Off by default, the loader keeps the source grid then
+	static bool sEnabled;
+	static ResampleFilter sFilter;
+	// Voxel size in mm, 0 on an axis uses the finest source spacing so the default grid is isotropic
+	static glm::vec3 sSpacing;
+
+	// Mixed into the volume cache key, so changing the settings doesn't load a stale cache
+	static uint64_t Key();
+
+	// Slice spacing of a series, the median distance between neighbouring positions
+	static double SliceSpacing(const std::vector<double>& positions);
+
+	// src holds the slices of grid. Returns the resampled volume, its dimensions and voxel size are recorded in grid and
+	// size is the new physical size in meters.
+	static std::vector<uint16_t> Resample(const uint16_t* src, SliceGrid& grid, glm::vec3& size);
+	// Moves a mask drawn on the slices of grid (8 bits per voxel) onto the grid Resample put the volume on, every voxel
+	// takes the label of the nearest source voxel at the place the volume's filter is centred
+	static std::vector<uint8_t> ResampleMask(const uint8_t* src, const SliceGrid& grid);
+};
\ No newline at end of file
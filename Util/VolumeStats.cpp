@@ -0,0 +1,71 @@
+#include "VolumeStats.hpp"
+
+#include <algorithm>
+#include <mutex>
+
+#include "ThreadPool.hpp"
+
+using namespace std;
+
+// voxels per task of the reductions
+#define STATS_CHUNK (1 << 20)
+
+float VolumeStats::Percentile(float p) const {
+	if (mHistogram.empty()) return mMin + (mMax - mMin) * p;
+
+	uint64_t total = 0;
+	for (uint32_t c : mHistogram) total += c;
+	uint64_t target = (uint64_t)(std::min(std::max(p, 0.f), 1.f) * total);
+
+	uint64_t sum = 0;
+	for (size_t i = 0; i < mHistogram.size(); i++) {
+		sum += mHistogram[i];
+		if (sum > target) return mMin + (mMax - mMin) * (i + .5f) / mHistogram.size();
+	}
+	return mMax;
+}
+
+VolumeStats VolumeStats::Compute(const uint16_t* data, size_t count, unsigned int channels, float valueScale, float valueOffset) {
+	ThreadPool& pool = ThreadPool::Shared();
+	size_t chunks = (count + STATS_CHUNK - 1) / STATS_CHUNK;
+	mutex m;
+
+	// global range of the stored texels
+	uint16_t lo = 0xFFFF;
+	uint16_t hi = 0;
+	pool.ParallelFor(0, chunks, [&](size_t c) {
+		size_t end = std::min(count, (c + 1) * STATS_CHUNK);
+		uint16_t l = 0xFFFF;
+		uint16_t h = 0;
+		for (size_t i = c * STATS_CHUNK; i < end; i++) {
+			uint16_t v = data[i * channels];
+			l = std::min(l, v);
+			h = std::max(h, v);
+		}
+		lock_guard<mutex> lock(m);
+		lo = std::min(lo, l);
+		hi = std::max(hi, h);
+	});
+	if (count == 0) lo = hi = 0;
+
+	// histogram over that range, every task fills its own and merges it at the end
+	vector<uint32_t> histogram(VOLUME_HISTOGRAM_BINS);
+	uint32_t range = (uint32_t)(hi - lo) + 1;
+	pool.ParallelFor(0, chunks, [&](size_t c) {
+		size_t end = std::min(count, (c + 1) * STATS_CHUNK);
+		vector<uint32_t> local(VOLUME_HISTOGRAM_BINS);
+		for (size_t i = c * STATS_CHUNK; i < end; i++)
+			local[(uint64_t)(data[i * channels] - lo) * VOLUME_HISTOGRAM_BINS / range]++;
+		lock_guard<mutex> lock(m);
+		for (unsigned int b = 0; b < VOLUME_HISTOGRAM_BINS; b++)
+			histogram[b] += local[b];
+	});
+
+	VolumeStats stats;
+	stats.mValueScale = valueScale;
+	stats.mValueOffset = valueOffset;
+	stats.mMin = stats.ToValue(lo / 65535.f);
+	stats.mMax = stats.ToValue(hi / 65535.f);
+	stats.mHistogram.swap(histogram);
+	return stats;
+}
\ No newline at end of file
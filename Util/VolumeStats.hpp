@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#define VOLUME_HISTOGRAM_BINS 4096
+
+// Intensity statistics of a volume, in modality units (Hounsfield units for CT)
+// Texels hold modality values linearly, value = texel * mValueScale + mValueOffset with texel in [0, 1],
+// so thresholds and windows can be given in real units and turned into texel values for the shaders.
+struct VolumeStats {
+	float mValueScale;
+	float mValueOffset;
+	float mMin;
+	float mMax;
+	// VOLUME_HISTOGRAM_BINS bins spanning [mMin, mMax], empty if the statistics weren't computed
+	std::vector<uint32_t> mHistogram;
+
+	VolumeStats() : mValueScale(1.f), mValueOffset(0.f), mMin(0.f), mMax(1.f) {}
+
+	inline float ToValue(float texel) const { return texel * mValueScale + mValueOffset; }
+	inline float ToTexel(float value) const { return mValueScale != 0.f ? (value - mValueOffset) / mValueScale : 0.f; }
+
+	// Value below which a fraction p of the voxels lie
+	float Percentile(float p) const;
+
+	// Parallel min/max and histogram over the first channel of a 16 bit volume
+	static VolumeStats Compute(const uint16_t* data, size_t count, unsigned int channels, float valueScale, float valueOffset);
+};
\ No newline at end of file